@@ -3,6 +3,7 @@
 
 #include "util.h"
 #include "token.h"
+#include "stats.h"
 
 enum class NodeType {
 	PRINT_STMT = 0,
@@ -12,8 +13,14 @@ enum class NodeType {
 	IF_STMT,
 	WHILE_STMT,
 	FOR_STMT,
+	RANGE_FOR_STMT,
+	FOR_IN_STMT,
 	BREAK_STMT,
 	CONTINUE_STMT,
+	FN_DECL_STMT,
+	RETURN_STMT,
+	IMPORT_STMT,
+	SNAPSHOT_STMT,
 	ASSIGN_EXPR,
 	IF_EXPR,
 	LOGIC_EXPR,
@@ -21,11 +28,37 @@ enum class NodeType {
 	GROUP_EXPR,
 	UNARY_EXPR,
 	VAR_EXPR,
-	LITERAL_EXPR
+	LITERAL_EXPR,
+	CALL_EXPR,
+	REDUCED_EXPR,
+	CSE_DEF_EXPR,
+	CSE_USE_EXPR,
+	SPAWN_EXPR,
+	MAP_EXPR
+};
+
+// How a statement finished; break, continue and return unwind through these
+enum class Flow { NORMAL, BREAK, CONTINUE, RETURN };
+
+class Tier; // In tiers.h, like FreeTier
+void FreeTier(Tier* tier);
+
+// How often a loop body or block has run, until it's hot enough to be
+// compiled. Only counted while one thread runs the program.
+struct Hotness {
+	u32 count = 0;
+	Tier* tier = 0; // Its compiled form, once it has one
+	bool cold = false; // It can't be compiled, so it's no longer counted
+	Hotness() {}
+	Hotness(const Hotness&) = delete;
+	~Hotness() { if (tier) FreeTier(tier); }
 };
 
 class Expr {
 public:
+	i8 value_type = TYPE_UNKNOWN; // Set by TypeInference when it can prove one
+	Expr() { stats.ast_nodes++; }
+	virtual ~Expr() {}
 	virtual NodeType Type() = 0;
 	virtual std::string Str() = 0;
 	virtual Object Evaluate() = 0;
@@ -34,9 +67,11 @@ public:
 
 class Stmt {
 public:
+	Stmt() { stats.ast_nodes++; }
+	virtual ~Stmt() {}
 	virtual NodeType Type() = 0;
 	virtual std::string Str() = 0;
-	virtual void Evaluate() = 0;
+	virtual Flow Evaluate() = 0;
 	virtual void Destroy() = 0;
 };
 
@@ -53,12 +88,14 @@ public:
 	std::string Str() {
 		return "(print " + (expr ? expr->Str() : "") + ")";
 	}
-	void Evaluate();
+	Flow Evaluate();
 };
 
 class BlockStmt : public Stmt {
 public:
 	std::vector<Stmt*> statements;
+	bool scoped = true; // False inside functions, where locals live in the frame
+	Hotness hot;
 	BlockStmt(const std::vector<Stmt*>& statements) : statements(statements) {}
 	NodeType Type() { return NodeType::BLOCK_STMT; }
 	void Destroy() {
@@ -74,7 +111,7 @@ public:
 		result += ")";
 		return result;
 	}
-	void Evaluate();
+	Flow Evaluate();
 };
 
 class ExprStmt : public Stmt {
@@ -90,13 +127,14 @@ public:
 	std::string Str() {
 		return "(exprStatement " + (expr ? expr->Str() : "") + ")";
 	}
-	void Evaluate();
+	Flow Evaluate();
 };
 
 class VarDeclStmt : public Stmt {
 public:
 	Token identifier;
 	Expr* expr = 0;
+	i32 slot = -1; // Frame slot of a function local, -1 for Environment variables
 	VarDeclStmt(Token identifier, Expr* expr) : identifier(identifier), expr(expr) {}
 	NodeType Type() { return NodeType::VAR_DECL_STMT; }
 	void Destroy() {
@@ -107,7 +145,7 @@ public:
 	std::string Str() {
 		return "(decl " + identifier.lexeme + " " + (expr ? expr->Str() : "") + ")";
 	}
-	void Evaluate();
+	Flow Evaluate();
 };
 
 class IfStmt : public Stmt {
@@ -126,13 +164,14 @@ public:
 	std::string Str() {
 		return "(if " + condition->Str() + " " + then_branch->Str() + (else_branch ? " " + else_branch->Str() : "") + ")";
 	}
-	void Evaluate();
+	Flow Evaluate();
 };
 
 class WhileStmt : public Stmt {
 public:
 	Expr* condition = 0;
 	Stmt* statement = 0;
+	Hotness hot;
 	WhileStmt(Expr* condition, Stmt* statement)
 		: condition(condition), statement(statement) {}
 	NodeType Type() { return NodeType::WHILE_STMT; }
@@ -143,7 +182,7 @@ public:
 	std::string Str() {
 		return "(while " + condition->Str() + " " + statement->Str() + ")";
 	}
-	void Evaluate();
+	Flow Evaluate();
 };
 
 class ForStmt : public Stmt {
@@ -152,6 +191,15 @@ public:
 	Expr* condition = 0;
 	Expr* increment = 0;
 	Stmt* body = 0;
+	bool scoped = true;
+	// Filled in by DetectCountedLoop when the loop can run on a native counter
+	bool counted = false;
+	Token counter;
+	TokenType compare = TokenType::LESS;
+	Expr* limit = 0; // Part of condition, not owned
+	float step = 1;
+	bool floor_step = false; // '++' floors before adding
+	Hotness hot;
 	ForStmt(Stmt* initializer, Expr* condition, Expr* increment, Stmt* body)
 		: initializer(initializer), condition(condition), increment(increment), body(body) {}
 	NodeType Type() { return NodeType::FOR_STMT; }
@@ -167,7 +215,75 @@ public:
 			(condition ? condition->Str() : ";") + " " +
 			(increment ? increment->Str() : ";") + ")";
 	}
-	void Evaluate();
+	Flow Evaluate();
+	Flow EvaluateLoop();
+};
+
+// A variable a parallel loop combines from its iterations
+struct Reduction {
+	enum Op { SUM, PRODUCT, MIN, MAX };
+	Op op;
+	Token name;
+	static const char* OpName(Op op) {
+		switch (op) {
+		case SUM: return "sum";
+		case PRODUCT: return "product";
+		case MIN: return "min";
+		default: return "max";
+		}
+	}
+};
+
+// for (identifier in start..end step step), with 'end' exclusive
+class RangeForStmt : public Stmt {
+public:
+	Token identifier;
+	Expr* start = 0;
+	Expr* end = 0;
+	Expr* step = 0;
+	Stmt* body = 0;
+	i32 slot = -1;
+	bool parallel = false; // 'parallel for', run by parallel.h
+	std::vector<Reduction> reductions;
+	Hotness hot;
+	RangeForStmt(Token identifier, Expr* start, Expr* end, Expr* step, Stmt* body)
+		: identifier(identifier), start(start), end(end), step(step), body(body) {}
+	NodeType Type() { return NodeType::RANGE_FOR_STMT; }
+	void Destroy() {
+		if (start) { start->Destroy(); delete start; }
+		if (end) { end->Destroy(); delete end; }
+		if (step) { step->Destroy(); delete step; }
+		if (body) { body->Destroy(); delete body; }
+	}
+	std::string Str() {
+		std::string reduce;
+		for (const Reduction& r : reductions)
+			reduce += std::string(" (") + Reduction::OpName(r.op) + " " + r.name.lexeme + ")";
+		return std::string(parallel ? "(parallel-for " : "(for ") + identifier.lexeme + " " + start->Str() + " " + end->Str() +
+			(step ? " " + step->Str() : "") + reduce + " " + body->Str() + ")";
+	}
+	Flow Evaluate();
+	Flow EvaluateParallel(float from, float to, float step);
+};
+
+// for (identifier in map), over its keys in insertion order
+class ForInStmt : public Stmt {
+public:
+	Token identifier;
+	Expr* collection = 0;
+	Stmt* body = 0;
+	i32 slot = -1;
+	ForInStmt(Token identifier, Expr* collection, Stmt* body)
+		: identifier(identifier), collection(collection), body(body) {}
+	NodeType Type() { return NodeType::FOR_IN_STMT; }
+	void Destroy() {
+		if (collection) { collection->Destroy(); delete collection; }
+		if (body) { body->Destroy(); delete body; }
+	}
+	std::string Str() {
+		return "(for-in " + identifier.lexeme + " " + collection->Str() + " " + body->Str() + ")";
+	}
+	Flow Evaluate();
 };
 
 class BreakStmt : public Stmt {
@@ -175,7 +291,7 @@ public:
 	NodeType Type() { return NodeType::BREAK_STMT; }
 	void Destroy() {}
 	std::string Str() { return "(break)"; }
-	void Evaluate();
+	Flow Evaluate();
 };
 
 class ContinueStmt : public Stmt {
@@ -183,13 +299,93 @@ public:
 	NodeType Type() { return NodeType::CONTINUE_STMT; }
 	void Destroy() {}
 	std::string Str() { return "(continue)"; }
-	void Evaluate();
+	Flow Evaluate();
+};
+
+class FnDeclStmt : public Stmt {
+public:
+	Token name;
+	Ref<Function> function;
+	i32 slot = -1; // Set when declared inside another function
+	FnDeclStmt(Token name, Function* function, i32 slot)
+		: name(name), function(function), slot(slot) {}
+	NodeType Type() { return NodeType::FN_DECL_STMT; }
+	// Values created from this declaration keep the function alive
+	void Destroy() {
+		function = Ref<Function>();
+	}
+	std::string Str() {
+		std::string result = (function->memo ? "(memo-fn " : "(fn ") + name.lexeme + " (";
+		for (u32 i = 0; i < function->params.size(); i++)
+			result += (i ? " " : "") + function->params[i];
+		result += ")";
+		for (Stmt* stmt : function->body)
+			result += " " + stmt->Str();
+		return result + ")";
+	}
+	Flow Evaluate();
+};
+
+Function::~Function() {
+	if (memo) FreeMemoTable(memo);
+	for (Stmt* stmt : body) {
+		stmt->Destroy();
+		delete stmt;
+	}
+}
+
+class ReturnStmt : public Stmt {
+public:
+	Token keyword;
+	Expr* value = 0;
+	bool tail = false; // 'return f(...);', run without growing the stack
+	ReturnStmt(Token keyword, Expr* value, bool tail) : keyword(keyword), value(value), tail(tail) {}
+	NodeType Type() { return NodeType::RETURN_STMT; }
+	void Destroy() {
+		if (value == 0) return;
+		value->Destroy();
+		delete value;
+	}
+	std::string Str() {
+		return "(return" + (value ? " " + value->Str() : "") + ")";
+	}
+	Flow Evaluate();
+};
+
+// import "path"; runs a module (modules.h) in the importer's globals
+class ImportStmt : public Stmt {
+public:
+	Token keyword;
+	std::string name; // As written
+	std::string path; // Relative to the importing file's directory
+	ImportStmt(Token keyword, std::string name, std::string path)
+		: keyword(keyword), name(std::move(name)), path(std::move(path)) {}
+	NodeType Type() { return NodeType::IMPORT_STMT; }
+	void Destroy() {}
+	std::string Str() {
+		return "(import \"" + name + "\")";
+	}
+	Flow Evaluate();
+};
+
+// snapshot; where --snapshot saves the program (snapshot.h)
+class SnapshotStmt : public Stmt {
+public:
+	Token keyword;
+	SnapshotStmt(Token keyword) : keyword(keyword) {}
+	NodeType Type() { return NodeType::SNAPSHOT_STMT; }
+	void Destroy() {}
+	std::string Str() {
+		return "(snapshot)";
+	}
+	Flow Evaluate();
 };
 
 class AssignExpr : public Expr {
 public:
 	Token identifier;
 	Expr* expr = 0;
+	i32 slot = -1;
 	AssignExpr(Token identifier, Expr* expr) : identifier(identifier), expr(expr) {}
 	NodeType Type() { return NodeType::ASSIGN_EXPR; }
 	void Destroy() {
@@ -245,6 +441,7 @@ public:
 	Token op;
 	Expr* left = 0;
 	Expr* right = 0;
+	bool numeric = false; // Both operands proven numbers, so no operand checks
 	BinaryExpr(Token op, Expr* left, Expr* right) : op(op), left(left), right(right) {}
 	NodeType Type() { return NodeType::BINARY_EXPR; }
 	void Destroy() {
@@ -278,6 +475,7 @@ public:
 	Token op;
 	Expr* expr = 0;
 	bool postfix = false;
+	bool numeric = false; // Operand proven a number
 	UnaryExpr(Token op, Expr* expr, bool postfix = false)
 		: op(op), expr(expr), postfix(postfix) {}
 	NodeType Type() { return NodeType::UNARY_EXPR; }
@@ -295,6 +493,7 @@ public:
 class VarExpr : public Expr {
 public:
 	Token identifier;
+	i32 slot = -1;
 	VarExpr(Token identifier) : identifier(identifier) {}
 	NodeType Type() { return NodeType::VAR_EXPR; }
 	void Destroy() {}
@@ -304,6 +503,45 @@ public:
 	Object Evaluate();
 };
 
+// A built-in function, which every new set of globals defines. Modules
+// list theirs in a table, and builtins.h collects the tables.
+struct Builtin {
+	const char* name;
+	u32 arity;
+	NativeFn fn;
+	i8 type = TYPE_UNKNOWN; // Of every value it gives back, if known
+	bool pure = false; // Touches nothing but its arguments, so 'memo' functions can call it
+};
+const Builtin* FindBuiltin(const std::string& name); // In builtins.h
+
+class CallExpr : public Expr {
+public:
+	Expr* callee = 0;
+	Token paren;
+	std::vector<Expr*> arguments;
+	// Set by TypeInference when the callee is a built-in nothing can have
+	// replaced, which is then called without looking it up
+	const Builtin* builtin = 0;
+	CallExpr(Expr* callee, Token paren, const std::vector<Expr*>& arguments)
+		: callee(callee), paren(paren), arguments(arguments) {}
+	NodeType Type() { return NodeType::CALL_EXPR; }
+	void Destroy() {
+		if (callee) { callee->Destroy(); delete callee; }
+		for (Expr* arg : arguments) {
+			arg->Destroy();
+			delete arg;
+		}
+	}
+	std::string Str() {
+		std::string result = "(call " + callee->Str();
+		for (Expr* arg : arguments)
+			result += " " + arg->Str();
+		return result + ")";
+	}
+	Object Evaluate();
+	void EvaluateTail();
+};
+
 class LiteralExpr : public Expr {
 public:
 	Object value;
@@ -315,4 +553,110 @@ public:
 	}
 	Object Evaluate();
 };
+
+// Cheaper form of a number operator with a constant right operand, made by
+// the Simplifier. The operand is always proven a number.
+class ReducedExpr : public Expr {
+public:
+	enum Kind {
+		POWER, // expr ** constant, for a small integer constant
+		SCALE, // expr / c as expr * constant, where constant = 1 / c exactly
+		MASK // expr % constant, for a power of two constant
+	};
+	Kind kind;
+	Expr* expr = 0;
+	float constant;
+	ReducedExpr(Kind kind, Expr* expr, float constant) : kind(kind), expr(expr), constant(constant) {}
+	NodeType Type() { return NodeType::REDUCED_EXPR; }
+	void Destroy() {
+		if (expr == 0) return;
+		expr->Destroy();
+		delete expr;
+	}
+	std::string Str() {
+		static const char* names[] = { "power", "scale", "mask" };
+		return "(" + std::string(names[kind]) + " " + expr->Str() + " " + NumberToStr(constant) + ")";
+	}
+	Object Evaluate();
+};
+
+// Common subexpression elimination: the first occurrence stores its value
+// in cse_temps[temp] and the later ones in the same statement read it back
+class CseDefExpr : public Expr {
+public:
+	Expr* expr = 0;
+	u32 temp;
+	CseDefExpr(Expr* expr, u32 temp) : expr(expr), temp(temp) {}
+	NodeType Type() { return NodeType::CSE_DEF_EXPR; }
+	void Destroy() {
+		if (expr == 0) return;
+		expr->Destroy();
+		delete expr;
+	}
+	std::string Str() {
+		return "(let t" + std::to_string(temp) + " " + expr->Str() + ")";
+	}
+	Object Evaluate();
+};
+
+class CseUseExpr : public Expr {
+public:
+	u32 temp;
+	CseUseExpr(u32 temp) : temp(temp) {}
+	NodeType Type() { return NodeType::CSE_USE_EXPR; }
+	void Destroy() {}
+	std::string Str() {
+		return "t" + std::to_string(temp);
+	}
+	Object Evaluate();
+};
+
+// 'spawn f(x)' or 'spawn { ... }': runs the call or block as a task (tasks.h)
+// and evaluates to a handle that join() waits on
+class SpawnExpr : public Expr {
+public:
+	Token keyword;
+	CallExpr* call = 0;
+	BlockStmt* block = 0;
+	Ref<Function> owner; // Owns 'block', so a task still running it keeps it alive
+	SpawnExpr(Token keyword, CallExpr* call, BlockStmt* block) : keyword(keyword), call(call), block(block) {
+		if (block)
+			owner = heap.New<Function>("spawn", std::vector<std::string>(), std::vector<Stmt*>{block}, 0);
+	}
+	NodeType Type() { return NodeType::SPAWN_EXPR; }
+	void Destroy() {
+		if (call) { call->Destroy(); delete call; }
+		owner = Ref<Function>();
+	}
+	std::string Str() {
+		return "(spawn " + (call ? call->Str() : block->Str()) + ")";
+	}
+	Object Evaluate();
+};
+
+// {key: value, ...}, evaluated to a new map each time
+class MapExpr : public Expr {
+public:
+	Token brace;
+	std::vector<Expr*> keys;
+	std::vector<Expr*> values;
+	MapExpr(Token brace, const std::vector<Expr*>& keys, const std::vector<Expr*>& values)
+		: brace(brace), keys(keys), values(values) {}
+	NodeType Type() { return NodeType::MAP_EXPR; }
+	void Destroy() {
+		for (u32 i = 0; i < keys.size(); i++) {
+			keys[i]->Destroy();
+			delete keys[i];
+			values[i]->Destroy();
+			delete values[i];
+		}
+	}
+	std::string Str() {
+		std::string result = "(map";
+		for (u32 i = 0; i < keys.size(); i++)
+			result += " " + keys[i]->Str() + " " + values[i]->Str();
+		return result + ")";
+	}
+	Object Evaluate();
+};
 #endif
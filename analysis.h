@@ -0,0 +1,318 @@
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+#include "util.h"
+#include "AST.h"
+#include <functional>
+
+/*
+Static checks over the AST, run by the parser once a node is complete.
+Anything a check doesn't recognize is treated as the worst case, so new
+node types are safe by default.
+*/
+
+// True unless 'expr' provably never assigns to a variable in 'names'
+bool MayWrite(Expr* expr, const std::vector<std::string>& names);
+// True unless 'stmt' provably never assigns to or redeclares a variable in 'names'
+bool MayWrite(Stmt* stmt, const std::vector<std::string>& names);
+
+bool IsOneOf(const std::string& name, const std::vector<std::string>& names) {
+	for (const std::string& n : names)
+		if (n == name) return true;
+	return false;
+}
+
+bool MayWrite(Expr* expr, const std::vector<std::string>& names) {
+	if (!expr) return false;
+	switch (expr->Type()) {
+	case NodeType::ASSIGN_EXPR: {
+		AssignExpr* e = (AssignExpr*)expr;
+		return IsOneOf(e->identifier.lexeme, names) || MayWrite(e->expr, names);
+	}
+	case NodeType::IF_EXPR: {
+		IfExpr* e = (IfExpr*)expr;
+		return MayWrite(e->condition, names) || MayWrite(e->then_branch, names) || MayWrite(e->else_branch, names);
+	}
+	case NodeType::LOGIC_EXPR:
+		return MayWrite(((LogicExpr*)expr)->left, names) || MayWrite(((LogicExpr*)expr)->right, names);
+	case NodeType::BINARY_EXPR:
+		return MayWrite(((BinaryExpr*)expr)->left, names) || MayWrite(((BinaryExpr*)expr)->right, names);
+	case NodeType::GROUP_EXPR:
+		return MayWrite(((GroupExpr*)expr)->expr, names);
+	case NodeType::UNARY_EXPR: {
+		UnaryExpr* e = (UnaryExpr*)expr;
+		if (e->op.type == TokenType::PLUS_PLUS || e->op.type == TokenType::MINUS_MINUS) {
+			if (e->expr->Type() != NodeType::VAR_EXPR) return true;
+			if (IsOneOf(((VarExpr*)e->expr)->identifier.lexeme, names)) return true;
+		}
+		return MayWrite(e->expr, names);
+	}
+	case NodeType::REDUCED_EXPR:
+		return MayWrite(((ReducedExpr*)expr)->expr, names);
+	case NodeType::CSE_DEF_EXPR:
+		return MayWrite(((CseDefExpr*)expr)->expr, names);
+	case NodeType::VAR_EXPR:
+	case NodeType::LITERAL_EXPR:
+	case NodeType::CSE_USE_EXPR:
+		return false;
+	default:
+		return true;
+	}
+}
+
+bool MayWrite(Stmt* stmt, const std::vector<std::string>& names) {
+	if (!stmt) return false;
+	switch (stmt->Type()) {
+	case NodeType::PRINT_STMT:
+		return MayWrite(((PrintStmt*)stmt)->expr, names);
+	case NodeType::EXPR_STMT:
+		return MayWrite(((ExprStmt*)stmt)->expr, names);
+	case NodeType::BLOCK_STMT:
+		for (Stmt* s : ((BlockStmt*)stmt)->statements)
+			if (MayWrite(s, names)) return true;
+		return false;
+	case NodeType::VAR_DECL_STMT: {
+		VarDeclStmt* s = (VarDeclStmt*)stmt;
+		return IsOneOf(s->identifier.lexeme, names) || MayWrite(s->expr, names);
+	}
+	case NodeType::IF_STMT: {
+		IfStmt* s = (IfStmt*)stmt;
+		return MayWrite(s->condition, names) || MayWrite(s->then_branch, names) || MayWrite(s->else_branch, names);
+	}
+	case NodeType::WHILE_STMT:
+		return MayWrite(((WhileStmt*)stmt)->condition, names) || MayWrite(((WhileStmt*)stmt)->statement, names);
+	case NodeType::FOR_STMT: {
+		ForStmt* s = (ForStmt*)stmt;
+		return MayWrite(s->initializer, names) || MayWrite(s->condition, names) ||
+			MayWrite(s->increment, names) || MayWrite(s->body, names);
+	}
+	case NodeType::RANGE_FOR_STMT: {
+		RangeForStmt* s = (RangeForStmt*)stmt;
+		return IsOneOf(s->identifier.lexeme, names) || MayWrite(s->start, names) ||
+			MayWrite(s->end, names) || MayWrite(s->step, names) || MayWrite(s->body, names);
+	}
+	case NodeType::BREAK_STMT:
+	case NodeType::CONTINUE_STMT:
+		return false;
+	default:
+		return true;
+	}
+}
+
+// Finds the first thing in a function body that could make its result depend
+// on more than its arguments, or give it an effect other than its result:
+// printing, spawning, declaring functions, writing a global or using one
+// that 'can_use' turns down. Globals are the names with slot -1.
+class PurityCheck {
+public:
+	std::function<bool(const std::string&)> can_use;
+	std::string problem; // What the body does, as in "prints"; empty if nothing
+	u16 line = 0; // Where, if known
+	bool Pure(const std::vector<Stmt*>& body) {
+		for (Stmt* stmt : body)
+			Check(stmt);
+		return problem.empty();
+	}
+private:
+	void Fail(const std::string& what, u16 at = 0) {
+		if (!problem.empty()) return;
+		problem = what;
+		line = at;
+	}
+	void UseGlobal(const Token& name) {
+		if (!can_use(name.lexeme))
+			Fail("uses '" + name.lexeme + "', which isn't a memo function or a built-in that touches nothing but its arguments", name.line);
+	}
+	void Check(Expr* expr) {
+		if (!expr) return;
+		switch (expr->Type()) {
+		case NodeType::ASSIGN_EXPR: {
+			AssignExpr* e = (AssignExpr*)expr;
+			if (e->slot < 0) Fail("assigns to the global '" + e->identifier.lexeme + "'", e->identifier.line);
+			Check(e->expr);
+			break;
+		}
+		case NodeType::IF_EXPR:
+			Check(((IfExpr*)expr)->condition);
+			Check(((IfExpr*)expr)->then_branch);
+			Check(((IfExpr*)expr)->else_branch);
+			break;
+		case NodeType::LOGIC_EXPR:
+			Check(((LogicExpr*)expr)->left);
+			Check(((LogicExpr*)expr)->right);
+			break;
+		case NodeType::BINARY_EXPR:
+			Check(((BinaryExpr*)expr)->left);
+			Check(((BinaryExpr*)expr)->right);
+			break;
+		case NodeType::GROUP_EXPR:
+			Check(((GroupExpr*)expr)->expr);
+			break;
+		case NodeType::UNARY_EXPR: {
+			UnaryExpr* e = (UnaryExpr*)expr;
+			bool step = e->op.type == TokenType::PLUS_PLUS || e->op.type == TokenType::MINUS_MINUS;
+			if (step && e->expr->Type() == NodeType::VAR_EXPR && ((VarExpr*)e->expr)->slot < 0)
+				Fail("assigns to the global '" + ((VarExpr*)e->expr)->identifier.lexeme + "'", e->op.line);
+			Check(e->expr);
+			break;
+		}
+		case NodeType::VAR_EXPR:
+			if (((VarExpr*)expr)->slot < 0) UseGlobal(((VarExpr*)expr)->identifier);
+			break;
+		case NodeType::CALL_EXPR: {
+			CallExpr* e = (CallExpr*)expr;
+			Check(e->callee);
+			for (Expr* arg : e->arguments)
+				Check(arg);
+			break;
+		}
+		case NodeType::MAP_EXPR:
+			for (Expr* key : ((MapExpr*)expr)->keys)
+				Check(key);
+			for (Expr* value : ((MapExpr*)expr)->values)
+				Check(value);
+			break;
+		case NodeType::LITERAL_EXPR:
+			break;
+		case NodeType::SPAWN_EXPR:
+			Fail("spawns a task", ((SpawnExpr*)expr)->keyword.line);
+			break;
+		default:
+			Fail("does something that can't be checked");
+			break;
+		}
+	}
+	void Check(Stmt* stmt) {
+		if (!stmt) return;
+		switch (stmt->Type()) {
+		case NodeType::PRINT_STMT:
+			Fail("prints");
+			break;
+		case NodeType::EXPR_STMT:
+			Check(((ExprStmt*)stmt)->expr);
+			break;
+		case NodeType::BLOCK_STMT:
+			for (Stmt* s : ((BlockStmt*)stmt)->statements)
+				Check(s);
+			break;
+		case NodeType::VAR_DECL_STMT:
+			Check(((VarDeclStmt*)stmt)->expr);
+			break;
+		case NodeType::IF_STMT:
+			Check(((IfStmt*)stmt)->condition);
+			Check(((IfStmt*)stmt)->then_branch);
+			Check(((IfStmt*)stmt)->else_branch);
+			break;
+		case NodeType::WHILE_STMT:
+			Check(((WhileStmt*)stmt)->condition);
+			Check(((WhileStmt*)stmt)->statement);
+			break;
+		case NodeType::FOR_STMT: {
+			ForStmt* s = (ForStmt*)stmt;
+			Check(s->initializer);
+			Check(s->condition);
+			Check(s->increment);
+			Check(s->body);
+			break;
+		}
+		case NodeType::RANGE_FOR_STMT: {
+			RangeForStmt* s = (RangeForStmt*)stmt;
+			Check(s->start);
+			Check(s->end);
+			Check(s->step);
+			Check(s->body);
+			break;
+		}
+		case NodeType::FOR_IN_STMT:
+			Check(((ForInStmt*)stmt)->collection);
+			Check(((ForInStmt*)stmt)->body);
+			break;
+		case NodeType::RETURN_STMT:
+			Check(((ReturnStmt*)stmt)->value);
+			break;
+		case NodeType::BREAK_STMT:
+		case NodeType::CONTINUE_STMT:
+			break;
+		case NodeType::FN_DECL_STMT:
+			Fail("declares a function", ((FnDeclStmt*)stmt)->name.line);
+			break;
+		default:
+			Fail("does something that can't be checked");
+			break;
+		}
+	}
+};
+
+Expr* Ungroup(Expr* expr) {
+	while (expr && expr->Type() == NodeType::GROUP_EXPR)
+		expr = ((GroupExpr*)expr)->expr;
+	return expr;
+}
+bool IsVar(Expr* expr, const std::string& name) {
+	expr = Ungroup(expr);
+	return expr && expr->Type() == NodeType::VAR_EXPR && ((VarExpr*)expr)->identifier.lexeme == name;
+}
+bool IsNumberLiteral(Expr* expr) {
+	expr = Ungroup(expr);
+	return expr && expr->Type() == NodeType::LITERAL_EXPR && ((LiteralExpr*)expr)->value.index() == TYPE_NUMBER;
+}
+
+// Recognizes 'for (var i = ...; i < n; i++)' where 'n' is a number literal or
+// a variable, the increment is 'i++', '++i' or 'i = i + <number>', and the
+// body provably changes neither 'i' nor 'n'
+void DetectCountedLoop(ForStmt* loop) {
+	if (!loop->initializer || loop->initializer->Type() != NodeType::VAR_DECL_STMT) return;
+	const Token& counter = ((VarDeclStmt*)loop->initializer)->identifier;
+	const std::string& name = counter.lexeme;
+
+	Expr* condition = Ungroup(loop->condition);
+	if (!condition || condition->Type() != NodeType::BINARY_EXPR) return;
+	BinaryExpr* compare = (BinaryExpr*)condition;
+	switch (compare->op.type) {
+	case TokenType::LESS: case TokenType::LESS_EQUAL:
+	case TokenType::GREATER: case TokenType::GREATER_EQUAL:
+		break;
+	default:
+		return;
+	}
+	if (!IsVar(compare->left, name)) return;
+	Expr* limit = Ungroup(compare->right);
+	std::vector<std::string> names = { name };
+	if (limit->Type() == NodeType::VAR_EXPR) {
+		if (IsVar(limit, name)) return;
+		names.push_back(((VarExpr*)limit)->identifier.lexeme);
+	}
+	else if (!IsNumberLiteral(limit))
+		return;
+
+	Expr* increment = Ungroup(loop->increment);
+	if (!increment) return;
+	float step = 1;
+	bool floor_step = false;
+	if (increment->Type() == NodeType::UNARY_EXPR) {
+		UnaryExpr* e = (UnaryExpr*)increment;
+		if (e->op.type != TokenType::PLUS_PLUS || !IsVar(e->expr, name)) return;
+		floor_step = true;
+	}
+	else if (increment->Type() == NodeType::ASSIGN_EXPR) {
+		AssignExpr* e = (AssignExpr*)increment;
+		Expr* value = Ungroup(e->expr);
+		if (e->identifier.lexeme != name || value->Type() != NodeType::BINARY_EXPR) return;
+		BinaryExpr* sum = (BinaryExpr*)value;
+		if (sum->op.type != TokenType::PLUS || !IsVar(sum->left, name) || !IsNumberLiteral(sum->right)) return;
+		step = std::get<TYPE_NUMBER>(((LiteralExpr*)Ungroup(sum->right))->value);
+	}
+	else
+		return;
+
+	if (MayWrite(loop->body, names)) return;
+
+	loop->counted = true;
+	loop->counter = counter;
+	loop->compare = compare->op.type;
+	loop->limit = limit;
+	loop->step = step;
+	loop->floor_step = floor_step;
+}
+
+#endif
@@ -0,0 +1,65 @@
+// Per-run cost of the library API (bomac.h): a compiled program run again
+// and again, on one thread and on all of them, against compiling it for
+// every run. Built with bomac.cpp and run by bench/run.sh.
+
+#include "../bomac.h"
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+const char* SOURCE = "var total = 0;\n"
+	"for (i in 0..n) total = total + i * scale;\n"
+	"print name;\n"
+	"print total;\n";
+
+std::unordered_map<std::string, bomac::Value> Inputs(int i) {
+	return {{"n", 10.0f}, {"scale", (float)(i % 7)}, {"name", std::string("request")}};
+}
+
+double Seconds(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main() {
+	const int RUNS = 200000;
+	std::shared_ptr<const bomac::Program> program = bomac::Program::Compile(SOURCE);
+	if (!program->Ok()) {
+		printf("%s", program->Errors().c_str());
+		return 1;
+	}
+	bomac::RunResult check = program->Run(Inputs(3));
+	if (!check.ok || check.output != "request\n135\n") {
+		printf("unexpected result: %s%s\n", check.output.c_str(), check.error.c_str());
+		return 1;
+	}
+
+	printf("%-28s %8s %12s %12s\n", "embedded runs", "threads", "ns/run", "runs/s");
+	auto start = std::chrono::steady_clock::now();
+	size_t bytes = 0;
+	for (int i = 0; i < RUNS; i++)
+		bytes += program->Run(Inputs(i)).output.size();
+	double seconds = Seconds(start);
+	printf("%-28s %8d %12.0f %12.0f\n", "compiled once", 1, seconds * 1e9 / RUNS, RUNS / seconds);
+
+	unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+	std::vector<std::thread> workers;
+	start = std::chrono::steady_clock::now();
+	for (unsigned t = 0; t < threads; t++)
+		workers.emplace_back([&program, t] {
+			for (int i = 0; i < RUNS; i++)
+				program->Run(Inputs(i + t));
+		});
+	for (std::thread& worker : workers)
+		worker.join();
+	seconds = Seconds(start);
+	printf("%-28s %8u %12.0f %12.0f\n", "compiled once", threads, seconds * 1e9 / RUNS, (double)RUNS * threads / seconds);
+
+	const int COMPILES = RUNS / 10;
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < COMPILES; i++)
+		bytes += bomac::Program::Compile(SOURCE)->Run(Inputs(i)).output.size();
+	seconds = Seconds(start);
+	printf("%-28s %8d %12.0f %12.0f\n", "compiled for every run", 1, seconds * 1e9 / COMPILES, COMPILES / seconds);
+	return bytes == 0;
+}
@@ -0,0 +1,108 @@
+// Compares MapObj (map.h) with std::unordered_map on inserts, lookups and
+// removes. Built and run by bench/run.sh.
+
+#include "../util.h"
+#include "../lexer.h"
+#include "../parser.h"
+#include "../interpreter.h"
+#include "../closure.h"
+#include "../tiers.h"
+#include "../types.h"
+#include "../simplify.h"
+#include "../server.h"
+#include "../watch.h"
+#include "../scheduler.h"
+#include "../parallel.h"
+#include "../pool.h"
+#include "../tasks.h"
+#include "../map.h"
+#include "../files.h"
+#include "../intrinsics.h"
+#include "../memo.h"
+#include "../builtins.h"
+#include "../modules.h"
+#include "../snapshot.h"
+#include "../stats.h"
+#include "../perf.h"
+#include <chrono>
+#include <cstdio>
+#include <unordered_map>
+
+const u32 ROUNDS = 5;
+
+template <typename F>
+double BestNsPerOp(u32 ops, F run) {
+	double best = 1e30;
+	for (u32 round = 0; round < ROUNDS; round++) {
+		auto start = std::chrono::steady_clock::now();
+		run();
+		double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+		best = std::min(best, ns / ops);
+	}
+	return best;
+}
+
+// Inserts every key, looks each up along with as many missing keys, then
+// removes half of them
+template <typename Key>
+void Compare(const char* name, const std::vector<Object>& keys, const std::vector<Object>& missing,
+		const std::vector<Key>& std_keys, const std::vector<Key>& std_missing) {
+	u32 n = keys.size();
+	u64 found = 0;
+	double map = BestNsPerOp(n * 3 + n / 2, [&] {
+		Ref<MapObj> m = heap.New<MapObj>();
+		for (Object key : keys)
+			m->Set(key, HashKey(key, 0), key);
+		Object value;
+		for (u32 i = 0; i < n; i++) {
+			Object key = keys[i], other = missing[i];
+			found += m->Find(key, HashKey(key, 0), value);
+			found += m->Find(other, HashKey(other, 0), value);
+		}
+		for (u32 i = 0; i < n; i += 2) {
+			Object key = keys[i];
+			m->Remove(key, HashKey(key, 0));
+		}
+	});
+	double unordered = BestNsPerOp(n * 3 + n / 2, [&] {
+		std::unordered_map<Key, Object> m;
+		for (u32 i = 0; i < n; i++)
+			m[std_keys[i]] = keys[i];
+		for (u32 i = 0; i < n; i++) {
+			found += m.count(std_keys[i]);
+			found += m.count(std_missing[i]);
+		}
+		for (u32 i = 0; i < n; i += 2)
+			m.erase(std_keys[i]);
+	});
+	printf("%-24s %8u %12.1f %12.1f %8.2fx\n", name, n, map, unordered, unordered / map);
+	if (found != (u64)n * ROUNDS * 2)
+		printf("  (found %llu keys, expected %llu)\n", (unsigned long long)found, (unsigned long long)n * ROUNDS * 2);
+}
+
+int main() {
+	printf("%-24s %8s %12s %12s %9s\n", "keys", "count", "map ns/op", "std ns/op", "speedup");
+	for (u32 n : {1000u, 100000u}) {
+		std::vector<Object> keys, missing;
+		std::vector<float> numbers, missing_numbers;
+		for (u32 i = 0; i < n; i++) {
+			keys.push_back((float)i);
+			missing.push_back((float)(i + n));
+			numbers.push_back(i);
+			missing_numbers.push_back(i + n);
+		}
+		Compare("numbers", keys, missing, numbers, missing_numbers);
+
+		keys.clear();
+		missing.clear();
+		std::vector<std::string> strings, missing_strings;
+		for (u32 i = 0; i < n; i++) {
+			strings.push_back("key_" + std::to_string(i * 7919));
+			missing_strings.push_back("missing_" + std::to_string(i));
+			keys.push_back(MakeString(strings.back()));
+			missing.push_back(MakeString(missing_strings.back()));
+		}
+		Compare("strings", keys, missing, strings, missing_strings);
+	}
+	return 0;
+}
@@ -0,0 +1,274 @@
+// Microbenchmarks of the interpreter's pieces on their own: the lexer and
+// parser on generated sources, Environment lookups at several depths, and
+// value operations per operator. Built and run by bench/run.sh.
+//
+// Every fixture runs in ROUNDS timed rounds of enough repetitions to last
+// about ROUND_NS, after a warm-up. It reports the median time per operation,
+// the fastest round and the median absolute deviation as a share of the
+// median, which stay put between runs where a mean wouldn't. Allocations
+// are counted by the operator new hook in stats.h.
+
+#define BOMAC_COUNT_ALLOCATIONS
+#include "../util.h"
+#include "../lexer.h"
+#include "../parser.h"
+#include "../interpreter.h"
+#include "../closure.h"
+#include "../tiers.h"
+#include "../types.h"
+#include "../simplify.h"
+#include "../server.h"
+#include "../watch.h"
+#include "../scheduler.h"
+#include "../parallel.h"
+#include "../pool.h"
+#include "../tasks.h"
+#include "../map.h"
+#include "../files.h"
+#include "../intrinsics.h"
+#include "../memo.h"
+#include "../builtins.h"
+#include "../modules.h"
+#include "../snapshot.h"
+#include "../stats.h"
+#include "../perf.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <sstream>
+
+const u32 ROUNDS = 21;
+const double ROUND_NS = 5e6;
+
+u64 sink; // Results go here so nothing measured is optimized away
+
+double NsSince(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+double Median(std::vector<double> values) {
+	std::sort(values.begin(), values.end());
+	u32 n = values.size();
+	return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+// Times 'run', which does 'ops' operations of the kind 'unit' names.
+// 'cleanup' runs after each round, untimed, for what the runs left behind.
+template <typename Run, typename Cleanup>
+void Measure(const std::string& name, const char* unit, u64 ops, Run run, Cleanup cleanup) {
+	run();
+	cleanup();
+	auto start = std::chrono::steady_clock::now();
+	run();
+	u32 reps = std::max(1.0, ROUND_NS / std::max(1.0, NsSince(start)));
+	cleanup();
+
+	std::vector<double> samples;
+	u64 allocations = 0, bytes = 0;
+	for (u32 round = 0; round < ROUNDS; round++) {
+		u64 allocations_before = stats.allocations, bytes_before = stats.allocated_bytes;
+		start = std::chrono::steady_clock::now();
+		for (u32 i = 0; i < reps; i++)
+			run();
+		samples.push_back(NsSince(start) / ((double)reps * ops));
+		allocations += stats.allocations - allocations_before;
+		bytes += stats.allocated_bytes - bytes_before;
+		cleanup();
+	}
+	double median = Median(samples);
+	std::vector<double> deviations;
+	for (double sample : samples)
+		deviations.push_back(std::abs(sample - median));
+	double total_ops = (double)ROUNDS * reps * ops;
+	printf("%-30s %-7s %11.2f %11.2f %6.1f%% %10.1f %10.3f\n", name.c_str(), unit, median,
+		*std::min_element(samples.begin(), samples.end()), Median(deviations) / median * 100,
+		bytes / total_ops, allocations / total_ops);
+}
+
+template <typename Run>
+void Measure(const std::string& name, const char* unit, u64 ops, Run run) {
+	Measure(name, unit, ops, run, [] {});
+}
+
+// About 'bytes' of source made of 'line' repeated, which gets its number
+std::string Repeat(u32 bytes, std::string (*line)(u32)) {
+	std::string source;
+	for (u32 i = 0; source.size() < bytes; i++)
+		source += line(i);
+	return source;
+}
+
+void LexerFixtures() {
+	const u32 SIZE = 64 * 1024;
+	std::pair<const char*, std::string> inputs[] = {
+		{"lex identifiers", Repeat(SIZE, [](u32 i) {
+			std::string n = std::to_string(i);
+			return "var alpha_" + n + " = beta_" + n + " + gamma_long_name_" + n + " * delta;\n";
+		})},
+		{"lex numbers", Repeat(SIZE, [](u32 i) {
+			std::string n = std::to_string(i);
+			return "print " + n + ".25 + 0x" + n + " + 1_000_" + n + " + " + n + "e-3 + 0b101;\n";
+		})},
+		{"lex comments", Repeat(SIZE, [](u32 i) {
+			return std::string(i % 8 ? "# a line of commentary about what follows, at some length\n" : "x = x + 1;\n");
+		})},
+		{"lex strings", Repeat(SIZE, [](u32 i) {
+			return "print \"a string literal of several words, number " + std::to_string(i) + "\";\n";
+		})},
+	};
+	for (auto& input : inputs) {
+		const std::string& source = input.second;
+		Measure(input.first, "byte", source.size(), [&] {
+			Lexer lexer;
+			lexer.Lex(source);
+			sink += lexer.tokens.size();
+		});
+	}
+}
+
+void ParserFixtures() {
+	std::string deep = "var deep = ", wide = "var w = 1;\nvar wide = w", statements = "var s0 = 0;\n";
+	for (u32 i = 0; i < 400; i++)
+		deep += "(1 + ";
+	deep += "1";
+	for (u32 i = 0; i < 400; i++)
+		deep += ")";
+	deep += ";\n";
+	const char* ops[] = {" + ", " * ", " - ", " / ", " < ", " == "};
+	for (u32 i = 0; i < 4000; i++)
+		wide += std::string(ops[i % 6]) + (i % 2 ? "w" : std::to_string(i));
+	wide += ";\n";
+	for (u32 i = 1; i < 2000; i++)
+		statements += "var s" + std::to_string(i) + " = s" + std::to_string(i - 1) + " + 1;\n";
+
+	std::pair<const char*, std::string*> inputs[] = {
+		{"parse deep expression", &deep},
+		{"parse wide expression", &wide},
+		{"parse many statements", &statements},
+	};
+	for (auto& input : inputs) {
+		std::ostringstream errors;
+		Lexer lexer;
+		lexer.errors = &errors;
+		lexer.Lex(*input.second);
+		std::vector<Stmt*> parsed;
+		Parser check;
+		check.errors = &errors;
+		check.Parse(lexer.tokens);
+		parsed = check.statements;
+		if (check.HadError()) {
+			printf("%s: %s", input.first, errors.str().c_str());
+			continue;
+		}
+		Measure(input.first, "token", lexer.tokens.size(), [&] {
+			Parser parser;
+			parser.Parse(lexer.tokens);
+			parsed.insert(parsed.end(), parser.statements.begin(), parser.statements.end());
+		}, [&] {
+			for (Stmt* stmt : parsed) {
+				stmt->Destroy();
+				delete stmt;
+			}
+			parsed.clear();
+		});
+	}
+}
+
+void EnvironmentFixtures() {
+	const u32 LOOKUPS = 1000;
+	for (u32 depth : {1u, 4u, 16u, 64u}) {
+		// Each scope has a few names of its own, and the one looked up is in the outermost
+		std::vector<Ref<Environment>> scopes;
+		for (u32 i = 0; i < depth; i++) {
+			scopes.push_back(i ? heap.New<Environment>(scopes.back().Get()) : heap.New<Environment>());
+			for (u32 j = 0; j < 4; j++)
+				scopes.back()->Define("local_" + std::to_string(i) + "_" + std::to_string(j), (float)j);
+		}
+		scopes.front()->Define("target", 1.0f);
+		Environment* inner = scopes.back().Get();
+		Token name{TokenType::IDENTIFIER, "target", Object(), 1};
+		std::string suffix = " depth " + std::to_string(depth);
+		Measure("env get" + suffix, "get", LOOKUPS, [&] {
+			for (u32 i = 0; i < LOOKUPS; i++)
+				sink += std::get<TYPE_NUMBER>(inner->Get(name)) > 0;
+		});
+		Measure("env assign" + suffix, "assign", LOOKUPS, [&] {
+			for (u32 i = 0; i < LOOKUPS; i++)
+				inner->Assign(name, (float)i);
+		});
+	}
+}
+
+void ValueFixtures() {
+	const u32 CALLS = 1000;
+	Object same = MakeString("a string of medium length");
+	std::pair<const char*, std::pair<Object, Object>> pairs[] = {
+		{"equal numbers", {1.5f, 1.5f}},
+		{"equal booleans", {true, true}},
+		{"same string", {same, same}},
+		{"equal strings", {same, MakeString("a string of medium length")}},
+		{"unequal strings", {same, MakeString("a string of medium lengtH")}},
+		{"mixed types", {1.0f, true}},
+	};
+	for (auto& pair : pairs) {
+		Object l = pair.second.first, r = pair.second.second;
+		Measure(std::string("ObjEqual ") + pair.first, "call", CALLS, [&] {
+			for (u32 i = 0; i < CALLS; i++)
+				sink += ObjEqual(l, r);
+		});
+	}
+
+	std::pair<const char*, Object> values[] = {
+		{"integer", 1234567.0f},
+		{"fraction", 3.14159f},
+		{"boolean", false},
+		{"string", same},
+	};
+	for (auto& value : values) {
+		Object obj = value.second;
+		Measure(std::string("ObjToStr ") + value.first, "call", CALLS, [&] {
+			for (u32 i = 0; i < CALLS; i++)
+				sink += ObjToStr(obj).size();
+		});
+	}
+
+	struct Operator {
+		TokenType type;
+		const char* lexeme;
+		Object left, right;
+	};
+	Object text = MakeString("text");
+	Operator operators[] = {
+		{TokenType::PLUS, "+", 3.5f, 1.25f},
+		{TokenType::MINUS, "-", 3.5f, 1.25f},
+		{TokenType::STAR, "*", 3.5f, 1.25f},
+		{TokenType::SLASH, "/", 3.5f, 1.25f},
+		{TokenType::MODULO, "%", 7.0f, 3.0f},
+		{TokenType::STAR_STAR, "**", 3.5f, 2.0f},
+		{TokenType::EQUAL_EQUAL, "==", 3.5f, 1.25f},
+		{TokenType::BANG_EQUAL, "!=", 3.5f, 1.25f},
+		{TokenType::LESS, "<", 3.5f, 1.25f},
+		{TokenType::LESS_EQUAL, "<=", 3.5f, 1.25f},
+		{TokenType::GREATER, ">", 3.5f, 1.25f},
+		{TokenType::GREATER_EQUAL, ">=", 3.5f, 1.25f},
+		{TokenType::PLUS, "+ strings", text, text},
+		{TokenType::EQUAL_EQUAL, "== strings", text, MakeString("text")},
+	};
+	for (Operator& op : operators) {
+		BinaryExpr expr(Token{op.type, op.lexeme, Object(), 1}, new LiteralExpr(op.left), new LiteralExpr(op.right));
+		Measure(std::string("BinaryExpr ") + op.lexeme, "eval", CALLS, [&] {
+			for (u32 i = 0; i < CALLS; i++)
+				sink += expr.Evaluate().index();
+		});
+		expr.Destroy();
+	}
+}
+
+int main() {
+	printf("%-30s %-7s %11s %11s %7s %10s %10s\n", "fixture", "op", "median ns", "min ns", "mad", "B/op", "allocs/op");
+	LexerFixtures();
+	ParserFixtures();
+	EnvironmentFixtures();
+	ValueFixtures();
+	return sink == 0;
+}
@@ -0,0 +1,78 @@
+#!/bin/sh
+# Runs every workload in bench/ under each execution engine and reports
+# wall time. Usage: bench/run.sh [path/to/bomac]
+cd "$(dirname "$0")/.."
+BOMAC=${1:-./bomac}
+if [ ! -x "$BOMAC" ]; then
+	g++ -std=c++17 -O2 -o "$BOMAC" main.cpp || exit 1
+fi
+
+now_ms() { echo $(($(date +%s%N) / 1000000)); }
+
+printf "%-24s %-10s %10s\n" "workload" "engine" "ms"
+for script in bench/*.bomac; do
+	name=$(basename "$script" .bomac)
+	for engine in tree untiered closure; do
+		flags=""
+		[ "$engine" = "untiered" ] && flags="--hot-loop 0 --hot-block 0"
+		[ "$engine" = "closure" ] && flags="--closure"
+		start=$(now_ms)
+		"$BOMAC" $flags "$script" > /dev/null
+		end=$(now_ms)
+		printf "%-24s %-10s %10d\n" "$name" "$engine" $((end - start))
+	done
+done
+
+# Lexing throughput on a generated, literal-heavy script
+literals=$(mktemp)
+awk 'BEGIN { for (i = 0; i < 100000; i++) printf "var n%d = %d.%d + 0x%X + 1_000_%03d + %de-3 + 0b101;\n", i, i, i % 97, i, i % 1000, i }' > "$literals"
+bytes=$(wc -c < "$literals")
+lex_ms=$("$BOMAC" --stats=json "$literals" 2>&1 >/dev/null | sed -n 's/.*"lex": \([0-9.]*\).*/\1/p')
+echo
+awk -v bytes="$bytes" -v ms="$lex_ms" 'BEGIN { printf "%-24s %10.3f ms %10.1f MB/s\n", "lex (number literals)", ms, bytes / 1e6 / (ms / 1e3) }'
+rm -f "$literals"
+
+# Reading a generated log a line at a time
+log=$(mktemp)
+scan=$(mktemp)
+awk 'BEGIN { for (i = 0; i < 2000000; i++) printf "2026-01-01 12:%02d:%02d INFO request %d served in %d ms\n", i / 60 % 60, i % 60, i, i % 997 }' > "$log"
+printf 'var n = 0;\nfor (line in lines("%s")) n = n + length(line);\nprint n;\n' "$log" > "$scan"
+bytes=$(wc -c < "$log")
+start=$(now_ms)
+"$BOMAC" "$scan" > /dev/null
+end=$(now_ms)
+echo
+awk -v bytes="$bytes" -v ms=$((end - start)) 'BEGIN { printf "%-24s %10d ms %10.1f MB/s\n", "lines (2M-line log)", ms, bytes / 1e6 / (ms / 1e3) }'
+rm -f "$log" "$scan"
+
+# Task workloads on one thread against the whole pool
+echo
+printf "%-24s %-10s %10s %10s %10s\n" "workload" "threads" "ms" "steals" "max queue"
+for name in parallel_sweep pipeline; do
+	for threads in 1 $(nproc); do
+		start=$(now_ms)
+		counters=$("$BOMAC" --threads "$threads" --stats=json "bench/$name.bomac" 2>&1 >/dev/null)
+		end=$(now_ms)
+		steals=$(echo "$counters" | sed -n 's/.*"steals": \([0-9]*\).*/\1/p')
+		depth=$(echo "$counters" | sed -n 's/.*"max_queue_depth": \([0-9]*\).*/\1/p')
+		printf "%-24s %-10s %10d %10s %10s\n" "$name" "$threads" $((end - start)) "$steals" "$depth"
+	done
+done
+
+# Script maps against std::unordered_map
+echo
+map_bench=$(mktemp)
+g++ -std=c++17 -O2 -o "$map_bench" bench/map_bench.cpp && "$map_bench"
+rm -f "$map_bench"
+
+# The lexer, parser, environments and value operations on their own
+echo
+micro_bench=$(mktemp)
+g++ -std=c++17 -O2 -o "$micro_bench" bench/micro_bench.cpp && "$micro_bench"
+rm -f "$micro_bench"
+
+# Library runs of one compiled program (bomac.h)
+echo
+embed_bench=$(mktemp)
+g++ -std=c++17 -O2 -pthread -o "$embed_bench" bench/embed_bench.cpp bomac.cpp && "$embed_bench"
+rm -f "$embed_bench"
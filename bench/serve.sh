@@ -0,0 +1,35 @@
+#!/bin/sh
+# Compares running a short, parse-heavy script directly against sending it
+# to a warm --serve process. Usage: bench/serve.sh [path/to/bomac] [runs]
+cd "$(dirname "$0")/.."
+BOMAC=${1:-./bomac}
+RUNS=${2:-100}
+if [ ! -x "$BOMAC" ]; then
+	g++ -std=c++17 -O2 -o "$BOMAC" main.cpp || exit 1
+fi
+
+now_ms() { echo $(($(date +%s%N) / 1000000)); }
+
+dir=$(mktemp -d)
+script="$dir/script.bomac"
+socket="$dir/bomac.sock"
+awk 'BEGIN { for (i = 0; i < 5000; i++) printf "var v%d = %d * 2 + (%d - 1) / 4;\n", i, i, i; print "print v4999;" }' > "$script"
+
+"$BOMAC" --serve "$socket" 2> "$dir/serve.log" &
+server=$!
+while [ ! -S "$socket" ]; do sleep 0.05; done
+
+start=$(now_ms)
+i=0; while [ $i -lt $RUNS ]; do "$BOMAC" "$script" > /dev/null; i=$((i + 1)); done
+direct=$(($(now_ms) - start))
+start=$(now_ms)
+i=0; while [ $i -lt $RUNS ]; do "$BOMAC" --client "$socket" "$script" > /dev/null; i=$((i + 1)); done
+served=$(($(now_ms) - start))
+
+kill $server
+printf "%-24s %10s\n" "mode" "ms/run"
+awk -v t=$direct -v n=$RUNS 'BEGIN { printf "%-24s %10.3f\n", "direct", t / n }'
+awk -v t=$served -v n=$RUNS 'BEGIN { printf "%-24s %10.3f\n", "client + server", t / n }'
+sed 's/.*, \([0-9.]*\) ms.*/\1/' "$dir/serve.log" | grep -v serving | sort -n |
+	awk '{ v[NR] = $1 } END { printf "%-24s %10.3f (median), %.3f (max)\n", "server latency", v[int((NR + 1) / 2)], v[NR] }'
+rm -rf "$dir"
@@ -0,0 +1,149 @@
+// The library build of the interpreter (bomac.h), in place of main.cpp
+
+#include "bomac.h"
+#include "util.h"
+#include "lexer.h"
+#include "parser.h"
+#include "interpreter.h"
+#include "closure.h"
+#include "tiers.h"
+#include "types.h"
+#include "simplify.h"
+#include "server.h"
+#include "watch.h"
+#include "scheduler.h"
+#include "parallel.h"
+#include "pool.h"
+#include "tasks.h"
+#include "map.h"
+#include "files.h"
+#include "intrinsics.h"
+#include "memo.h"
+#include "builtins.h"
+#include "modules.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "perf.h"
+#include <sstream>
+
+/*
+A program's statements are shared by all its runs, which only read them,
+so reference counts are atomic for as long as a program exists. Each run
+gets fresh globals in front of a read-only environment of built-ins made
+once per program, and borrows the interpreter state of the thread it's
+called on: a runtime error unwinds back to Run() instead of exiting.
+
+Runs use the tree-walking interpreter, since the closure compiler keeps
+per-compilation state.
+*/
+
+struct RunFailed {};
+
+Object ToObject(const bomac::Value& value) {
+	if (const bool* boolean = std::get_if<bool>(&value)) return *boolean;
+	if (const float* number = std::get_if<float>(&value)) return *number;
+	return MakeString(std::get<std::string>(value));
+}
+
+namespace bomac {
+
+struct Program::Impl {
+	std::vector<Stmt*> statements;
+	std::string errors;
+	bool ok = false;
+	Ref<Environment> builtins;
+};
+
+Program::Program() : mImpl(new Impl()) {}
+
+Program::~Program() {
+	for (Stmt* stmt : mImpl->statements) {
+		stmt->Destroy();
+		delete stmt;
+	}
+	if (mImpl->ok) {
+		mImpl->builtins = Ref<Environment>();
+		threads_share_objects--;
+	}
+}
+
+std::shared_ptr<const Program> Program::Compile(const std::string& source, const CompileOptions& options) {
+	std::shared_ptr<Program> program(new Program());
+	Impl& impl = *program->mImpl;
+	std::ostringstream errors;
+	Lexer lexer;
+	Parser parser;
+	lexer.errors = parser.errors = &errors;
+	parser.directory = options.directory;
+	lexer.Lex(source);
+	parser.Parse(lexer.tokens);
+	impl.statements = parser.statements;
+	impl.errors = errors.str();
+	impl.ok = !parser.HadError();
+	if (!impl.ok)
+		return program;
+	TypeInference().Run(impl.statements);
+	if (options.simplify)
+		Simplifier(options.cse).Run(impl.statements);
+	modules.Preload(impl.statements);
+	threads_share_objects++;
+	impl.builtins = heap.New<Environment>();
+	DefineBuiltins(impl.builtins.Get());
+	impl.builtins->frozen = true;
+	return program;
+}
+
+bool Program::Ok() const {
+	return mImpl->ok;
+}
+
+const std::string& Program::Errors() const {
+	return mImpl->errors;
+}
+
+RunResult Program::Run(const std::unordered_map<std::string, Value>& inputs) const {
+	RunResult result;
+	if (!mImpl->ok) {
+		result.ok = false;
+		result.error = "The program has errors.";
+		return result;
+	}
+	Ref<Environment> run_globals = heap.New<Environment>(mImpl->builtins.Get());
+	for (const auto& input : inputs)
+		run_globals->Define(input.first, ToObject(input.second));
+
+	// Whatever the thread was running itself comes back afterwards
+	output.Flush();
+	Ref<Environment> prev_globals = std::move(globals);
+	Environment* prev_environment = environment;
+	Object* prev_frame = frame;
+	u32 prev_stack_top = stack_top;
+	u32 prev_call_depth = call_depth;
+	void (*prev_end_script)() = end_script;
+	std::string* prev_error_message = error_message;
+	std::string* prev_capture = output.capture;
+	globals = run_globals;
+	environment = globals.Get();
+	end_script = [] { throw RunFailed(); };
+	error_message = &result.error;
+	output.capture = &result.output;
+	try {
+		for (Stmt* stmt : mImpl->statements)
+			stmt->Evaluate();
+	} catch (const RunFailed&) {
+		result.ok = false;
+	}
+	output.Flush();
+	globals = std::move(prev_globals);
+	environment = prev_environment;
+	frame = prev_frame;
+	stack_top = prev_stack_top;
+	call_depth = prev_call_depth;
+	tail_callee = 0;
+	end_script = prev_end_script;
+	error_message = prev_error_message;
+	output.capture = prev_capture;
+	return result;
+}
+
+}
@@ -0,0 +1,55 @@
+#ifndef BOMAC_H
+#define BOMAC_H
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <variant>
+
+/*
+The interpreter as a library, for programs that run scripts themselves.
+Compile() lexes, parses and analyses a script once, into a Program that
+nothing changes afterwards. Run() then evaluates it as often as needed,
+from any number of threads at once; every run has its own globals, starts
+with the inputs it's given and collects what the script prints.
+
+Build bomac.cpp along with the embedding program. It holds the whole
+interpreter, so it can't be linked together with main.cpp.
+*/
+
+namespace bomac {
+
+using Value = std::variant<bool, float, std::string>;
+
+struct CompileOptions {
+	bool simplify = true; // As without --no-simplify
+	bool cse = false; // As with --cse
+	std::string directory; // That imports are relative to
+};
+
+struct RunResult {
+	bool ok = true;
+	std::string output; // What the script printed
+	std::string error; // The runtime error that stopped it, if not ok
+};
+
+class Program {
+public:
+	// Check Ok() before running it
+	static std::shared_ptr<const Program> Compile(const std::string& source, const CompileOptions& options = CompileOptions());
+	~Program();
+	bool Ok() const;
+	const std::string& Errors() const; // From the lexer and parser
+	// Runs the program with 'inputs' as globals. Built-ins keep their
+	// meaning for calls even when an input has the same name. Tasks the
+	// script spawns print to stdout rather than into the result.
+	RunResult Run(const std::unordered_map<std::string, Value>& inputs = {}) const;
+private:
+	struct Impl;
+	std::unique_ptr<Impl> mImpl;
+	Program();
+};
+
+}
+
+#endif
@@ -1 +1,2 @@
-cls && g++ -std=c++17 -o bomac main.cpp
\ No newline at end of file
+cls && g++ -std=c++17 -o bomac main.cpp
+g++ -std=c++17 -c -o bomac.o bomac.cpp && ar rcs libbomac.a bomac.o
\ No newline at end of file
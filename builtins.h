@@ -0,0 +1,62 @@
+#ifndef BUILTINS_H
+#define BUILTINS_H
+
+#include "interpreter.h"
+#include "tasks.h"
+#include "map.h"
+#include "files.h"
+#include "intrinsics.h"
+#include <deque>
+
+// Added by the program embedding the interpreter, after the tables so they
+// take the place of a built-in of the same name. A deque, since calls keep
+// pointers to its entries (CallExpr::builtin).
+std::deque<Builtin> registered_builtins;
+
+void DefineBuiltin(Environment* env, const Builtin& builtin) {
+	env->Define(builtin.name, Ref<Function>(heap.New<Function>(builtin.name, builtin.arity, builtin.fn)));
+}
+
+template <size_t N>
+void DefineTable(Environment* env, const Builtin (&table)[N]) {
+	for (const Builtin& builtin : table)
+		DefineBuiltin(env, builtin);
+}
+
+template <size_t N>
+const Builtin* FindInTable(const Builtin (&table)[N], const std::string& name) {
+	for (const Builtin& builtin : table)
+		if (name == builtin.name) return &builtin;
+	return 0;
+}
+
+void DefineBuiltins(Environment* env) {
+	DefineTable(env, task_builtins);
+	DefineTable(env, map_builtins);
+	DefineTable(env, file_builtins);
+	DefineTable(env, intrinsic_builtins);
+	for (const Builtin& builtin : registered_builtins)
+		DefineBuiltin(env, builtin);
+}
+
+// 0 if there's no built-in called 'name'
+const Builtin* FindBuiltin(const std::string& name) {
+	for (auto builtin = registered_builtins.rbegin(); builtin != registered_builtins.rend(); builtin++)
+		if (name == builtin->name) return &*builtin;
+	if (const Builtin* builtin = FindInTable(task_builtins, name)) return builtin;
+	if (const Builtin* builtin = FindInTable(map_builtins, name)) return builtin;
+	if (const Builtin* builtin = FindInTable(file_builtins, name)) return builtin;
+	return FindInTable(intrinsic_builtins, name);
+}
+
+// Makes 'fn' a built-in called 'name', taking 'arity' arguments and giving
+// back values of 'type' if that's always the same, and 'pure' if it touches
+// nothing but its arguments. Scripts parsed from then on can call it, and so
+// can the current thread's globals. 'name' has to last, as a string literal
+// does. Not for while scripts run on other threads.
+void RegisterBuiltin(const char* name, u32 arity, NativeFn fn, i8 type = TYPE_UNKNOWN, bool pure = false) {
+	registered_builtins.push_back({name, arity, fn, type, pure});
+	DefineBuiltin(globals.Get(), registered_builtins.back());
+}
+
+#endif
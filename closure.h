@@ -0,0 +1,519 @@
+#ifndef CLOSURE_H
+#define CLOSURE_H
+
+#include "util.h"
+#include "AST.h"
+#include "interpreter.h"
+#include <deque>
+#include <functional>
+
+/*
+Closure compilation: every Expr/Stmt is converted once into a callable with
+its operator, operand kinds and variable slots already bound, so running a
+node never switches on op.type or NodeType. The Evaluate() methods in
+interpreter.h are the semantic reference; anything this engine does must
+produce the same output.
+
+Besides whole programs, it compiles the hot loops and blocks of a program
+the tree-walker is running (tiers.h). Variables from outside such a region
+get slots of their own, which are copied in before it runs and back out
+after; nothing the engine compiles could look at them in the meantime.
+*/
+
+using ExprFn = std::function<Object()>;
+using StmtFn = std::function<Flow()>;
+
+// Operand fetchers, picked at compile time depending on what the operand is
+struct SlotOperand {
+	Object* slot;
+	const Object& Get() const { return *slot; }
+};
+struct ConstOperand {
+	Object value;
+	const Object& Get() const { return value; }
+};
+struct ExprOperand {
+	ExprFn fn;
+	Object Get() const { return fn(); }
+};
+
+class ClosureCompiler {
+public:
+	// Returns false if the program uses something this engine can't compile,
+	// in which case the caller should fall back to the tree-walker
+	bool Compile(const std::vector<Stmt*>& statements) {
+		mSupported = true;
+		mRegion = false;
+		mScopes.clear();
+		mScopes.emplace_back();
+		mProgram.clear();
+		for (Stmt* stmt : statements)
+			mProgram.push_back(CompileStmt(stmt));
+		return mSupported;
+	}
+	void Run() {
+		for (StmtFn& stmt : mProgram)
+			stmt();
+	}
+
+	// A variable a region uses but doesn't declare
+	struct Outer {
+		const Token* name;
+		i32 slot; // In the frame, or -1 for one in an Environment
+		Object* value; // The region's copy
+		bool written;
+	};
+	std::vector<Outer> outer;
+	void BeginRegion() {
+		mSupported = true;
+		mRegion = true;
+		mScopes.assign(1, {});
+		outer.clear();
+	}
+	StmtFn RegionStmt(Stmt* stmt) { return CompileStmt(stmt); }
+	ExprFn RegionExpr(Expr* expr) { return CompileExpr(expr); }
+	// Declared in a new scope that the rest of the region is inside
+	Object* RegionVariable(const std::string& name) {
+		mScopes.emplace_back();
+		return Declare(name);
+	}
+	bool Supported() { return mSupported; }
+	// Lets go of the values a region held while it ran
+	void ClearSlots() {
+		for (Object& slot : mSlots)
+			slot = Object(0.0f);
+	}
+private:
+	std::deque<Object> mSlots; // deque so slot addresses stay stable while compiling
+	std::vector<std::unordered_map<std::string, Object*>> mScopes;
+	std::vector<StmtFn> mProgram;
+	bool mSupported = true;
+	bool mRegion = false;
+
+	// 0 for an undefined variable, except in a region, where anything not
+	// declared in it is an outer variable
+	Object* Resolve(const Token& name, i32 slot, bool write = false) {
+		for (auto scope = mScopes.rbegin(); scope != mScopes.rend(); scope++) {
+			auto iter = scope->find(name.lexeme);
+			if (iter == scope->end())
+				continue;
+			if (write && mRegion)
+				for (Outer& o : outer)
+					if (o.value == iter->second) o.written = true;
+			return iter->second;
+		}
+		if (!mRegion)
+			return 0;
+		mSlots.emplace_back(Object(0.0f));
+		Object* value = &mSlots.back();
+		mScopes.front()[name.lexeme] = value;
+		outer.push_back({&name, slot, value, write});
+		return value;
+	}
+	Object* Declare(const std::string& name) {
+		auto iter = mScopes.back().find(name);
+		if (iter != mScopes.back().end())
+			return iter->second;
+		mSlots.emplace_back(Object(0.0f));
+		return mScopes.back()[name] = &mSlots.back();
+	}
+
+	StmtFn CompileStmt(Stmt* stmt) {
+		switch (stmt->Type()) {
+		case NodeType::PRINT_STMT: {
+			ExprFn expr = CompileExpr(((PrintStmt*)stmt)->expr);
+			return [expr]() {
+				PrintObj(expr());
+				return Flow::NORMAL;
+			};
+		}
+		case NodeType::BLOCK_STMT: {
+			mScopes.emplace_back();
+			std::vector<StmtFn> body;
+			for (Stmt* s : ((BlockStmt*)stmt)->statements)
+				body.push_back(CompileStmt(s));
+			mScopes.pop_back();
+			return [body]() {
+				for (const StmtFn& s : body) {
+					Flow flow = s();
+					if (flow != Flow::NORMAL) return flow;
+				}
+				return Flow::NORMAL;
+			};
+		}
+		case NodeType::EXPR_STMT: {
+			ExprFn expr = CompileExpr(((ExprStmt*)stmt)->expr);
+			return [expr]() { expr(); return Flow::NORMAL; };
+		}
+		case NodeType::VAR_DECL_STMT: {
+			VarDeclStmt* decl = (VarDeclStmt*)stmt;
+			// The initializer is compiled before the name is declared, so
+			// 'var x = x + 1;' reads the enclosing 'x' like Environment does
+			if (decl->expr) {
+				ExprFn init = CompileExpr(decl->expr);
+				Object* slot = Declare(decl->identifier.lexeme);
+				return [init, slot]() { *slot = init(); return Flow::NORMAL; };
+			}
+			Object* slot = Declare(decl->identifier.lexeme);
+			return [slot]() { *slot = Object(0.0f); return Flow::NORMAL; };
+		}
+		case NodeType::IF_STMT: {
+			IfStmt* s = (IfStmt*)stmt;
+			ExprFn condition = CompileExpr(s->condition);
+			StmtFn then_branch = CompileStmt(s->then_branch);
+			if (!s->else_branch) {
+				return [condition, then_branch]() {
+					if (ObjIsTruthy(condition())) return then_branch();
+					return Flow::NORMAL;
+				};
+			}
+			StmtFn else_branch = CompileStmt(s->else_branch);
+			return [condition, then_branch, else_branch]() {
+				return ObjIsTruthy(condition()) ? then_branch() : else_branch();
+			};
+		}
+		case NodeType::WHILE_STMT: {
+			WhileStmt* s = (WhileStmt*)stmt;
+			ExprFn condition = CompileExpr(s->condition);
+			StmtFn body = CompileStmt(s->statement);
+			return [condition, body]() {
+				while (ObjIsTruthy(condition())) {
+					Tick();
+					if (body() == Flow::BREAK) break;
+				}
+				return Flow::NORMAL;
+			};
+		}
+		case NodeType::FOR_STMT: {
+			ForStmt* s = (ForStmt*)stmt;
+			mScopes.emplace_back();
+			StmtFn initializer = s->initializer ? CompileStmt(s->initializer) : []() { return Flow::NORMAL; };
+			ExprFn condition = s->condition ? CompileExpr(s->condition) : []() { return Object(true); };
+			ExprFn increment = s->increment ? CompileExpr(s->increment) : []() { return Object(); };
+			StmtFn body = CompileStmt(s->body);
+			mScopes.pop_back();
+			return [initializer, condition, increment, body]() {
+				for (initializer(); ObjIsTruthy(condition()); increment()) {
+					Tick();
+					if (body() == Flow::BREAK) break;
+				}
+				return Flow::NORMAL;
+			};
+		}
+		case NodeType::RANGE_FOR_STMT: {
+			RangeForStmt* s = (RangeForStmt*)stmt;
+			if (s->parallel) {
+				mSupported = false; // Left to parallel.h
+				return []() { return Flow::NORMAL; };
+			}
+			const Token* name = &s->identifier;
+			ExprFn start = CompileExpr(s->start);
+			ExprFn end = CompileExpr(s->end);
+			ExprFn step = s->step ? CompileExpr(s->step) : []() { return Object(1.0f); };
+			mScopes.emplace_back();
+			Object* slot = Declare(name->lexeme);
+			StmtFn body = CompileStmt(s->body);
+			mScopes.pop_back();
+			return [name, start, end, step, slot, body]() {
+				Object from = start();
+				Object to = end();
+				Object by = step();
+				if (from.index() != TYPE_NUMBER || to.index() != TYPE_NUMBER || by.index() != TYPE_NUMBER)
+					ErrorRT(name->line, "Expected the bounds and step of a range to be numbers.");
+				float i = std::get<TYPE_NUMBER>(from);
+				float limit = std::get<TYPE_NUMBER>(to);
+				float increment = std::get<TYPE_NUMBER>(by);
+				if (increment == 0)
+					ErrorRT(name->line, "The step of a range can't be zero.");
+				for (; increment > 0 ? i < limit : i > limit; i += increment) {
+					Tick();
+					*slot = i;
+					if (body() == Flow::BREAK) break;
+				}
+				return Flow::NORMAL;
+			};
+		}
+		case NodeType::BREAK_STMT:
+			return []() { return Flow::BREAK; };
+		case NodeType::CONTINUE_STMT:
+			return []() { return Flow::CONTINUE; };
+		default:
+			mSupported = false;
+			return []() { return Flow::NORMAL; };
+		}
+	}
+
+	// Calls 'f' with the cheapest fetcher that can stand in for 'expr'.
+	// 'copy' forces a copying fetcher for variables, which is needed when
+	// a later operand could assign to the same slot before it's read.
+	template <typename F>
+	ExprFn WithOperand(Expr* expr, bool copy, F f) {
+		while (expr->Type() == NodeType::GROUP_EXPR)
+			expr = ((GroupExpr*)expr)->expr;
+		if (expr->Type() == NodeType::LITERAL_EXPR)
+			return f(ConstOperand{((LiteralExpr*)expr)->value});
+		if (!copy && expr->Type() == NodeType::VAR_EXPR) {
+			Object* slot = Resolve(((VarExpr*)expr)->identifier, ((VarExpr*)expr)->slot);
+			if (slot)
+				return f(SlotOperand{slot});
+		}
+		return f(ExprOperand{CompileExpr(expr)});
+	}
+	static bool IsSimple(Expr* expr) {
+		while (expr->Type() == NodeType::GROUP_EXPR)
+			expr = ((GroupExpr*)expr)->expr;
+		return expr->Type() == NodeType::LITERAL_EXPR || expr->Type() == NodeType::VAR_EXPR;
+	}
+	template <typename Op>
+	ExprFn WithOperands(BinaryExpr* e, Op op) {
+		bool copy = !IsSimple(e->right);
+		return WithOperand(e->left, copy, [&](auto l) {
+			return WithOperand(e->right, false, [&](auto r) {
+				return op(l, r);
+			});
+		});
+	}
+
+	template <typename F>
+	ExprFn NumberOp(BinaryExpr* e, F f) {
+		const Token* op = &e->op;
+		if (e->numeric) {
+			return WithOperands(e, [f](auto l, auto r) -> ExprFn {
+				return [f, l, r]() -> Object {
+					const Object& a = l.Get();
+					const Object& b = r.Get();
+					return f(ObjNum(a), ObjNum(b));
+				};
+			});
+		}
+		return WithOperands(e, [op, f](auto l, auto r) -> ExprFn {
+			return [op, f, l, r]() -> Object {
+				const Object& a = l.Get();
+				const Object& b = r.Get();
+				if (a.index() != TYPE_NUMBER || b.index() != TYPE_NUMBER)
+					CheckNumberOperands(*op, a, b);
+				return f(std::get<TYPE_NUMBER>(a), std::get<TYPE_NUMBER>(b));
+			};
+		});
+	}
+
+	ExprFn CompileBinary(BinaryExpr* e) {
+		switch (e->op.type) {
+		case TokenType::PLUS: {
+			if (e->numeric)
+				return NumberOp(e, [](float a, float b) -> Object { return a + b; });
+			const Token* op = &e->op;
+			return WithOperands(e, [op](auto l, auto r) -> ExprFn {
+				return [op, l, r]() -> Object {
+					const Object& a = l.Get();
+					const Object& b = r.Get();
+					if (a.index() == TYPE_NUMBER && b.index() == TYPE_NUMBER)
+						return std::get<TYPE_NUMBER>(a) + std::get<TYPE_NUMBER>(b);
+					if (a.index() == TYPE_STRING && b.index() == TYPE_STRING)
+						return MakeString(ObjStr(a) + ObjStr(b));
+					CheckNumberOperands(*op, a, b);
+					return Object(); // Unreachable
+				};
+			});
+		}
+		case TokenType::MINUS:
+			return NumberOp(e, [](float a, float b) -> Object { return a - b; });
+		case TokenType::STAR:
+			return NumberOp(e, [](float a, float b) -> Object { return a * b; });
+		case TokenType::SLASH:
+			return NumberOp(e, [](float a, float b) -> Object { return a / b; });
+		case TokenType::MODULO:
+			return NumberOp(e, [](float a, float b) -> Object {
+				return (float)((i32)std::floor(a) % (i32)std::floor(b));
+			});
+		case TokenType::STAR_STAR:
+			return NumberOp(e, [](float a, float b) -> Object { return Power(a, b); });
+		case TokenType::LESS:
+			return NumberOp(e, [](float a, float b) -> Object { return a < b; });
+		case TokenType::LESS_EQUAL:
+			return NumberOp(e, [](float a, float b) -> Object { return a <= b; });
+		case TokenType::GREATER:
+			return NumberOp(e, [](float a, float b) -> Object { return a > b; });
+		case TokenType::GREATER_EQUAL:
+			return NumberOp(e, [](float a, float b) -> Object { return a >= b; });
+		case TokenType::EQUAL_EQUAL:
+			return WithOperands(e, [](auto l, auto r) -> ExprFn {
+				return [l, r]() -> Object { return ObjEqual(l.Get(), r.Get()); };
+			});
+		case TokenType::BANG_EQUAL:
+			return WithOperands(e, [](auto l, auto r) -> ExprFn {
+				return [l, r]() -> Object { return !ObjEqual(l.Get(), r.Get()); };
+			});
+		default:
+			return []() { return Object(); };
+		}
+	}
+
+	ExprFn CompileUnary(UnaryExpr* e) {
+		const Token* op = &e->op;
+		switch (e->op.type) {
+		case TokenType::BANG: {
+			ExprFn expr = CompileExpr(e->expr);
+			return [expr]() -> Object { return !ObjIsTruthy(expr()); };
+		}
+		case TokenType::MINUS: {
+			ExprFn expr = CompileExpr(e->expr);
+			if (e->numeric)
+				return [expr]() -> Object { return -ObjNum(expr()); };
+			return [op, expr]() -> Object {
+				Object v = expr();
+				CheckNumberOperand(*op, v);
+				return -std::get<TYPE_NUMBER>(v);
+			};
+		}
+		case TokenType::PLUS_PLUS: {
+			Object* slot = 0;
+			if (e->expr->Type() == NodeType::VAR_EXPR)
+				slot = Resolve(((VarExpr*)e->expr)->identifier, ((VarExpr*)e->expr)->slot, true);
+			if (!slot) {
+				// Same errors as UnaryExpr::Evaluate, in the same order
+				ExprFn expr = CompileExpr(e->expr);
+				return [op, expr]() -> Object {
+					expr();
+					ErrorRT(op->line, "Expressions followed by '++' or '--' must be variables.");
+					return Object(); // Unreachable
+				};
+			}
+			if (e->postfix) {
+				return [op, slot]() -> Object {
+					CheckNumberOperand(*op, *slot);
+					Object old = *slot;
+					*slot = std::floor(std::get<TYPE_NUMBER>(*slot)) + 1;
+					return old;
+				};
+			}
+			return [op, slot]() -> Object {
+				CheckNumberOperand(*op, *slot);
+				*slot = std::floor(std::get<TYPE_NUMBER>(*slot)) + 1;
+				return *slot;
+			};
+		}
+		default: {
+			ExprFn expr = CompileExpr(e->expr);
+			return [expr]() -> Object { expr(); return Object(); };
+		}
+		}
+	}
+
+	ExprFn CompileExpr(Expr* expr) {
+		switch (expr->Type()) {
+		case NodeType::ASSIGN_EXPR: {
+			AssignExpr* e = (AssignExpr*)expr;
+			ExprFn value = CompileExpr(e->expr);
+			Object* slot = Resolve(e->identifier, e->slot, true);
+			if (!slot) {
+				const Token* name = &e->identifier;
+				return [name, value]() -> Object {
+					value();
+					ErrorRT(name->line, "Undefined variable '" + name->lexeme + "'.");
+					return Object(); // Unreachable
+				};
+			}
+			return [slot, value]() { return *slot = value(); };
+		}
+		case NodeType::IF_EXPR: {
+			IfExpr* e = (IfExpr*)expr;
+			ExprFn condition = CompileExpr(e->condition);
+			ExprFn then_branch = CompileExpr(e->then_branch);
+			ExprFn else_branch = CompileExpr(e->else_branch);
+			return [condition, then_branch, else_branch]() {
+				return ObjIsTruthy(condition()) ? then_branch() : else_branch();
+			};
+		}
+		case NodeType::LOGIC_EXPR: {
+			LogicExpr* e = (LogicExpr*)expr;
+			ExprFn left = CompileExpr(e->left);
+			ExprFn right = CompileExpr(e->right);
+			if (e->op.type == TokenType::OR) {
+				return [left, right]() {
+					Object l = left();
+					return ObjIsTruthy(l) ? l : right();
+				};
+			}
+			return [left, right]() {
+				Object l = left();
+				return ObjIsTruthy(l) ? right() : l;
+			};
+		}
+		case NodeType::BINARY_EXPR:
+			return CompileBinary((BinaryExpr*)expr);
+		case NodeType::GROUP_EXPR:
+			return CompileExpr(((GroupExpr*)expr)->expr);
+		case NodeType::UNARY_EXPR:
+			return CompileUnary((UnaryExpr*)expr);
+		case NodeType::VAR_EXPR: {
+			const Token* name = &((VarExpr*)expr)->identifier;
+			Object* slot = Resolve(*name, ((VarExpr*)expr)->slot);
+			if (!slot) {
+				return [name]() -> Object {
+					ErrorRT(name->line, "Undefined variable '" + name->lexeme + "'.");
+					return Object(); // Unreachable
+				};
+			}
+			return [slot]() { return *slot; };
+		}
+		case NodeType::LITERAL_EXPR: {
+			Object value = ((LiteralExpr*)expr)->value;
+			return [value]() { return value; };
+		}
+		case NodeType::REDUCED_EXPR: {
+			ReducedExpr* e = (ReducedExpr*)expr;
+			ExprFn operand = CompileExpr(e->expr);
+			float constant = e->constant;
+			switch (e->kind) {
+			case ReducedExpr::POWER:
+				return [operand, constant]() -> Object { return IntPower(ObjNum(operand()), (i32)constant); };
+			case ReducedExpr::SCALE:
+				return [operand, constant]() -> Object { return ObjNum(operand()) * constant; };
+			default:
+				return [operand, constant]() -> Object { return MaskModulo(ObjNum(operand()), (i32)constant); };
+			}
+		}
+		case NodeType::CSE_DEF_EXPR: {
+			ExprFn value = CompileExpr(((CseDefExpr*)expr)->expr);
+			Object* temp = &cse_temps[((CseDefExpr*)expr)->temp];
+			return [value, temp]() { return *temp = value(); };
+		}
+		case NodeType::CSE_USE_EXPR: {
+			Object* temp = &cse_temps[((CseUseExpr*)expr)->temp];
+			return [temp]() { return *temp; };
+		}
+		case NodeType::CALL_EXPR: {
+			// Only built-ins TypeInference bound, which don't see variables
+			CallExpr* e = (CallExpr*)expr;
+			if (!e->builtin) {
+				mSupported = false;
+				return []() { return Object(); };
+			}
+			std::vector<ExprFn> arguments;
+			for (Expr* arg : e->arguments)
+				arguments.push_back(CompileExpr(arg));
+			NativeFn native = e->builtin->fn;
+			const Token* paren = &e->paren;
+			return [native, arguments, paren]() {
+				if (value_stack.empty())
+					value_stack.resize(value_stack_size);
+				u32 base = stack_top;
+				if (base + arguments.size() > value_stack.size())
+					ErrorRT(paren->line, "Stack overflow.");
+				for (const ExprFn& arg : arguments)
+					value_stack[stack_top++] = arg();
+				Object result = native(&value_stack[base], paren->line);
+				while (stack_top > base)
+					value_stack[--stack_top] = false;
+				return result;
+			};
+		}
+		default:
+			mSupported = false;
+			return []() { return Object(); };
+		}
+	}
+};
+
+#endif
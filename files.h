@@ -0,0 +1,271 @@
+#ifndef FILES_H
+#define FILES_H
+
+#include "util.h"
+#include "AST.h"
+#include "interpreter.h"
+#include <cstdio>
+#include <cstring>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+lines(path) opens a file to be read a line at a time and records(path, n)
+n bytes at a time, with next() or with 'for (x in ...)'. Only the part
+being read is held in memory: a regular file is mapped and the pages
+behind the reader are handed back as it goes, and anything else (a pipe,
+or a build without mmap) is read a megabyte at a time.
+
+A for-in loop reuses the string it gave its variable the time before when
+nothing else holds on to it, so reading a file that way doesn't allocate
+per line. writer(path) gives a file that write() and write_line() fill
+through a one-megabyte buffer, flushed by flush() and when it's freed.
+*/
+
+const size_t FILE_CHUNK = 1 << 20;
+const size_t FILE_RELEASE = 32 << 20; // Mapped bytes read between handing pages back
+const u32 MAX_RECORD_SIZE = 1 << 30;
+
+class FileObj : public HeapObject {
+public:
+	const std::string path;
+	const bool writing;
+	// 'record_size' is 0 to read lines. Check IsOpen() afterwards.
+	FileObj(std::string path, bool writing, u32 record_size = 0)
+		: path(std::move(path)), writing(writing), mRecordSize(record_size) {
+		if (writing) {
+			mFile = std::fopen(this->path.c_str(), "wb");
+			if (mFile) std::setvbuf(mFile, 0, _IOFBF, FILE_CHUNK);
+			return;
+		}
+#ifndef _WIN32
+		int fd = open(this->path.c_str(), O_RDONLY);
+		struct stat info;
+		if (fd >= 0 && fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+			void* data = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data != MAP_FAILED) {
+				madvise(data, info.st_size, MADV_SEQUENTIAL);
+				mMap = (const char*)data;
+				mMapSize = info.st_size;
+			}
+		}
+		if (fd >= 0) close(fd);
+		if (mMap) return;
+#endif
+		mFile = std::fopen(this->path.c_str(), "rb");
+		if (mFile) mBuffer.resize(FILE_CHUNK);
+	}
+	~FileObj() { Release(); }
+	bool IsOpen() { return mMap || mFile; }
+	// Points 'data' at the next line, without its line break, or record.
+	// The last record may be short. It stays valid until the next call.
+	bool Next(const char*& data, size_t& size) {
+		size_t used;
+		if (mMap) {
+			if (!Split(mMap + mPos, mMap + mMapSize, true, data, size, used)) {
+				Release();
+				return false;
+			}
+			mPos += used;
+#ifndef _WIN32
+			if (mPos - mReleased >= FILE_RELEASE) {
+				// Only whole pages before the one 'data' starts on
+				static const size_t page = sysconf(_SC_PAGESIZE);
+				size_t upto = (data - mMap) / page * page;
+				madvise((void*)(mMap + mReleased), upto - mReleased, MADV_DONTNEED);
+				mReleased = upto;
+			}
+#endif
+			return true;
+		}
+		while (mFile) {
+			if (Split(mBuffer.data() + mStart, mBuffer.data() + mEnd, mAtEnd, data, size, used)) {
+				mStart += used;
+				return true;
+			}
+			if (mAtEnd) break;
+			// Keep the unfinished line at the front, growing the buffer if it fills it
+			std::memmove(mBuffer.data(), mBuffer.data() + mStart, mEnd - mStart);
+			mEnd -= mStart;
+			mStart = 0;
+			if (mEnd == mBuffer.size())
+				mBuffer.resize(mBuffer.size() * 2);
+			size_t read = std::fread(mBuffer.data() + mEnd, 1, mBuffer.size() - mEnd, mFile);
+			mEnd += read;
+			mAtEnd = read == 0;
+		}
+		Release();
+		return false;
+	}
+	bool Write(const char* data, size_t size) {
+		return mFile && std::fwrite(data, 1, size, mFile) == size;
+	}
+	bool Flush() {
+		return mFile && std::fflush(mFile) == 0;
+	}
+	size_t Bytes() { return sizeof(*this) + (writing ? FILE_CHUNK : mBuffer.capacity()); }
+private:
+	u32 mRecordSize;
+	std::FILE* mFile = 0;
+	// A mapped file, read up to mPos, with pages before mReleased handed back
+	const char* mMap = 0;
+	size_t mMapSize = 0;
+	size_t mPos = 0;
+	size_t mReleased = 0;
+	// Otherwise what's been read, of which mStart..mEnd is still to go
+	std::vector<char> mBuffer;
+	size_t mStart = 0;
+	size_t mEnd = 0;
+	bool mAtEnd = false;
+
+	// Finds the line or record [begin, end) starts with, taking what's left if
+	// 'at_end' says no more is coming. 'used' includes the line break.
+	bool Split(const char* begin, const char* end, bool at_end, const char*& data, size_t& size, size_t& used) {
+		if (begin == end) return false;
+		const char* stop;
+		if (mRecordSize)
+			stop = (size_t)(end - begin) >= mRecordSize ? begin + mRecordSize : 0;
+		else
+			stop = (const char*)std::memchr(begin, '\n', end - begin);
+		if (!stop) {
+			if (!at_end) return false;
+			stop = end;
+		}
+		used = stop - begin + (stop != end && !mRecordSize);
+		data = begin;
+		size = stop - begin;
+		if (!mRecordSize && size && data[size - 1] == '\r')
+			size--;
+		return true;
+	}
+	// Done with the file, whether it was read to the end or freed
+	void Release() {
+#ifndef _WIN32
+		if (mMap) munmap((void*)mMap, mMapSize);
+#endif
+		mMap = 0;
+		if (mFile) std::fclose(mFile);
+		mFile = 0;
+		std::vector<char>().swap(mBuffer);
+	}
+};
+
+FileObj* ExpectFile(const Object& obj, bool writing, u16 line) {
+	if (obj.index() != TYPE_FILE || std::get<TYPE_FILE>(obj)->writing != writing)
+		ErrorRT(line, writing ? "Expected a file from writer()." : "Expected a file from lines() or records().");
+	return std::get<TYPE_FILE>(obj).Get();
+}
+
+Object OpenFile(const Object& path, bool writing, u32 record_size, u16 line) {
+	if (path.index() != TYPE_STRING)
+		ErrorRT(line, "Expected the path of a file to be a string.");
+	Ref<FileObj> file = heap.New<FileObj>(ObjStr(path), writing, record_size);
+	if (!file->IsOpen())
+		ErrorRT(line, "Could not open file: " + ObjStr(path) + ".");
+	return file;
+}
+
+// Puts the text in 'slot', reusing the string already there if nothing else
+// holds it
+void SetString(Object& slot, const char* data, size_t size) {
+	if (slot.index() == TYPE_STRING && !threads_share_objects) {
+		StringObj* str = std::get<TYPE_STRING>(slot).Get();
+		if (str->refs == 1) {
+			str->Assign(data, size);
+			heap.Resized(str);
+			return;
+		}
+	}
+	slot = MakeString(std::string(data, size));
+}
+
+Flow ForInFile(FileObj* file, Object& counter, Stmt* body, u16 line) {
+	if (file->writing)
+		ErrorRT(line, "Can't loop over a file being written.");
+	const char* data;
+	size_t size;
+	while (true) {
+		Tick();
+		if (!file->Next(data, size)) break;
+		SetString(counter, data, size);
+		Flow flow = body->Evaluate();
+		if (flow == Flow::BREAK) break;
+		if (flow == Flow::RETURN) return flow;
+	}
+	return Flow::NORMAL;
+}
+
+Object Lines(Object* args, u16 line) {
+	return OpenFile(args[0], false, 0, line);
+}
+
+Object Records(Object* args, u16 line) {
+	if (args[1].index() != TYPE_NUMBER)
+		ErrorRT(line, "Expected the size of a record to be a number.");
+	float size = std::get<TYPE_NUMBER>(args[1]);
+	if (size < 1 || size > MAX_RECORD_SIZE || size != (u32)size)
+		ErrorRT(line, "Expected the size of a record to be a whole number from 1 to " + std::to_string(MAX_RECORD_SIZE) + ".");
+	return OpenFile(args[0], false, (u32)size, line);
+}
+
+// Gives 'false' once the file has been read
+Object Next(Object* args, u16 line) {
+	FileObj* file = ExpectFile(args[0], false, line);
+	const char* data;
+	size_t size;
+	if (!file->Next(data, size))
+		return false;
+	return MakeString(std::string(data, size));
+}
+
+Object Writer(Object* args, u16 line) {
+	return OpenFile(args[0], true, 0, line);
+}
+
+// Strings are written as they are and other values as print shows them
+void WriteValue(FileObj* file, const Object& value, bool line_break, u16 line) {
+	bool written;
+	if (value.index() == TYPE_STRING)
+		written = file->Write(ObjStr(value).data(), ObjStr(value).size());
+	else {
+		std::string text = ObjToStr(value);
+		written = file->Write(text.data(), text.size());
+	}
+	if (line_break)
+		written = written && file->Write("\n", 1);
+	if (!written)
+		ErrorRT(line, "Could not write to file: " + file->path + ".");
+}
+
+Object Write(Object* args, u16 line) {
+	WriteValue(ExpectFile(args[0], true, line), args[1], false, line);
+	return args[1];
+}
+
+Object WriteLine(Object* args, u16 line) {
+	WriteValue(ExpectFile(args[0], true, line), args[1], true, line);
+	return args[1];
+}
+
+Object Flush(Object* args, u16 line) {
+	FileObj* file = ExpectFile(args[0], true, line);
+	if (!file->Flush())
+		ErrorRT(line, "Could not write to file: " + file->path + ".");
+	return args[0];
+}
+
+const Builtin file_builtins[] = {
+	{"lines", 1, Lines, TYPE_FILE},
+	{"records", 2, Records, TYPE_FILE},
+	{"next", 1, Next},
+	{"writer", 1, Writer, TYPE_FILE},
+	{"write", 2, Write},
+	{"write_line", 2, WriteLine},
+	{"flush", 1, Flush, TYPE_FILE},
+};
+
+#endif
@@ -0,0 +1,184 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+#include <atomic>
+#include <string>
+#include <utility>
+#include <variant>
+#include <vector>
+
+// Included from util.h, after the integer typedefs
+
+/*
+Runtime objects that live on the heap (strings, function values, maps,
+environments and so on) are reference counted and freed as soon as the
+last Ref to them goes away. There is no cycle collector: a map or channel
+that ends up holding itself, directly or not, is never freed.
+*/
+
+class HeapObject {
+public:
+	u32 refs = 0; // Updated atomically while threads_share_objects is set
+	size_t bytes = 0; // Recorded when allocated, for the heap statistics
+	virtual ~HeapObject() {}
+	virtual size_t Bytes() { return sizeof(*this); }
+};
+
+struct HeapStats {
+	u64 allocated = 0;
+	u64 freed = 0;
+	u64 live_bytes = 0;
+	u64 peak_bytes = 0;
+	// Objects can be freed on another thread than the one that made them, so
+	// only the sum over threads is meaningful. Peaks add up to an upper bound.
+	void Merge(const HeapStats& other) {
+		allocated += other.allocated;
+		freed += other.freed;
+		live_bytes += other.live_bytes;
+		peak_bytes += other.peak_bytes;
+	}
+};
+
+class Heap {
+public:
+	HeapStats stats;
+	template <typename T, typename... Args>
+	T* New(Args&&... args) {
+		T* obj = new T(std::forward<Args>(args)...);
+		obj->bytes = obj->Bytes();
+		stats.allocated++;
+		stats.live_bytes += obj->bytes;
+		if (stats.live_bytes > stats.peak_bytes)
+			stats.peak_bytes = stats.live_bytes;
+		return obj;
+	}
+	// For an object that grew or shrank in place since it was made
+	void Resized(HeapObject* obj) {
+		stats.live_bytes -= obj->bytes;
+		obj->bytes = obj->Bytes();
+		stats.live_bytes += obj->bytes;
+		if (stats.live_bytes > stats.peak_bytes)
+			stats.peak_bytes = stats.live_bytes;
+	}
+	void Free(HeapObject* obj) {
+		stats.freed++;
+		stats.live_bytes -= obj->bytes;
+		delete obj;
+	}
+};
+
+thread_local Heap heap; // Each thread counts its own allocations
+
+// Nonzero while other threads may hold Refs to the same objects, as during
+// a parallel loop. Reference counts only pay for atomic updates then.
+std::atomic<u32> threads_share_objects{0};
+
+// Owning handle to a heap object
+template <typename T>
+class Ref {
+public:
+	Ref() {}
+	Ref(T* ptr) : mPtr(ptr) { Retain(); }
+	Ref(const Ref& other) : mPtr(other.mPtr) { Retain(); }
+	Ref(Ref&& other) noexcept : mPtr(other.mPtr) { other.mPtr = 0; }
+	~Ref() { Release(); }
+	Ref& operator=(const Ref& other) {
+		if (mPtr == other.mPtr) return *this;
+		Release();
+		mPtr = other.mPtr;
+		Retain();
+		return *this;
+	}
+	Ref& operator=(Ref&& other) noexcept {
+		if (this == &other) return *this;
+		Release();
+		mPtr = other.mPtr;
+		other.mPtr = 0;
+		return *this;
+	}
+	T* Get() const { return mPtr; }
+	T* operator->() const { return mPtr; }
+	T& operator*() const { return *mPtr; }
+	explicit operator bool() const { return mPtr != 0; }
+private:
+	T* mPtr = 0;
+	void Retain() {
+		if (!mPtr) return;
+		if (threads_share_objects.load(std::memory_order_relaxed))
+			__atomic_fetch_add(&mPtr->refs, 1, __ATOMIC_RELAXED);
+		else
+			mPtr->refs++;
+	}
+	void Release() {
+		if (!mPtr) return;
+		u32 left;
+		if (threads_share_objects.load(std::memory_order_relaxed))
+			left = __atomic_sub_fetch(&mPtr->refs, 1, __ATOMIC_ACQ_REL);
+		else
+			left = --mPtr->refs;
+		if (left == 0)
+			heap.Free(mPtr);
+		mPtr = 0;
+	}
+};
+
+class StringObj : public HeapObject {
+public:
+	std::string value;
+	StringObj(std::string value) : value(std::move(value)) {}
+	size_t Bytes() { return sizeof(*this) + value.capacity(); }
+	// Only for a string nothing else holds, as a for-in loop over a file's
+	// lines reuses its variable's (files.h)
+	void Assign(const char* data, size_t size) {
+		value.assign(data, size);
+		mHash.store(0, std::memory_order_relaxed);
+	}
+	// Computed on first use and kept, since shared strings never change (map.h)
+	u64 Hash() {
+		u64 hash = mHash.load(std::memory_order_relaxed);
+		if (hash) return hash;
+		hash = 14695981039346656037ull; // FNV-1a
+		for (char c : value)
+			hash = (hash ^ (u8)c) * 1099511628211ull;
+		hash ^= hash >> 32; // The low bits pick the slot, so fold the high ones in
+		hash |= hash == 0;
+		mHash.store(hash, std::memory_order_relaxed);
+		return hash;
+	}
+private:
+	std::atomic<u64> mHash{0}; // 0 until Hash() is first called
+};
+
+class Stmt;
+class Function;
+class TaskObj; // Defined in tasks.h, like ChannelObj
+class ChannelObj;
+class MapObj; // In map.h
+class FileObj; // In files.h
+class MemoTable; // In memo.h, like the functions below
+MemoTable* NewMemoTable();
+void FreeMemoTable(MemoTable* table);
+using Object = std::variant<bool, float, Ref<StringObj>, Ref<Function>, Ref<TaskObj>, Ref<ChannelObj>, Ref<MapObj>, Ref<FileObj>>;
+
+// A built-in function's code; 'args' are its arguments on the value stack
+typedef Object (*NativeFn)(Object* args, u16 line);
+
+// A function value. It owns the body rather than the FnDeclStmt that
+// created it, since the value can outlive that statement.
+class Function : public HeapObject {
+public:
+	std::string name;
+	std::vector<std::string> params; // Slots 0..params.size()-1 of the frame
+	std::vector<Stmt*> body;
+	u32 frame_size = 0; // Parameters plus every local declared in the body
+	NativeFn native = 0; // Set for built-ins, which have no body
+	MemoTable* memo = 0; // Results so far of a 'memo' function
+	Function(std::string name, std::vector<std::string> params, std::vector<Stmt*> body, u32 frame_size)
+		: name(std::move(name)), params(std::move(params)), body(std::move(body)), frame_size(frame_size) {}
+	Function(std::string name, u32 arity, NativeFn native)
+		: name(std::move(name)), params(arity), frame_size(arity), native(native) {}
+	~Function(); // Defined in AST.h, where statements can be destroyed
+	size_t Bytes() { return sizeof(*this); }
+};
+
+#endif
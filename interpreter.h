@@ -3,21 +3,25 @@
 
 #include "util.h"
 #include "AST.h"
+#include "stats.h"
 #include <cmath>
 
-class Environment {
+class Environment : public HeapObject {
 public:
-	Environment* enclosing = 0;
-	Environment() {}
-	Environment(Environment* enclosing) : enclosing(enclosing) {}
+	Ref<Environment> enclosing;
+	Environment() { stats.environments++; }
+	Environment(Environment* enclosing) : enclosing(enclosing) { stats.environments++; }
 	std::unordered_map<std::string, Object> values;
-	void Destroy() {
-		if (enclosing)
-			enclosing->Destroy();
-	}
+	bool frozen = false; // Read-only while a parallel loop runs, and in tasks
+	u64 version = 0; // Bumped by every change, so tasks.h can reuse a copy
+	Ref<Environment> snapshot; // That copy, taken at 'snapshot_version'
+	u64 snapshot_version = 0;
+	std::vector<std::string> imported; // Canonical paths of the modules run in these globals
+	size_t Bytes() { return sizeof(*this); }
 	Object Get(const Token& name) {
-		if (values.count(name.lexeme))
-			return values[name.lexeme];
+		auto iter = values.find(name.lexeme);
+		if (iter != values.end())
+			return iter->second;
 		
 		if (enclosing)
 			return enclosing->Get(name);
@@ -26,10 +30,14 @@ public:
 		return Object(0.0f); // Unreachable
 	}
 	void Define(std::string name, Object value) {
+		version++;
 		values[name] = value;
 	}
 	Object Assign(Token name, Object value) {
 		if (values.count(name.lexeme)) {
+			if (frozen)
+				ErrorRT(name.line, "'" + name.lexeme + "' is read-only in tasks and parallel loops.");
+			version++;
 			values[name.lexeme] = value;
 			return value;
 		}
@@ -38,10 +46,87 @@ public:
 			return value;
 		}
 		ErrorRT(name.line, "Undefined variable '" + name.lexeme + "'.");
+		return value; // Unreachable
+	}
+};
+
+// The running script's state is per thread, since green threads
+// (scheduler.h) run scripts on several threads at once
+void DefineBuiltins(Environment* env); // In builtins.h
+Ref<Environment> NewGlobals() {
+	Ref<Environment> env = heap.New<Environment>();
+	DefineBuiltins(env.Get());
+	return env;
+}
+
+thread_local Ref<Environment> globals = NewGlobals();
+thread_local Environment* environment = globals.Get();
+
+// Creates a child of the current environment for a block or loop, and
+// switches back (freeing the child) when it goes out of scope
+class ScopedEnvironment {
+public:
+	ScopedEnvironment() : mPrev(environment), mScope(heap.New<Environment>(environment)) {
+		environment = mScope.Get();
 	}
+	~ScopedEnvironment() { environment = mPrev; }
+private:
+	Environment* mPrev;
+	Ref<Environment> mScope;
 };
 
-Environment* environment = new Environment();
+// Function frames: arguments and locals of every active call, contiguous
+const u32 STACK_SIZE = 1 << 16;
+const u32 MAX_CALL_DEPTH = 1024; // Non-tail calls nest C++ frames; this keeps them inside an 8 MB stack
+thread_local std::vector<Object> value_stack; // Sized on the first call
+thread_local u32 value_stack_size = STACK_SIZE;
+thread_local Object* frame = 0;
+thread_local u32 stack_top = 0;
+thread_local u32 call_depth = 0;
+thread_local Object return_value;
+thread_local Function* tail_callee = 0;
+
+const i32 MAX_INT_POWER = 4;
+const u32 MAX_CSE_TEMPS = 16;
+thread_local Object cse_temps[MAX_CSE_TEMPS]; // Shared values of one expression, which makes no calls
+
+// Loop iterations and calls left before a green thread yields. Outside the
+// scheduler it never runs out, so the check is one decrement and a branch.
+thread_local i64 budget = INT64_MAX;
+void Preempt(); // In scheduler.h
+inline void Tick() {
+	if (--budget < 0) Preempt();
+}
+
+// Everything above for a script that isn't running, such as a green thread
+// between its slices. Swap() trades it with the thread's current state.
+struct InterpreterState {
+	Ref<Environment> globals;
+	Environment* environment;
+	std::vector<Object> value_stack;
+	u32 value_stack_size = STACK_SIZE;
+	Object* frame = 0;
+	u32 stack_top = 0;
+	u32 call_depth = 0;
+	Object return_value;
+	Function* tail_callee = 0;
+	Object cse_temps[MAX_CSE_TEMPS];
+	InterpreterState() : InterpreterState(NewGlobals()) {}
+	explicit InterpreterState(Ref<Environment> globals) : globals(globals), environment(globals.Get()) {}
+	void Swap() {
+		std::swap(globals, ::globals);
+		std::swap(environment, ::environment);
+		std::swap(value_stack, ::value_stack);
+		std::swap(value_stack_size, ::value_stack_size);
+		std::swap(frame, ::frame);
+		std::swap(stack_top, ::stack_top);
+		std::swap(call_depth, ::call_depth);
+		std::swap(return_value, ::return_value);
+		std::swap(tail_callee, ::tail_callee);
+		for (u32 i = 0; i < MAX_CSE_TEMPS; i++)
+			std::swap(cse_temps[i], ::cse_temps[i]);
+	}
+};
 
 bool ObjIsTruthy(Object obj) {
 	switch(obj.index()) {
@@ -50,7 +135,13 @@ bool ObjIsTruthy(Object obj) {
 	case TYPE_NUMBER:
 		return std::get<TYPE_NUMBER>(obj) != 0;
 	case TYPE_STRING:
-		return std::get<TYPE_STRING>(obj).size() != 0;
+		return ObjStr(obj).size() != 0;
+	case TYPE_FUNCTION:
+	case TYPE_TASK:
+	case TYPE_CHANNEL:
+	case TYPE_MAP:
+	case TYPE_FILE:
+		return true;
 	}
 	return false; // Unreachable
 }
@@ -62,10 +153,42 @@ bool ObjEqual(Object l, Object r) {
 	if (l.index() == TYPE_NUMBER && r.index() == TYPE_NUMBER)
 		return std::get<TYPE_NUMBER>(l) == std::get<TYPE_NUMBER>(r);
 	if (l.index() == TYPE_STRING && r.index() == TYPE_STRING)
-		return std::get<TYPE_STRING>(l) == std::get<TYPE_STRING>(r);
+		return std::get<TYPE_STRING>(l).Get() == std::get<TYPE_STRING>(r).Get() || ObjStr(l) == ObjStr(r);
+	if (l.index() == TYPE_FUNCTION && r.index() == TYPE_FUNCTION)
+		return std::get<TYPE_FUNCTION>(l).Get() == std::get<TYPE_FUNCTION>(r).Get();
+	if (l.index() == TYPE_TASK && r.index() == TYPE_TASK)
+		return std::get<TYPE_TASK>(l).Get() == std::get<TYPE_TASK>(r).Get();
+	if (l.index() == TYPE_CHANNEL && r.index() == TYPE_CHANNEL)
+		return std::get<TYPE_CHANNEL>(l).Get() == std::get<TYPE_CHANNEL>(r).Get();
+	if (l.index() == TYPE_MAP && r.index() == TYPE_MAP)
+		return std::get<TYPE_MAP>(l).Get() == std::get<TYPE_MAP>(r).Get();
+	if (l.index() == TYPE_FILE && r.index() == TYPE_FILE)
+		return std::get<TYPE_FILE>(l).Get() == std::get<TYPE_FILE>(r).Get();
 	return false;
 }
 
+// Small integer powers are multiplied out in double precision, where the
+// square is exact. std::pow on floats isn't correctly rounded, so this also
+// makes 'x ** 2' agree with a plain multiplication.
+float IntPower(float base, i32 exponent) {
+	double result = base;
+	for (i32 i = 1; i < exponent; i++)
+		result *= base;
+	return (float)result;
+}
+float Power(float base, float exponent) {
+	if (exponent >= 2 && exponent <= MAX_INT_POWER && exponent == (i32)exponent)
+		return IntPower(base, (i32)exponent);
+	return std::pow(base, exponent);
+}
+// Same as the '%' operator for a power of two modulus
+float MaskModulo(float value, i32 modulus) {
+	i32 a = (i32)std::floor(value);
+	i32 result = a & (modulus - 1);
+	if (a < 0 && result) result -= modulus; // '%' keeps the sign of the dividend
+	return (float)result;
+}
+
 void CheckNumberOperand(Token op, Object right) {
 	if (right.index() == TYPE_NUMBER) return;
 	ErrorRT(op.line, "Expected the operand following '-' to be a number.");
@@ -75,72 +198,307 @@ void CheckNumberOperands(Token op, Object left, Object right) {
 	ErrorRT(op.line, "Expected both operands of the '" + op.lexeme + "' operator to be numbers.");
 }
 
-void PrintStmt::Evaluate() {
-	std::cout << ObjToStr(expr->Evaluate()) << "\n";
+Flow PrintStmt::Evaluate() {
+	PrintObj(expr->Evaluate());
+	return Flow::NORMAL;
+}
+
+Flow ExecuteAll(const std::vector<Stmt*>& statements) {
+	for (Stmt* stmt : statements) {
+		Flow flow = stmt->Evaluate();
+		if (flow != Flow::NORMAL) return flow;
+	}
+	return Flow::NORMAL;
+}
+
+u32 hot_loop_threshold = 1000; // Iterations before a loop runs compiled, 0 for never
+u32 hot_block_threshold = 2000; // Runs before a block does
+
+// Whether a loop or block has run often enough to run compiled. Nothing is
+// counted while threads share objects, since they'd share the counts.
+inline bool IsHot(const Hotness& hot, u32 threshold) {
+	return threshold && hot.count >= threshold && !hot.cold && !threads_share_objects.load(std::memory_order_relaxed);
+}
+// Counts one more run
+inline bool Heat(Hotness& hot, u32 threshold) {
+	if (hot.count < threshold && !threads_share_objects.load(std::memory_order_relaxed)) hot.count++;
+	return IsHot(hot, threshold);
 }
+// Run the rest of a hot loop or block compiled, false if it can't. In tiers.h.
+bool RunTier(WhileStmt* loop);
+bool RunTier(ForStmt* loop);
+bool RunTier(RangeForStmt* loop, float from, float to, float step);
+bool RunTier(BlockStmt* block, Flow& flow);
 
-void BlockStmt::Evaluate() {
-	Environment *prev = environment;
-	environment = new Environment(environment);
-	
-	for (Stmt* stmt : statements)
-		stmt->Evaluate();
-	environment = prev;
+Flow BlockStmt::Evaluate() {
+	Flow flow;
+	if (Heat(hot, hot_block_threshold) && RunTier(this, flow))
+		return flow;
+	if (!scoped)
+		return ExecuteAll(statements);
+	ScopedEnvironment scope;
+	return ExecuteAll(statements);
 }
 
-void ExprStmt::Evaluate() {
+Flow ExprStmt::Evaluate() {
 	expr->Evaluate();
+	return Flow::NORMAL;
 }
 
-void VarDeclStmt::Evaluate() {
-	environment->Define(identifier.lexeme, expr ? expr->Evaluate() : Object(0.0f));
+Flow VarDeclStmt::Evaluate() {
+	Object value = expr ? expr->Evaluate() : Object(0.0f);
+	if (slot >= 0)
+		frame[slot] = value;
+	else
+		environment->Define(identifier.lexeme, value);
+	return Flow::NORMAL;
 }
 
-void IfStmt::Evaluate() {
+Flow IfStmt::Evaluate() {
 	if (ObjIsTruthy(condition->Evaluate()))
-		then_branch->Evaluate();
+		return then_branch->Evaluate();
 	else if (else_branch)
-		else_branch->Evaluate();
+		return else_branch->Evaluate();
+	return Flow::NORMAL;
 }
 
-void WhileStmt::Evaluate() {
+Flow WhileStmt::Evaluate() {
+	if (IsHot(hot, hot_loop_threshold) && RunTier(this))
+		return Flow::NORMAL;
 	while (ObjIsTruthy(condition->Evaluate())) {
-		try {
-			statement->Evaluate();
-		} catch (BreakException e) {
-			break;
-		} catch (ContinueException e) {
-			continue;
-		}
+		Tick();
+		Flow flow = statement->Evaluate();
+		if (flow == Flow::BREAK) break;
+		if (flow == Flow::RETURN) return flow;
+		if (Heat(hot, hot_loop_threshold) && RunTier(this)) break;
 	}
+	return Flow::NORMAL;
 }
 
-void ForStmt::Evaluate() {
-	Environment *prev = environment;
-	environment = new Environment(environment);
+// Runs a loop whose variable lives in 'slot' on a native counter. The slot is
+// written once per iteration and nothing else is evaluated between bodies,
+// except 'tier_up', which gets the next value and returns true if it ran the
+// rest of the loop.
+template <typename Compare, typename TierUp>
+Flow CountedLoop(Object* slot, float counter, float limit, float step, bool floor_step, Stmt* body, Compare compare, TierUp tier_up) {
+	while (compare(counter, limit)) {
+		Tick();
+		*slot = counter;
+		Flow flow = body->Evaluate();
+		if (flow == Flow::BREAK) break;
+		if (flow == Flow::RETURN) return flow;
+		counter = floor_step ? std::floor(counter) + 1 : counter + step;
+		if (tier_up(counter)) break;
+	}
+	return Flow::NORMAL;
+}
 
-	for(initializer->Evaluate(); ObjIsTruthy(condition->Evaluate()); increment->Evaluate()) {
-		try {
-			body->Evaluate();
-		} catch (BreakException e) {
+Flow ForStmt::Evaluate() {
+	if (scoped) {
+		ScopedEnvironment scope;
+		return EvaluateLoop();
+	}
+	return EvaluateLoop();
+}
+
+Flow ForStmt::EvaluateLoop() {
+
+	Flow flow = Flow::NORMAL;
+	if (initializer)
+		initializer->Evaluate();
+	if (IsHot(hot, hot_loop_threshold) && RunTier(this))
+		return flow;
+	if (counted) {
+		// Falls through to the general loop if the operands aren't numbers,
+		// so the error comes from the same place it otherwise would
+		i32 counter_slot = ((VarDeclStmt*)initializer)->slot;
+		Object* slot = counter_slot >= 0 ? &frame[counter_slot] : &environment->values[counter.lexeme];
+		Object bound = limit->Evaluate();
+		if (slot->index() == TYPE_NUMBER && bound.index() == TYPE_NUMBER) {
+			float from = std::get<TYPE_NUMBER>(*slot);
+			float to = std::get<TYPE_NUMBER>(bound);
+			// The tier starts from the condition, with the counter already stepped
+			auto tier_up = [this, slot](float next) {
+				if (!Heat(hot, hot_loop_threshold)) return false;
+				*slot = next;
+				return RunTier(this);
+			};
+			switch (compare) {
+			case TokenType::LESS:
+				flow = CountedLoop(slot, from, to, step, floor_step, body, [](float a, float b) { return a < b; }, tier_up); break;
+			case TokenType::LESS_EQUAL:
+				flow = CountedLoop(slot, from, to, step, floor_step, body, [](float a, float b) { return a <= b; }, tier_up); break;
+			case TokenType::GREATER:
+				flow = CountedLoop(slot, from, to, step, floor_step, body, [](float a, float b) { return a > b; }, tier_up); break;
+			default:
+				flow = CountedLoop(slot, from, to, step, floor_step, body, [](float a, float b) { return a >= b; }, tier_up); break;
+			}
+			return flow;
+		}
+	}
+	while (!condition || ObjIsTruthy(condition->Evaluate())) {
+		Tick();
+		Flow result = body->Evaluate();
+		if (result == Flow::BREAK) break;
+		if (result == Flow::RETURN) {
+			flow = result;
 			break;
-		} catch (ContinueException e) {
-			continue;
 		}
+		if (increment)
+			increment->Evaluate();
+		if (Heat(hot, hot_loop_threshold) && RunTier(this)) break;
 	}
+	return flow;
+}
+
+Flow RangeForStmt::Evaluate() {
+	Object from = start->Evaluate();
+	Object to = end->Evaluate();
+	Object by = step ? step->Evaluate() : Object(1.0f);
+	if (from.index() != TYPE_NUMBER || to.index() != TYPE_NUMBER || by.index() != TYPE_NUMBER)
+		ErrorRT(identifier.line, "Expected the bounds and step of a range to be numbers.");
+	float increment = std::get<TYPE_NUMBER>(by);
+	if (increment == 0)
+		ErrorRT(identifier.line, "The step of a range can't be zero.");
+	if (parallel)
+		return EvaluateParallel(std::get<TYPE_NUMBER>(from), std::get<TYPE_NUMBER>(to), increment);
 
-	environment = prev;
+	float first = std::get<TYPE_NUMBER>(from), last = std::get<TYPE_NUMBER>(to);
+	if (IsHot(hot, hot_loop_threshold) && RunTier(this, first, last, increment))
+		return Flow::NORMAL;
+	auto tier_up = [&](float next) {
+		return Heat(hot, hot_loop_threshold) && RunTier(this, next, last, increment);
+	};
+	auto run = [&](Object* counter) {
+		if (increment > 0)
+			return CountedLoop(counter, first, last, increment, false, body, [](float a, float b) { return a < b; }, tier_up);
+		return CountedLoop(counter, first, last, increment, false, body, [](float a, float b) { return a > b; }, tier_up);
+	};
+	if (slot >= 0)
+		return run(&frame[slot]);
+	ScopedEnvironment scope;
+	// Element references in an unordered_map survive rehashing
+	return run(&environment->values[identifier.lexeme]);
 }
 
-void BreakStmt::Evaluate() {
-	throw BreakException();
+Flow BreakStmt::Evaluate() {
+	return Flow::BREAK;
 }
 
-void ContinueStmt::Evaluate() {
-	throw ContinueException();
+Flow ContinueStmt::Evaluate() {
+	return Flow::CONTINUE;
+}
+
+Flow FnDeclStmt::Evaluate() {
+	if (slot >= 0)
+		frame[slot] = Object(function);
+	else
+		environment->Define(name.lexeme, Object(function));
+	return Flow::NORMAL;
+}
+
+Flow ReturnStmt::Evaluate() {
+	if (tail)
+		((CallExpr*)value)->EvaluateTail();
+	else
+		return_value = value ? value->Evaluate() : Object(0.0f);
+	return Flow::RETURN;
+}
+
+// Runs 'fn' on the frame starting at value_stack[base], where the caller has
+// already stored the arguments. Tail calls reuse the same frame.
+Object CallFunction(Function* fn, u32 base, u16 line) {
+	if (call_depth >= MAX_CALL_DEPTH)
+		ErrorRT(line, "Stack overflow.");
+	Object* prev_frame = frame;
+	Environment* prev_env = environment;
+	environment = globals.Get(); // Functions only see their own locals and globals
+	call_depth++;
+	while (true) {
+		Tick();
+		if (base + fn->frame_size > value_stack.size())
+			ErrorRT(line, "Stack overflow.");
+		frame = &value_stack[base];
+		stack_top = base + fn->frame_size;
+		return_value = Object(0.0f);
+		ExecuteAll(fn->body);
+		if (!tail_callee) break;
+		fn = tail_callee;
+		tail_callee = 0;
+	}
+	call_depth--;
+	frame = prev_frame;
+	environment = prev_env;
+	stack_top = base;
+	return std::move(return_value);
+}
+
+Object CallMemo(Function* fn, u32 base, u16 line); // In memo.h
+
+Function* CheckCallable(const Object& callee, u32 arg_count, u16 line) {
+	if (callee.index() != TYPE_FUNCTION)
+		ErrorRT(line, "Can only call functions.");
+	Function* fn = std::get<TYPE_FUNCTION>(callee).Get();
+	if (fn->params.size() != arg_count)
+		ErrorRT(line, "Expected " + std::to_string(fn->params.size()) + " arguments but got " + std::to_string(arg_count) + ".");
+	return fn;
+}
+
+Object CallExpr::Evaluate() {
+	Function* fn = builtin ? 0 : CheckCallable(callee->Evaluate(), arguments.size(), paren.line);
+	NativeFn native = builtin ? builtin->fn : fn->native;
+	if (value_stack.empty())
+		value_stack.resize(value_stack_size);
+	// Arguments are evaluated straight into the callee's frame; stack_top
+	// moves past each one so calls inside later arguments don't clobber it
+	u32 base = stack_top;
+	if (base + arguments.size() > value_stack.size())
+		ErrorRT(paren.line, "Stack overflow.");
+	for (Expr* arg : arguments)
+		value_stack[stack_top++] = arg->Evaluate();
+	if (native) {
+		Object result = native(&value_stack[base], paren.line);
+		// Let go of the arguments now, so a string passed in is held by the
+		// caller alone again (see SetString in files.h)
+		while (stack_top > base)
+			value_stack[--stack_top] = false;
+		return result;
+	}
+	if (fn->memo)
+		return CallMemo(fn, base, paren.line);
+	return CallFunction(fn, base, paren.line);
+}
+
+// 'return f(...)': the arguments replace the current frame's and
+// CallFunction picks up 'tail_callee' once the current body unwinds
+void CallExpr::EvaluateTail() {
+	Function* fn = builtin ? 0 : CheckCallable(callee->Evaluate(), arguments.size(), paren.line);
+	NativeFn native = builtin ? builtin->fn : fn->native;
+	u32 temp = stack_top;
+	if (temp + arguments.size() > value_stack.size())
+		ErrorRT(paren.line, "Stack overflow.");
+	for (Expr* arg : arguments)
+		value_stack[stack_top++] = arg->Evaluate();
+	if (native) {
+		return_value = native(&value_stack[temp], paren.line);
+		while (stack_top > temp)
+			value_stack[--stack_top] = false;
+		return;
+	}
+	// Its result is only kept if it returns to here
+	if (fn->memo) {
+		return_value = CallMemo(fn, temp, paren.line);
+		return;
+	}
+	for (u32 i = 0; i < arguments.size(); i++)
+		frame[i] = std::move(value_stack[temp + i]);
+	stack_top = temp;
+	tail_callee = fn;
 }
 
 Object AssignExpr::Evaluate() {
+	if (slot >= 0)
+		return frame[slot] = expr->Evaluate();
 	return environment->Assign(identifier, expr->Evaluate());
 }
 
@@ -154,10 +512,10 @@ Object IfExpr::Evaluate() {
 Object LogicExpr::Evaluate() {
 	Object l = left->Evaluate();
 	if (op.type == TokenType::OR) {
-		if (ObjIsTruthy(l)) return left;
+		if (ObjIsTruthy(l)) return l;
 	}
 	else {
-		if (!ObjIsTruthy(l)) return left;
+		if (!ObjIsTruthy(l)) return l;
 	}
 	return right->Evaluate();
 }
@@ -168,47 +526,49 @@ Object BinaryExpr::Evaluate() {
 
 	switch(op.type) {
 	case TokenType::PLUS:
-		if (l.index() == TYPE_NUMBER && r.index() == TYPE_NUMBER)
-			return std::get<TYPE_NUMBER>(l) + std::get<TYPE_NUMBER>(r);
+		if (numeric || (l.index() == TYPE_NUMBER && r.index() == TYPE_NUMBER))
+			return ObjNum(l) + ObjNum(r);
 		if (l.index() == TYPE_STRING && r.index() == TYPE_STRING)
-			return std::get<TYPE_STRING>(l) + std::get<TYPE_STRING>(r);
+			return MakeString(ObjStr(l) + ObjStr(r));
 	case TokenType::MINUS:
-		CheckNumberOperands(op, l, r);
-		return std::get<TYPE_NUMBER>(l) - std::get<TYPE_NUMBER>(r);
+		if (!numeric) CheckNumberOperands(op, l, r);
+		return ObjNum(l) - ObjNum(r);
 	case TokenType::STAR:
-		CheckNumberOperands(op, l, r);
-		return std::get<TYPE_NUMBER>(l) * std::get<TYPE_NUMBER>(r);
+		if (!numeric) CheckNumberOperands(op, l, r);
+		return ObjNum(l) * ObjNum(r);
 	case TokenType::SLASH:
-		CheckNumberOperands(op, l, r);
-		return std::get<TYPE_NUMBER>(l) / std::get<TYPE_NUMBER>(r);
+		if (!numeric) CheckNumberOperands(op, l, r);
+		return ObjNum(l) / ObjNum(r);
 	case TokenType::MODULO:
-		CheckNumberOperands(op, l, r);
-		return (float)((i32)std::floor(std::get<TYPE_NUMBER>(l)) % (i32)std::floor(std::get<TYPE_NUMBER>(r)));
+		if (!numeric) CheckNumberOperands(op, l, r);
+		return (float)((i32)std::floor(ObjNum(l)) % (i32)std::floor(ObjNum(r)));
 	case TokenType::STAR_STAR:
-		CheckNumberOperands(op, l, r);
-		return std::pow(std::get<TYPE_NUMBER>(l), std::get<TYPE_NUMBER>(r));
+		if (!numeric) CheckNumberOperands(op, l, r);
+		return Power(ObjNum(l), ObjNum(r));
 
 	case TokenType::EQUAL_EQUAL:
 		return ObjEqual(l, r);
 	case TokenType::BANG_EQUAL:
 		return !ObjEqual(l, r);
 	case TokenType::LESS:
-		CheckNumberOperands(op, l, r);
-		return std::get<TYPE_NUMBER>(l) < std::get<TYPE_NUMBER>(r);
+		if (!numeric) CheckNumberOperands(op, l, r);
+		return ObjNum(l) < ObjNum(r);
 	case TokenType::LESS_EQUAL:
-		CheckNumberOperands(op, l, r);
-		return std::get<TYPE_NUMBER>(l) <= std::get<TYPE_NUMBER>(r);
+		if (!numeric) CheckNumberOperands(op, l, r);
+		return ObjNum(l) <= ObjNum(r);
 	case TokenType::GREATER:
-		CheckNumberOperands(op, l, r);
-		return std::get<TYPE_NUMBER>(l) > std::get<TYPE_NUMBER>(r);
+		if (!numeric) CheckNumberOperands(op, l, r);
+		return ObjNum(l) > ObjNum(r);
 	case TokenType::GREATER_EQUAL:
-		CheckNumberOperands(op, l, r);
-		return std::get<TYPE_NUMBER>(l) >= std::get<TYPE_NUMBER>(r);
+		if (!numeric) CheckNumberOperands(op, l, r);
+		return ObjNum(l) >= ObjNum(r);
 	}
 	return Object(); // Unreachable
 }
 
 Object VarExpr::Evaluate() {
+	if (slot >= 0)
+		return frame[slot];
 	return environment->Get(identifier);
 }
 
@@ -218,15 +578,17 @@ Object UnaryExpr::Evaluate() {
 	case TokenType::BANG:
 		return !ObjIsTruthy(e);
 	case TokenType::MINUS:
-		CheckNumberOperand(op, e);
-		return -std::get<TYPE_NUMBER>(e);
+		if (!numeric) CheckNumberOperand(op, e);
+		return -ObjNum(e);
 	case TokenType::PLUS_PLUS:
 		if (expr->Type() == NodeType::VAR_EXPR) {
-			CheckNumberOperand(op, e);
+			if (!numeric) CheckNumberOperand(op, e);
 			Object old = e;
-			e = environment->Assign(
-				((VarExpr*)expr)->identifier,
-				std::floor(std::get<TYPE_NUMBER>(e)) + 1);
+			VarExpr* var = (VarExpr*)expr;
+			if (var->slot >= 0)
+				e = frame[var->slot] = std::floor(ObjNum(e)) + 1;
+			else
+				e = environment->Assign(var->identifier, std::floor(ObjNum(e)) + 1);
 			if (postfix) return old;
 			else return e;
 		}
@@ -244,4 +606,24 @@ Object LiteralExpr::Evaluate() {
 	return value;
 }
 
+Object ReducedExpr::Evaluate() {
+	float value = ObjNum(expr->Evaluate());
+	switch (kind) {
+	case POWER:
+		return IntPower(value, (i32)constant);
+	case SCALE:
+		return value * constant;
+	default:
+		return MaskModulo(value, (i32)constant);
+	}
+}
+
+Object CseDefExpr::Evaluate() {
+	return cse_temps[temp] = expr->Evaluate();
+}
+
+Object CseUseExpr::Evaluate() {
+	return cse_temps[temp];
+}
+
 #endif
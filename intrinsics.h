@@ -0,0 +1,100 @@
+#ifndef INTRINSICS_H
+#define INTRINSICS_H
+
+#include "util.h"
+#include "AST.h"
+#include "interpreter.h"
+#include <chrono>
+#include <cmath>
+
+/*
+Clocks, math and substrings, so scripts can time themselves and don't
+have to compute sqrt(x) or floor(x) in interpreted code.
+
+Numbers are floats, which hold 24 bits. clock() counts seconds and
+clock_ns() nanoseconds since the program started: clock_ns() is exact for
+its first 16 ms and keeps about 7 significant digits after that, so it
+suits short sections and clock() longer ones.
+*/
+
+const std::chrono::steady_clock::time_point program_start = std::chrono::steady_clock::now();
+
+float ExpectNumber(const Object& obj, u16 line) {
+	if (obj.index() != TYPE_NUMBER)
+		ErrorRT(line, "Expected a number.");
+	return ObjNum(obj);
+}
+
+Object Clock(Object*, u16) {
+	return std::chrono::duration<float>(std::chrono::steady_clock::now() - program_start).count();
+}
+
+Object ClockNs(Object*, u16) {
+	return (float)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - program_start).count();
+}
+
+Object Sqrt(Object* args, u16 line) {
+	return std::sqrt(ExpectNumber(args[0], line));
+}
+
+Object Sin(Object* args, u16 line) {
+	return std::sin(ExpectNumber(args[0], line));
+}
+
+Object Cos(Object* args, u16 line) {
+	return std::cos(ExpectNumber(args[0], line));
+}
+
+Object Log(Object* args, u16 line) {
+	return std::log(ExpectNumber(args[0], line));
+}
+
+Object Exp(Object* args, u16 line) {
+	return std::exp(ExpectNumber(args[0], line));
+}
+
+Object Floor(Object* args, u16 line) {
+	return std::floor(ExpectNumber(args[0], line));
+}
+
+Object Abs(Object* args, u16 line) {
+	return std::fabs(ExpectNumber(args[0], line));
+}
+
+Object Min(Object* args, u16 line) {
+	return std::fmin(ExpectNumber(args[0], line), ExpectNumber(args[1], line));
+}
+
+Object Max(Object* args, u16 line) {
+	return std::fmax(ExpectNumber(args[0], line), ExpectNumber(args[1], line));
+}
+
+// The 'count' bytes from 'start', or as many as there are
+Object Substring(Object* args, u16 line) {
+	if (args[0].index() != TYPE_STRING)
+		ErrorRT(line, "Expected a string.");
+	const std::string& text = ObjStr(args[0]);
+	float start = ExpectNumber(args[1], line), count = ExpectNumber(args[2], line);
+	if (start < 0 || start > text.size() || start != (u32)start)
+		ErrorRT(line, "Expected the start of a substring to be a whole number from 0 to " + std::to_string(text.size()) + ".");
+	if (count < 0 || count != std::floor(count))
+		ErrorRT(line, "Expected the length of a substring to be a whole number from 0 up.");
+	return MakeString(text.substr((u32)start, std::min<double>(count, text.size())));
+}
+
+const Builtin intrinsic_builtins[] = {
+	{"clock", 0, Clock, TYPE_NUMBER},
+	{"clock_ns", 0, ClockNs, TYPE_NUMBER},
+	{"sqrt", 1, Sqrt, TYPE_NUMBER, true},
+	{"sin", 1, Sin, TYPE_NUMBER, true},
+	{"cos", 1, Cos, TYPE_NUMBER, true},
+	{"log", 1, Log, TYPE_NUMBER, true},
+	{"exp", 1, Exp, TYPE_NUMBER, true},
+	{"floor", 1, Floor, TYPE_NUMBER, true},
+	{"abs", 1, Abs, TYPE_NUMBER, true},
+	{"min", 2, Min, TYPE_NUMBER, true},
+	{"max", 2, Max, TYPE_NUMBER, true},
+	{"substring", 3, Substring, TYPE_STRING, true},
+};
+
+#endif
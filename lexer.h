@@ -3,52 +3,76 @@
 
 #include "util.h"
 #include "token.h"
+#include <charconv>
 
 class Lexer {
 public:
 	std::vector<Token> tokens;
-	bool Lex(const std::string source) {
+	std::ostream* errors = &std::cout; // Modules (modules.h) keep theirs to print on import
+	bool Lex(const std::string& source) {
+		Begin(source, 0, 1);
+		ScanUntil(mSource.size());
+		End();
+		return mHadError;
+	}
+	// For lexing part of a file: Begin() at a token boundary, then ScanUntil()
+	// as often as needed and End() to add the EOF token
+	void Begin(const std::string& source, u32 offset, u32 line) {
 		mSource = source;
-		mStart = 0;
-		mCurrent = 0;
-		mLine = 1;
+		mStart = offset;
+		mCurrent = offset;
+		mLine = line;
 		mHadError = false;
 		tokens.clear();
-		mKeywords["var"] = TokenType::VAR;
-		mKeywords["print"] = TokenType::PRINT;
-		mKeywords["true"] = TokenType::TRUE;
-		mKeywords["false"] = TokenType::FALSE;
-		mKeywords["and"] = TokenType::AND;
-		mKeywords["or"] = TokenType::OR;
-		mKeywords["if"] = TokenType::IF;
-		mKeywords["else"] = TokenType::ELSE;
-		mKeywords["while"] = TokenType::WHILE;
-		mKeywords["for"] = TokenType::FOR;
-		mKeywords["break"] = TokenType::BREAK;
-		mKeywords["continue"] = TokenType::CONTINUE;
-		mKeywords["class"] = TokenType::CLASS;
-		mKeywords["fn"] = TokenType::FN;
-		mKeywords["return"] = TokenType::RETURN;
-		ScanTokens();
-		return mHadError;
 	}
-private:
-	std::string mSource;
-	u32 mStart = 0;
-	u32 mCurrent = 0;
-	u32 mLine = 1;
-	bool mHadError = false;
-	std::unordered_map<std::string, TokenType> mKeywords;
-	void ScanTokens() {
-		while (!AtEnd()) {
+	// Scans up to the first token boundary at or past 'stop' and returns it
+	u32 ScanUntil(u32 stop) {
+		while (!AtEnd() && mCurrent < stop) {
 			mStart = mCurrent;
 			ScanToken();
 		}
+		return mCurrent;
+	}
+	void End() {
 		Token eof;
 		eof.line = mLine;
 		eof.type = TokenType::EOF;
+		eof.offset = mCurrent;
 		tokens.push_back(eof);
 	}
+	bool HadError() { return mHadError; }
+	u32 Line() { return mLine; }
+private:
+	std::string mSource;
+	u32 mStart = 0;
+	u32 mCurrent = 0;
+	u32 mLine = 1;
+	bool mHadError = false;
+	// Made once for all lexers, since modules and the REPL make many
+	static const std::unordered_map<std::string, TokenType>& Keywords() {
+		static const std::unordered_map<std::string, TokenType> keywords = {
+			{"var", TokenType::VAR},
+			{"print", TokenType::PRINT},
+			{"true", TokenType::TRUE},
+			{"false", TokenType::FALSE},
+			{"and", TokenType::AND},
+			{"or", TokenType::OR},
+			{"if", TokenType::IF},
+			{"else", TokenType::ELSE},
+			{"while", TokenType::WHILE},
+			{"for", TokenType::FOR},
+			{"in", TokenType::IN},
+			{"break", TokenType::BREAK},
+			{"continue", TokenType::CONTINUE},
+			{"class", TokenType::CLASS},
+			{"fn", TokenType::FN},
+			{"return", TokenType::RETURN},
+			{"spawn", TokenType::SPAWN},
+			{"import", TokenType::IMPORT},
+			{"snapshot", TokenType::SNAPSHOT},
+		};
+		return keywords;
+	}
 	void ScanToken() {
 		char c = Advance();
 		switch (c) {
@@ -77,6 +101,15 @@ private:
 			case '{': AddToken(TokenType::LEFT_BRACE); break;
 			case '}': AddToken(TokenType::RIGHT_BRACE); break;
 			case ';': AddToken(TokenType::SEMICOLON); break;
+			case ':': AddToken(TokenType::COLON); break;
+			case ',': AddToken(TokenType::COMMA); break;
+			case '.':
+				if (Match('.')) AddToken(TokenType::DOT_DOT);
+				else {
+					Error(mLine, "Unexpected character: '.'.");
+					mHadError = true;
+				}
+				break;
 			case '"': String(); break;
 			default:
 				if (isdigit(c))
@@ -91,13 +124,88 @@ private:
 				break;
 		}
 	}
+	// Number literals are parsed straight out of mSource: decimal with an
+	// optional fraction and exponent, 0x hex or 0b binary, all of which may
+	// use '_' as a digit separator
 	void Number() {
-		while (isdigit(Peek())) Advance();
+		if (mSource[mStart] == '0' && (Peek() == 'x' || Peek() == 'X'))
+			return RadixNumber(16);
+		if (mSource[mStart] == '0' && (Peek() == 'b' || Peek() == 'B'))
+			return RadixNumber(2);
+
+		bool separators = false;
+		auto digits = [&]() {
+			while (isdigit(Peek()) || Peek() == '_') {
+				separators = separators || Peek() == '_';
+				Advance();
+			}
+		};
+		digits();
 		if (Peek() == '.' && isdigit(PeekNext())) {
 			Advance();
-			while (isdigit(Peek())) Advance();
+			digits();
+		}
+		if (Peek() == 'e' || Peek() == 'E') {
+			char next = PeekNext();
+			bool sign = next == '+' || next == '-';
+			if (isdigit(next) || (sign && isdigit(PeekAt(mCurrent + 2)))) {
+				Advance();
+				if (sign) Advance();
+				digits();
+			}
+		}
+
+		const char* first = mSource.data() + mStart;
+		const char* last = mSource.data() + mCurrent;
+		char stripped[64];
+		if (separators) {
+			if (last - first > (i64)sizeof(stripped)) {
+				Error(mLine, "Number literal is too long.");
+				mHadError = true;
+				return;
+			}
+			char* out = stripped;
+			for (const char* c = first; c != last; c++)
+				if (*c != '_') *out++ = *c;
+			first = stripped;
+			last = out;
+		}
+		float value = 0;
+		auto result = std::from_chars(first, last, value);
+		if (result.ec == std::errc::result_out_of_range) {
+			Error(mLine, "Number literal is out of range.");
+			mHadError = true;
+		}
+		AddToken(TokenType::NUMBER, Object(value));
+	}
+	void RadixNumber(u32 radix) {
+		Advance(); // 'x' or 'b'
+		u64 value = 0;
+		u32 digit_count = 0;
+		bool overflow = false;
+		while (true) {
+			char c = Peek();
+			u32 digit;
+			if (c == '_') { Advance(); continue; }
+			if (isdigit(c)) digit = c - '0';
+			else if (radix == 16 && c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+			else if (radix == 16 && c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+			else break;
+			if (digit >= radix) break;
+			if (value > (UINT64_MAX - digit) / radix) overflow = true;
+			value = value * radix + digit;
+			digit_count++;
+			Advance();
+		}
+		if (digit_count == 0) {
+			Error(mLine, std::string("Expected digits after '0") + mSource[mStart + 1] + "'.");
+			mHadError = true;
 		}
-		AddToken(TokenType::NUMBER, Object(std::stof(mSource.substr(mStart, mCurrent-mStart))));
+		else if (overflow) {
+			Error(mLine, "Number literal is out of range.");
+			mHadError = true;
+		}
+		AddToken(TokenType::NUMBER, Object((float)value));
 	}
 	void String() {
 		while (Peek() != '"' && !AtEnd()) {
@@ -107,18 +215,19 @@ private:
 		}
 		if (AtEnd()) {
 			Error(mLine, "Unterminated string.");
+			mHadError = true;
 			return;
 		}
 		Advance();
 		
 		std::string value = mSource.substr(mStart + 1, mCurrent - mStart - 2);
-		AddToken(TokenType::STRING, value);
+		AddToken(TokenType::STRING, MakeString(value));
 	}
 	void Identifier() {
 		while (isalnum(Peek()) || Peek() == '_') Advance();
 		std::string text = mSource.substr(mStart, mCurrent - mStart);
-		auto iter = mKeywords.find(text);
-		if (iter == mKeywords.end())
+		auto iter = Keywords().find(text);
+		if (iter == Keywords().end())
 			AddToken(TokenType::IDENTIFIER);
 		else
 			AddToken(iter->second);
@@ -128,8 +237,9 @@ private:
 		tok.type = type;
 		tok.lexeme = mSource.substr(mStart, mCurrent - mStart);
 		tok.line = mLine;
+		tok.offset = mStart;
 		tok.literal = literal;
-		tokens.push_back(tok);
+		tokens.push_back(std::move(tok));
 	}
 	bool AtEnd() {
 		return mCurrent >= mSource.size();
@@ -142,8 +252,11 @@ private:
 		return mSource[mCurrent];
 	}
 	char PeekNext() {
-		if (mCurrent + 1 >= mSource.length()) return 0;
-		return mSource[mCurrent+1];
+		return PeekAt(mCurrent + 1);
+	}
+	char PeekAt(u32 index) {
+		if (index >= mSource.length()) return 0;
+		return mSource[index];
 	}
 	bool Match(char c) {
 		if (AtEnd() || c != mSource[mCurrent]) return false;
@@ -151,7 +264,7 @@ private:
 		return true;
 	}
 	void Error(u16 line, const std::string& message) {
-		std::cout << "Error on line " << line << ": " << message << "\n";
+		*errors << "Error on line " << line << ": " << message << "\n";
 	}
 };
 #endif
\ No newline at end of file
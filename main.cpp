@@ -1,12 +1,28 @@
-/*
-TODO:
-- while and for loops (maybe have ranges?)
-*/
-
+#define BOMAC_COUNT_ALLOCATIONS // For --stats, see stats.h
 #include "util.h"
 #include "lexer.h"
 #include "parser.h"
 #include "interpreter.h"
+#include "closure.h"
+#include "tiers.h"
+#include "types.h"
+#include "simplify.h"
+#include "server.h"
+#include "watch.h"
+#include "scheduler.h"
+#include "parallel.h"
+#include "pool.h"
+#include "tasks.h"
+#include "map.h"
+#include "files.h"
+#include "intrinsics.h"
+#include "memo.h"
+#include "builtins.h"
+#include "modules.h"
+#include "snapshot.h"
+#include "repl.h"
+#include "stats.h"
+#include "perf.h"
 #include <fstream>
 
 std::string ReadFile(const char* filename) {
@@ -22,44 +38,187 @@ std::string ReadFile(const char* filename) {
 	return result;
 }
 
+bool print_stats = false;
+bool stats_json = false;
+bool print_perf = false;
+bool perf_json = false;
+
+void BeginPhase(Stats::Phase phase) {
+	stats.Begin(phase);
+	if (print_perf) perf_counters.Begin(phase);
+}
+void EndPhase() {
+	if (print_perf) perf_counters.End();
+	stats.End();
+}
+// Registered with atexit() so runtime errors, which exit() directly, still report.
+// The thread's output is flushed by then: its destructor runs before atexit()'s.
+void Report() {
+	if (print_perf) perf_counters.Report(perf_json);
+	if (print_stats) stats.Report(stats_json);
+}
+
+void RunProgram(const std::vector<Stmt*>& statements, bool use_closures) {
+	snapshot_program = &statements;
+	ClosureCompiler compiler;
+	if (use_closures && compiler.Compile(statements)) {
+		compiler.Run();
+		for (Stmt* stmt : statements)
+			stmt->Destroy();
+	}
+	else {
+		for(int i = 0; i < statements.size(); i++) {
+			//std::cout << statements[i]->Str() << "\n";
+			statements[i]->Evaluate();
+			statements[i]->Destroy();
+		}
+	}
+	ThreadPool::Drain();
+}
+
 int main(int argc, char **argv) {
 	Lexer lexer;
 	Parser parser;
-	if (argc > 1) {
-		lexer.Lex(ReadFile(argv[1]));
+	const char* filename = 0;
+	std::vector<const char*> scripts;
+	u32 threads = 0;
+	i64 slice = DEFAULT_SLICE;
+	bool use_closures = false;
+	bool dump_types = false;
+	bool simplify = true;
+	bool cse = false;
+	bool watch = false;
+	const char* serve_path = 0;
+	u32 timeout_ms = RunOptions().timeout_ms;
+	const char* client_path = 0;
+	const char* restore_path = 0;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--closure")
+			use_closures = true;
+		else if (arg == "--dump-types")
+			dump_types = true;
+		else if (arg == "--no-simplify")
+			simplify = false;
+		else if (arg == "--cse")
+			cse = true;
+		else if (arg == "--watch")
+			watch = true;
+		else if (arg == "--threads" && i + 1 < argc)
+			threads = std::max(1, atoi(argv[++i]));
+		else if (arg == "--hot-loop" && i + 1 < argc)
+			hot_loop_threshold = std::max(0, atoi(argv[++i]));
+		else if (arg == "--hot-block" && i + 1 < argc)
+			hot_block_threshold = std::max(0, atoi(argv[++i]));
+		else if (arg == "--slice" && i + 1 < argc)
+			slice = std::max(1ll, atoll(argv[++i]));
+		else if (arg == "--serve" && i + 1 < argc)
+			serve_path = argv[++i];
+		else if (arg == "--timeout" && i + 1 < argc)
+			timeout_ms = std::max(0, atoi(argv[++i]));
+		else if (arg == "--client" && i + 1 < argc)
+			client_path = argv[++i];
+		else if (arg == "--snapshot" && i + 1 < argc)
+			snapshot_path = argv[++i];
+		else if (arg == "--restore" && i + 1 < argc)
+			restore_path = argv[++i];
+		else if (arg == "--stats")
+			print_stats = true;
+		else if (arg == "--stats=json")
+			print_stats = stats_json = true;
+		else if (arg == "--perf-counters")
+			print_perf = true;
+		else if (arg == "--perf-counters=json")
+			print_perf = perf_json = true;
+		else
+			scripts.push_back(argv[i]);
+	}
+	if (!scripts.empty())
+		filename = scripts[0];
+	RunOptions options;
+	options.use_closures = use_closures;
+	options.simplify = simplify;
+	options.cse = cse;
+	options.timeout_ms = timeout_ms;
+	modules.simplify = simplify;
+	modules.cse = cse;
+	if (serve_path)
+		return Serve(serve_path, options);
+	if (client_path) {
+		if (!filename) {
+			GenericError("--client needs a script, or - to send source from stdin.");
+			return 1;
+		}
+		return Client(client_path, filename, print_stats);
+	}
+	if (watch) {
+		if (!filename) {
+			GenericError("--watch needs a script.");
+			return 1;
+		}
+		return Watch(filename, options);
+	}
+	ThreadPool::threads = threads;
+	if (scripts.size() > 1) {
+		if (print_stats)
+			atexit(Report);
+		if (!threads)
+			threads = std::thread::hardware_concurrency();
+		BeginPhase(Stats::EVAL);
+		return Schedule(scripts, options, threads, slice);
+	}
+	if (restore_path) {
+		if (print_perf)
+			perf_counters.Open();
+		if (print_stats || print_perf)
+			atexit(Report);
+		BeginPhase(Stats::READ);
+		std::vector<Stmt*> statements;
+		bool restored = Restore(restore_path, statements);
+		EndPhase();
+		if (!restored)
+			return 1;
+		BeginPhase(Stats::EVAL);
+		RunProgram(statements, use_closures);
+		return 0;
+	}
+	if (filename) {
+		if (print_perf)
+			perf_counters.Open();
+		if (print_stats || print_perf)
+			atexit(Report);
+		BeginPhase(Stats::READ);
+		std::string source = ReadFile(filename);
+		EndPhase();
+		BeginPhase(Stats::LEX);
+		bool lex_error = lexer.Lex(source);
+		EndPhase();
+		if (lex_error)
+			return 1;
+		BeginPhase(Stats::PARSE);
+		parser.directory = DirectoryOf(filename);
 		parser.Parse(lexer.tokens);
+		TypeInference types;
+		if (!parser.HadError()) {
+			types.Run(parser.statements);
+			if (simplify && !dump_types)
+				Simplifier(cse).Run(parser.statements);
+		}
+		EndPhase();
+		if (dump_types) {
+			types.Dump();
+			return 0;
+		}
+		stats.tokens = lexer.tokens.size();
+		BeginPhase(Stats::EVAL);
 
 		//for(auto tok : lexer.tokens) {
 		//	std::cout << tok.str() << "\n";
 		//}
-		if (!parser.HadError()) {
-			for(int i = 0; i < parser.statements.size(); i++) {
-				//std::cout << parser.statements[i]->Str() << "\n";
-				parser.statements[i]->Evaluate();
-				parser.statements[i]->Destroy();
-			}
-		}
-	}
-	else {
-		while (true) {
-			std::cout << ">>>";
-			std::string input;
-			std::getline(std::cin, input);
-			lexer.Lex(input);
-			parser.Parse(lexer.tokens);
-			//for(auto tok : lexer.tokens) {
-			//	std::cout << tok.str() << "\n";
-			//}
-			if (!parser.HadError()) {
-				for(int i = 0; i < parser.statements.size(); i++) {
-					//std::cout << parser.statements[i]->Str() << "\n";
-					parser.statements[i]->Evaluate();
-					parser.statements[i]->Destroy();
-				}
-			}
-		}
+		if (!parser.HadError())
+			RunProgram(parser.statements, use_closures);
 	}
-	if (environment)
-		environment->Destroy();
+	else
+		Repl(simplify, cse).Run(std::cin);
 	return 0;
 }
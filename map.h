@@ -0,0 +1,354 @@
+#ifndef MAP_H
+#define MAP_H
+
+#include "util.h"
+#include "AST.h"
+#include "interpreter.h"
+#include <cmath>
+#include <cstring>
+#include <mutex>
+
+/*
+Maps from numbers, strings and booleans to any value, as hash tables built
+like SwissTable. Every slot of the index has a control byte: empty, deleted,
+or the low 7 bits of its key's hash. A lookup loads the control bytes of a
+group of 8 slots as one word and compares all of them with those bits at
+once, so it only looks at entries that are likely to match.
+
+Slots hold positions in an array of entries kept in insertion order, which
+is the order 'for (k in map)' visits. Removing an entry leaves a hole there
+until the next resize packs the array, unless the map is being iterated.
+
+Strings keep their hash (see StringObj), so a string key is hashed once.
+Maps can be shared with tasks; like reference counts, they only take a lock
+while other threads may be running.
+*/
+
+class MapObj : public HeapObject {
+public:
+	struct Entry {
+		Object key;
+		Object value;
+		u64 hash;
+		bool removed;
+	};
+	std::mutex lock;
+	u32 iterating = 0; // Loops over the map, which rely on positions staying put
+
+	bool Find(const Object& key, u64 hash, Object& value) {
+		u32 slot;
+		if (!FindSlot(key, hash, slot)) return false;
+		value = mEntries[mSlots[slot]].value;
+		return true;
+	}
+	void Set(const Object& key, u64 hash, const Object& value) {
+		u32 slot;
+		if (FindSlot(key, hash, slot)) {
+			mEntries[mSlots[slot]].value = value;
+			return;
+		}
+		// Deleted slots are reused, but their holes in mEntries aren't
+		if (mUsed + 1 > mCapacity - mCapacity / 8 || mEntries.size() >= mCapacity)
+			Resize();
+		slot = FreeSlot(hash);
+		if (mControl[slot] == EMPTY) mUsed++;
+		mControl[slot] = H2(hash);
+		mSlots[slot] = mEntries.size();
+		mEntries.push_back(Entry{key, value, hash, false});
+		mSize++;
+	}
+	bool Remove(const Object& key, u64 hash) {
+		u32 slot;
+		if (!FindSlot(key, hash, slot)) return false;
+		Entry& entry = mEntries[mSlots[slot]];
+		entry.key = Object();
+		entry.value = Object();
+		entry.removed = true;
+		mControl[slot] = DELETED; // Still counted in mUsed, so probes go past it
+		mSize--;
+		return true;
+	}
+	u32 Size() { return mSize; }
+	// The next key at or after 'position', which is moved past it
+	bool Next(u32& position, Object& key) {
+		for (; position < mEntries.size(); position++)
+			if (!mEntries[position].removed) {
+				key = mEntries[position++].key;
+				return true;
+			}
+		return false;
+	}
+	const std::vector<Entry>& Entries() { return mEntries; }
+	size_t Bytes() { return sizeof(*this); }
+private:
+	static constexpr u32 GROUP = 8;
+	static constexpr u8 EMPTY = 0x80;
+	static constexpr u8 DELETED = 0xFE;
+	static constexpr u64 LSBS = 0x0101010101010101ull;
+	static constexpr u64 MSBS = 0x8080808080808080ull;
+
+	std::vector<u8> mControl; // One byte per slot, in groups of GROUP
+	std::vector<u32> mSlots; // Index into mEntries of each full slot
+	std::vector<Entry> mEntries;
+	u32 mCapacity = 0; // Slots, a power of two and at least GROUP once used
+	u32 mUsed = 0; // Full and deleted slots
+	u32 mSize = 0;
+
+	static u8 H2(u64 hash) { return hash >> 57; }
+	u64 Group(u32 group) {
+		u64 word;
+		memcpy(&word, &mControl[group * GROUP], GROUP);
+		return word;
+	}
+	// A bit set in the top of each byte of 'word' equal to 'byte'. A byte
+	// just above a match can show up too, which the key comparison weeds out.
+	static u64 Match(u64 word, u8 byte) {
+		u64 x = word ^ (LSBS * byte);
+		return (x - LSBS) & ~x & MSBS;
+	}
+	static u64 MatchEmpty(u64 word) {
+		return word & ~(word << 6) & MSBS; // Only EMPTY has bit 7 set and bit 1 clear
+	}
+	static u32 FirstByte(u64 mask) {
+		return __builtin_ctzll(mask) / 8; // Bytes are in memory order on little-endian machines
+	}
+	static bool SameKey(const Object& a, const Object& b) {
+		if (a.index() != b.index()) return false;
+		switch (a.index()) {
+		case TYPE_BOOLEAN: return std::get<TYPE_BOOLEAN>(a) == std::get<TYPE_BOOLEAN>(b);
+		case TYPE_NUMBER: return std::get<TYPE_NUMBER>(a) == std::get<TYPE_NUMBER>(b);
+		default: return std::get<TYPE_STRING>(a).Get() == std::get<TYPE_STRING>(b).Get() || ObjStr(a) == ObjStr(b);
+		}
+	}
+	// Groups are probed in a triangular sequence, which visits each of a
+	// power-of-two number of groups once
+	bool FindSlot(const Object& key, u64 hash, u32& slot) {
+		if (mCapacity == 0) return false;
+		u32 groups = mCapacity / GROUP;
+		u32 group = (hash >> 7) & (groups - 1);
+		for (u32 step = 1; step <= groups; step++) {
+			u64 word = Group(group);
+			for (u64 mask = Match(word, H2(hash)); mask; mask &= mask - 1) {
+				u32 candidate = group * GROUP + FirstByte(mask);
+				if (mControl[candidate] != H2(hash)) continue;
+				Entry& entry = mEntries[mSlots[candidate]];
+				if (entry.hash == hash && SameKey(entry.key, key)) {
+					slot = candidate;
+					return true;
+				}
+			}
+			if (MatchEmpty(word)) return false;
+			group = (group + step) & (groups - 1);
+		}
+		return false;
+	}
+	// An empty or deleted slot for a key that isn't in the map
+	u32 FreeSlot(u64 hash) {
+		u32 groups = mCapacity / GROUP;
+		u32 group = (hash >> 7) & (groups - 1);
+		for (u32 step = 1; ; step++) {
+			u64 mask = Group(group) & MSBS;
+			if (mask) return group * GROUP + FirstByte(mask);
+			group = (group + step) & (groups - 1);
+		}
+	}
+	// Grows the index once it's mostly live entries, or rebuilds it in place
+	// to drop deleted slots
+	void Resize() {
+		u32 capacity = mCapacity ? mCapacity : GROUP;
+		u32 kept = iterating ? mEntries.size() : mSize; // Holes stay while iterating
+		if (kept + 1 > capacity / 2)
+			capacity *= 2;
+		if (!iterating) {
+			u32 kept = 0;
+			for (Entry& entry : mEntries)
+				if (!entry.removed)
+					mEntries[kept++] = std::move(entry);
+			mEntries.resize(kept);
+		}
+		mCapacity = capacity;
+		mControl.assign(capacity, EMPTY);
+		mSlots.assign(capacity, 0);
+		mUsed = 0;
+		for (u32 i = 0; i < mEntries.size(); i++) {
+			if (mEntries[i].removed) continue;
+			u32 slot = FreeSlot(mEntries[i].hash);
+			mControl[slot] = H2(mEntries[i].hash);
+			mSlots[slot] = i;
+			mUsed++;
+		}
+	}
+};
+
+// Holds the map's lock for as long as it's in scope, if other threads may
+// use the map meanwhile
+class MapGuard {
+public:
+	MapGuard(MapObj* map) : mLock(threads_share_objects ? &map->lock : 0) {
+		if (mLock) mLock->lock();
+	}
+	~MapGuard() {
+		if (mLock) mLock->unlock();
+	}
+private:
+	std::mutex* mLock;
+};
+
+u64 MixHash(u64 hash) {
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdull;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+// Also turns -0 into 0, since they're the same key
+u64 HashKey(Object& key, u16 line) {
+	switch (key.index()) {
+	case TYPE_BOOLEAN:
+		return MixHash(std::get<TYPE_BOOLEAN>(key) ? 2 : 1);
+	case TYPE_NUMBER: {
+		float number = std::get<TYPE_NUMBER>(key);
+		if (std::isnan(number))
+			ErrorRT(line, "A map key can't be NaN.");
+		if (number == 0) key = number = 0;
+		u32 bits;
+		memcpy(&bits, &number, sizeof(bits));
+		return MixHash(bits + 3);
+	}
+	case TYPE_STRING:
+		return std::get<TYPE_STRING>(key)->Hash();
+	default:
+		ErrorRT(line, "Map keys must be numbers, strings or booleans.");
+		return 0; // Unreachable
+	}
+}
+
+// Strings inside a map are quoted, so {"1": 1} and {1: 1} look different
+std::string MapToStr(MapObj* map) {
+	static thread_local std::vector<MapObj*> printing; // A map that holds itself prints as {...}
+	for (MapObj* outer : printing)
+		if (outer == map) return "{...}";
+	printing.push_back(map);
+	std::string result = "{";
+	{
+		MapGuard guard(map);
+		bool first = true;
+		for (const MapObj::Entry& entry : map->Entries()) {
+			if (entry.removed) continue;
+			if (!first) result += ", ";
+			first = false;
+			for (const Object* obj : {&entry.key, &entry.value})
+				result += (obj->index() == TYPE_STRING ? "\"" + ObjStr(*obj) + "\"" : ObjToStr(*obj)) + (obj == &entry.key ? ": " : "");
+		}
+	}
+	printing.pop_back();
+	return result + "}";
+}
+
+MapObj* ExpectMap(const Object& obj, u16 line) {
+	if (obj.index() != TYPE_MAP)
+		ErrorRT(line, "Expected a map.");
+	return std::get<TYPE_MAP>(obj).Get();
+}
+
+Object MapExpr::Evaluate() {
+	Ref<MapObj> map = heap.New<MapObj>();
+	for (u32 i = 0; i < keys.size(); i++) {
+		Object key = keys[i]->Evaluate();
+		u64 hash = HashKey(key, brace.line);
+		map->Set(key, hash, values[i]->Evaluate());
+	}
+	return map;
+}
+
+Flow ForInFile(FileObj* file, Object& counter, Stmt* body, u16 line); // In files.h
+
+Flow ForInStmt::Evaluate() {
+	Object target = collection->Evaluate();
+	if (target.index() != TYPE_MAP && target.index() != TYPE_FILE)
+		ErrorRT(identifier.line, "Expected a map or a file.");
+	auto run = [&](Object* counter) {
+		if (target.index() == TYPE_FILE)
+			return ForInFile(std::get<TYPE_FILE>(target).Get(), *counter, body, identifier.line);
+		// Keys added by the body are visited too; removed ones are skipped
+		MapObj* map = std::get<TYPE_MAP>(target).Get();
+		struct Iterating {
+			MapObj* map;
+			Iterating(MapObj* map) : map(map) { MapGuard guard(map); map->iterating++; }
+			~Iterating() { MapGuard guard(map); map->iterating--; }
+		} iterating(map);
+		u32 position = 0;
+		while (true) {
+			Tick();
+			{
+				MapGuard guard(map);
+				if (!map->Next(position, *counter)) break;
+			}
+			Flow flow = body->Evaluate();
+			if (flow == Flow::BREAK) break;
+			if (flow == Flow::RETURN) return flow;
+		}
+		return Flow::NORMAL;
+	};
+	if (slot >= 0)
+		return run(&frame[slot]);
+	ScopedEnvironment scope;
+	return run(&environment->values[identifier.lexeme]);
+}
+
+Object Get(Object* args, u16 line) {
+	MapObj* map = ExpectMap(args[0], line);
+	u64 hash = HashKey(args[1], line);
+	Object value;
+	bool found;
+	{
+		MapGuard guard(map);
+		found = map->Find(args[1], hash, value);
+	}
+	if (!found)
+		ErrorRT(line, "The map has no key " + (args[1].index() == TYPE_STRING ? "\"" + ObjStr(args[1]) + "\"" : ObjToStr(args[1])) + ".");
+	return value;
+}
+
+Object Set(Object* args, u16 line) {
+	MapObj* map = ExpectMap(args[0], line);
+	u64 hash = HashKey(args[1], line);
+	MapGuard guard(map);
+	map->Set(args[1], hash, args[2]);
+	return args[2];
+}
+
+// Gives whether the key was there
+Object Remove(Object* args, u16 line) {
+	MapObj* map = ExpectMap(args[0], line);
+	u64 hash = HashKey(args[1], line);
+	MapGuard guard(map);
+	return map->Remove(args[1], hash);
+}
+
+Object Contains(Object* args, u16 line) {
+	MapObj* map = ExpectMap(args[0], line);
+	u64 hash = HashKey(args[1], line);
+	Object value;
+	MapGuard guard(map);
+	return map->Find(args[1], hash, value);
+}
+
+// Of a map or a string
+Object Length(Object* args, u16 line) {
+	if (args[0].index() == TYPE_STRING)
+		return (float)ObjStr(args[0]).size();
+	MapObj* map = ExpectMap(args[0], line);
+	MapGuard guard(map);
+	return (float)map->Size();
+}
+
+const Builtin map_builtins[] = {
+	{"get", 2, Get, TYPE_UNKNOWN, true},
+	{"set", 3, Set, TYPE_UNKNOWN, false},
+	{"remove", 2, Remove, TYPE_BOOLEAN, false},
+	{"contains", 2, Contains, TYPE_BOOLEAN, true},
+	{"length", 1, Length, TYPE_NUMBER, true},
+};
+
+#endif
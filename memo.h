@@ -0,0 +1,181 @@
+#ifndef MEMO_H
+#define MEMO_H
+
+#include "util.h"
+#include "interpreter.h"
+#include "map.h"
+#include <cstring>
+#include <mutex>
+
+/*
+Results of 'memo' functions, whose bodies the parser has checked only
+compute a value from their arguments (see PurityCheck in analysis.h). Each
+function keeps its last MEMO_CAPACITY results by argument values, and calls
+with the same arguments after that return the kept result without running
+the body.
+
+Only booleans, numbers and strings are compared by value, so a call with any
+other argument runs the body as usual, and so does a result that isn't one
+of those: a map has to be a new one every call. Numbers are the same key
+when their bits are, which keeps 0 and -0 apart and finds NaN again.
+*/
+
+const u32 MEMO_CAPACITY = 4096;
+
+class MemoTable {
+public:
+	// True with 'result' set if 'args' were seen lately
+	bool Find(const Object* args, u32 count, u64 hash, Object& result) {
+		std::unique_lock<std::mutex> guard(mLock, std::defer_lock);
+		if (threads_share_objects) guard.lock();
+		if (mBuckets.empty()) return false;
+		for (i32 i = mBuckets[hash & (mBuckets.size() - 1)]; i >= 0; i = mEntries[i].next_in_bucket) {
+			Entry& entry = mEntries[i];
+			if (entry.hash != hash || !SameKey(entry.key, args, count)) continue;
+			Unlink(i);
+			PushNewest(i);
+			result = entry.result;
+			return true;
+		}
+		return false;
+	}
+	// The least recently used result makes room once the table is full
+	void Insert(std::vector<Object> key, u64 hash, const Object& result) {
+		std::unique_lock<std::mutex> guard(mLock, std::defer_lock);
+		if (threads_share_objects) guard.lock();
+		if (mBuckets.empty())
+			mBuckets.assign(MEMO_CAPACITY * 2, -1);
+		i32* bucket = &mBuckets[hash & (mBuckets.size() - 1)];
+		// Another thread may have computed it meanwhile
+		for (i32 i = *bucket; i >= 0; i = mEntries[i].next_in_bucket)
+			if (mEntries[i].hash == hash && SameKey(mEntries[i].key, key.data(), key.size())) return;
+		i32 index;
+		if (mEntries.size() < MEMO_CAPACITY) {
+			index = mEntries.size();
+			mEntries.emplace_back();
+		}
+		else {
+			index = mOldest;
+			Unlink(index);
+			i32* link = &mBuckets[mEntries[index].hash & (mBuckets.size() - 1)];
+			while (*link != index)
+				link = &mEntries[*link].next_in_bucket;
+			*link = mEntries[index].next_in_bucket;
+		}
+		Entry& entry = mEntries[index];
+		entry.key = std::move(key);
+		entry.result = result;
+		entry.hash = hash;
+		entry.next_in_bucket = *bucket;
+		*bucket = index;
+		PushNewest(index);
+	}
+private:
+	struct Entry {
+		std::vector<Object> key;
+		Object result;
+		u64 hash = 0;
+		i32 next_in_bucket = -1;
+		i32 newer = -1, older = -1;
+	};
+	std::vector<Entry> mEntries;
+	std::vector<i32> mBuckets; // Made on the first insert, twice as many as entries
+	i32 mNewest = -1, mOldest = -1;
+	std::mutex mLock; // Only taken while threads_share_objects is set
+
+	static bool SameArgument(const Object& a, const Object& b) {
+		if (a.index() != b.index()) return false;
+		switch (a.index()) {
+		case TYPE_BOOLEAN:
+			return std::get<TYPE_BOOLEAN>(a) == std::get<TYPE_BOOLEAN>(b);
+		case TYPE_NUMBER:
+			return memcmp(&std::get<TYPE_NUMBER>(a), &std::get<TYPE_NUMBER>(b), sizeof(float)) == 0;
+		case TYPE_STRING:
+			return std::get<TYPE_STRING>(a).Get() == std::get<TYPE_STRING>(b).Get() || ObjStr(a) == ObjStr(b);
+		default:
+			return false;
+		}
+	}
+	static bool SameKey(const std::vector<Object>& key, const Object* args, u32 count) {
+		for (u32 i = 0; i < count; i++)
+			if (!SameArgument(key[i], args[i])) return false;
+		return true;
+	}
+	void Unlink(i32 index) {
+		Entry& entry = mEntries[index];
+		if (entry.newer >= 0) mEntries[entry.newer].older = entry.older;
+		else mNewest = entry.older;
+		if (entry.older >= 0) mEntries[entry.older].newer = entry.newer;
+		else mOldest = entry.newer;
+	}
+	void PushNewest(i32 index) {
+		Entry& entry = mEntries[index];
+		entry.newer = -1;
+		entry.older = mNewest;
+		if (mNewest >= 0) mEntries[mNewest].newer = index;
+		mNewest = index;
+		if (mOldest < 0) mOldest = index;
+	}
+};
+
+MemoTable* NewMemoTable() {
+	return new MemoTable();
+}
+
+void FreeMemoTable(MemoTable* table) {
+	delete table;
+}
+
+bool MemoValue(const Object& obj) {
+	return obj.index() == TYPE_BOOLEAN || obj.index() == TYPE_NUMBER || obj.index() == TYPE_STRING;
+}
+
+// False if some argument can't be part of a key
+bool MemoHash(const Object* args, u32 count, u64& hash) {
+	hash = 0;
+	for (u32 i = 0; i < count; i++) {
+		u64 part;
+		switch (args[i].index()) {
+		case TYPE_BOOLEAN:
+			part = std::get<TYPE_BOOLEAN>(args[i]) ? 2 : 1;
+			break;
+		case TYPE_NUMBER: {
+			u32 bits;
+			memcpy(&bits, &std::get<TYPE_NUMBER>(args[i]), sizeof(bits));
+			part = bits + 3;
+			break;
+		}
+		case TYPE_STRING:
+			part = std::get<TYPE_STRING>(args[i])->Hash();
+			break;
+		default:
+			return false;
+		}
+		hash = MixHash(hash * 31 + part);
+	}
+	return true;
+}
+
+// Calls the 'memo' function 'fn' the way CallFunction does
+Object CallMemo(Function* fn, u32 base, u16 line) {
+	u32 count = fn->params.size();
+	u64 hash;
+	if (!MemoHash(&value_stack[base], count, hash))
+		return CallFunction(fn, base, line);
+	Object result;
+	if (fn->memo->Find(&value_stack[base], count, hash, result)) {
+		stats.memo_hits++;
+		while (stack_top > base)
+			value_stack[--stack_top] = false;
+		return result;
+	}
+	stats.memo_misses++;
+	// Copied first, since the body can assign to its parameters
+	std::vector<Object> key(&value_stack[base], &value_stack[base] + count);
+	result = CallFunction(fn, base, line);
+	if (MemoValue(result))
+		fn->memo->Insert(std::move(key), hash, result);
+	return result;
+}
+
+#endif
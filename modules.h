@@ -0,0 +1,156 @@
+#ifndef MODULES_H
+#define MODULES_H
+
+#include "util.h"
+#include "lexer.h"
+#include "parser.h"
+#include "types.h"
+#include "simplify.h"
+#include "interpreter.h"
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+
+/*
+'import "path";' runs a module's top-level code in the importing script's
+globals, once per set of globals however often it's imported.
+
+Modules are lexed, parsed and simplified once per process and cached by
+canonical path, checked against the file's mtime and size on each import.
+Nothing changes the statements after that, so every script, task and
+green thread importing a module shares them. A module whose file changed is
+parsed again, but its old statements are kept: functions they declared may
+still be running somewhere.
+*/
+
+struct Module {
+	std::vector<Stmt*> statements;
+	std::string errors; // From the lexer and parser, printed by every import
+	bool runnable = false;
+	std::filesystem::file_time_type mtime;
+	uintmax_t size = 0;
+};
+
+class ModuleCache {
+public:
+	bool simplify = true; // As for the script itself
+	bool cse = false;
+	// Set when scripts run on several threads at once (scheduler.h). Their
+	// modules' functions and strings are then shared, so reference counts
+	// become atomic from the first import on.
+	bool shared = false;
+	// Returns 0 with 'error' set if the file can't be read
+	const Module* Load(const std::string& path, std::string& error) {
+		std::error_code code;
+		std::filesystem::file_time_type mtime = std::filesystem::last_write_time(path, code);
+		uintmax_t size = code ? 0 : std::filesystem::file_size(path, code);
+		if (code) {
+			error = "Could not open module: " + path;
+			return 0;
+		}
+		std::lock_guard<std::mutex> guard(mLock);
+		if (shared && !mSharing) {
+			mSharing = true;
+			threads_share_objects++;
+		}
+		std::unique_ptr<Module>& module = mModules[path];
+		if (module && module->mtime == mtime && module->size == size) {
+			stats.module_imports++;
+			return module.get();
+		}
+		std::ifstream file(path);
+		if (!file.is_open()) {
+			error = "Could not open module: " + path;
+			return 0;
+		}
+		std::string source, line;
+		while (std::getline(file, line))
+			source += line + "\n";
+		if (module)
+			mStale.push_back(std::move(module));
+		module.reset(new Module());
+		module->mtime = mtime;
+		module->size = size;
+		Compile(source, std::filesystem::path(path).parent_path().string(), *module);
+		stats.module_imports++;
+		stats.modules_loaded++;
+		return module.get();
+	}
+	// Loads what 'statements' import, and what those modules import, so a
+	// forked server child (server.h) finds them cached
+	void Preload(const std::vector<Stmt*>& statements) {
+		std::vector<std::string> seen; // Against import cycles
+		Preload(statements, seen);
+	}
+	// Empty if there's no such file
+	static std::string CanonicalPath(const std::string& path) {
+		std::error_code code;
+		std::filesystem::path canonical = std::filesystem::canonical(path, code);
+		return code ? "" : canonical.string();
+	}
+private:
+	std::mutex mLock;
+	std::unordered_map<std::string, std::unique_ptr<Module>> mModules;
+	std::vector<std::unique_ptr<Module>> mStale;
+	bool mSharing = false;
+
+	void Preload(const std::vector<Stmt*>& statements, std::vector<std::string>& seen) {
+		for (Stmt* stmt : statements) {
+			if (stmt->Type() != NodeType::IMPORT_STMT) continue;
+			std::string path = CanonicalPath(((ImportStmt*)stmt)->path), error;
+			if (path.empty() || std::find(seen.begin(), seen.end(), path) != seen.end())
+				continue;
+			seen.push_back(path);
+			if (const Module* module = Load(path, error))
+				Preload(module->statements, seen);
+		}
+	}
+	void Compile(const std::string& source, const std::string& directory, Module& module) {
+		std::ostringstream errors;
+		Lexer lexer;
+		Parser parser;
+		lexer.errors = parser.errors = &errors;
+		parser.directory = directory;
+		lexer.Lex(source);
+		parser.Parse(lexer.tokens);
+		stats.tokens += lexer.tokens.size();
+		module.errors = errors.str();
+		module.runnable = !parser.HadError();
+		module.statements = parser.statements;
+		if (module.runnable) {
+			TypeInference types;
+			types.bind_builtins = false;
+			types.Run(module.statements);
+			if (simplify)
+				Simplifier(cse).Run(module.statements);
+		}
+	}
+};
+
+ModuleCache modules;
+
+Flow ImportStmt::Evaluate() {
+	std::string canonical = ModuleCache::CanonicalPath(path);
+	if (canonical.empty())
+		ErrorRT(keyword.line, "Could not find module \"" + name + "\".");
+	std::vector<std::string>& imported = globals->imported;
+	if (std::find(imported.begin(), imported.end(), canonical) != imported.end())
+		return Flow::NORMAL;
+	imported.push_back(canonical); // Before running it, so an import cycle ends here
+	std::string error;
+	const Module* module = modules.Load(canonical, error);
+	if (!module)
+		ErrorRT(keyword.line, error + ".");
+	if (!module->runnable) {
+		output.Flush();
+		std::cout << module->errors;
+		ErrorRT(keyword.line, "Could not compile module \"" + name + "\".");
+	}
+	for (Stmt* stmt : module->statements)
+		stmt->Evaluate();
+	return Flow::NORMAL;
+}
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+// Buffered sink for everything a script prints. It is flushed when it fills
+// up, before any error message, before the REPL prompt and at exit, so the
+// interleaving with std::cout is the same as if it wrote directly. Each
+// thread has its own; green threads flush it whenever they yield.
+class OutputBuffer {
+public:
+	std::string* capture = 0; // Gets the output instead of stdout, when set (bomac.cpp)
+	~OutputBuffer() { Flush(); }
+	void Write(const char* data, size_t size) {
+		if (mSize + size > sizeof(mBuffer)) {
+			Flush();
+			if (size > sizeof(mBuffer)) {
+				Emit(data, size);
+				return;
+			}
+		}
+		memcpy(mBuffer + mSize, data, size);
+		mSize += size;
+	}
+	void Write(const std::string& str) {
+		Write(str.data(), str.size());
+	}
+	void Put(char c) {
+		if (mSize == sizeof(mBuffer)) Flush();
+		mBuffer[mSize++] = c;
+	}
+	// Shortest representation that reads back as the same float
+	void WriteNumber(float number) {
+		if (sizeof(mBuffer) - mSize < MAX_NUMBER_CHARS) Flush();
+		mSize = FormatNumber(mBuffer + mSize, mBuffer + sizeof(mBuffer), number) - mBuffer;
+	}
+	// Whole numbers below 1e21 keep all their digits rather than becoming
+	// 1e+05, which still reads back the same. Returns the end of the text.
+	static char* FormatNumber(char* first, char* last, float number) {
+		if (number == std::floor(number) && std::fabs(number) < 1e21f)
+			return std::to_chars(first, last, number, std::chars_format::fixed).ptr;
+		return std::to_chars(first, last, number).ptr;
+	}
+	void Flush() {
+		if (mSize == 0) return;
+		Emit(mBuffer, mSize);
+		mSize = 0;
+	}
+	static const size_t MAX_NUMBER_CHARS = 32;
+private:
+	char mBuffer[1 << 16];
+	size_t mSize = 0;
+
+	void Emit(const char* data, size_t size) {
+		if (capture) {
+			capture->append(data, size);
+			return;
+		}
+		fwrite(data, 1, size, stdout);
+		fflush(stdout);
+	}
+};
+
+thread_local OutputBuffer output;
+
+#endif
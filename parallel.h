@@ -0,0 +1,121 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include "util.h"
+#include "AST.h"
+#include "interpreter.h"
+#include "pool.h"
+#include <algorithm>
+#include <cmath>
+
+/*
+'parallel for' runs the iterations of a range loop as tasks on the thread
+pool. The range is cut into a fixed number of chunks, so how it's split
+doesn't depend on the number of threads. Each chunk runs in an environment
+of its own that holds the loop variable and a copy of every reduction,
+starting from the operation's identity. Once all chunks are done, their
+copies are folded into the outer variables in chunk order, so every run
+gives the same result.
+
+Everything outside the loop is read-only while it runs: the parser rejects
+assignments to it in the body, and its environments are frozen so that
+functions called from the body can't write to globals either.
+*/
+
+const u32 PARALLEL_CHUNKS = 128;
+
+float ReductionIdentity(Reduction::Op op) {
+	switch (op) {
+		case Reduction::SUM: return 0;
+		case Reduction::PRODUCT: return 1;
+		case Reduction::MIN: return INFINITY;
+		default: return -INFINITY;
+	}
+}
+
+float Reduce(Reduction::Op op, float a, float b) {
+	switch (op) {
+		case Reduction::SUM: return a + b;
+		case Reduction::PRODUCT: return a * b;
+		case Reduction::MIN: return std::min(a, b);
+		default: return std::max(a, b);
+	}
+}
+
+Flow RangeForStmt::EvaluateParallel(float from, float to, float step) {
+	for (const Reduction& r : reductions)
+		if (environment->Get(r.name).index() != TYPE_NUMBER)
+			ErrorRT(r.name.line, "Expected '" + r.name.lexeme + "' to be a number before it's reduced.");
+
+	// Iteration i has the value from + i * step, so every chunk finds its own
+	// start without walking the ones before it. With a fractional step that
+	// can be an iteration fewer than a sequential loop adding up its steps.
+	float largest = std::max(std::fabs(from), std::fabs(to));
+	if (largest + std::fabs(step) == largest)
+		ErrorRT(identifier.line, "The step of a range is too small to reach its end.");
+	double span = ((double)to - from) / step;
+	u64 count = span > 0 ? (u64)std::ceil(span) : 0;
+	u32 chunks = std::min<u64>(count, PARALLEL_CHUNKS);
+	u64 per_chunk = chunks ? (count + chunks - 1) / chunks : 0;
+	if (chunks)
+		chunks = (count + per_chunk - 1) / per_chunk;
+
+	Environment* outer = environment;
+	Ref<Environment> shared_globals = globals;
+	std::vector<float> partials(chunks * reductions.size());
+	std::atomic<bool> failed{false};
+	std::vector<Task> tasks;
+	for (u32 c = 0; c < chunks; c++) {
+		tasks.push_back([&, c] {
+			if (failed) return;
+			globals = shared_globals;
+			try {
+				Ref<Environment> scope = heap.New<Environment>(outer);
+				environment = scope.Get();
+				Object* slot = &scope->values[identifier.lexeme];
+				for (const Reduction& r : reductions)
+					scope->Define(r.name.lexeme, ReductionIdentity(r.op));
+				u64 last = std::min(count, (c + 1) * per_chunk);
+				for (u64 i = c * per_chunk; i < last; i++) {
+					*slot = (float)(from + (double)i * step);
+					body->Evaluate();
+				}
+				for (u32 k = 0; k < reductions.size(); k++) {
+					const Reduction& r = reductions[k];
+					Object value = scope->values[r.name.lexeme];
+					if (value.index() != TYPE_NUMBER)
+						ErrorRT(r.name.line, "Expected '" + r.name.lexeme + "' to be a number when it's reduced.");
+					partials[c * reductions.size() + k] = std::get<TYPE_NUMBER>(value);
+				}
+			} catch (const TaskFailed&) {
+				failed = true;
+			}
+		});
+	}
+
+	// A task's globals are frozen already, and stay that way
+	std::vector<Environment*> frozen;
+	for (Environment* env = outer; env; env = env->enclosing.Get())
+		if (!env->frozen) {
+			env->frozen = true;
+			frozen.push_back(env);
+		}
+	ThreadPool::Get().Run(tasks, identifier.line);
+	for (Environment* env : frozen)
+		env->frozen = false;
+	if (failed) {
+		if (end_script) end_script();
+		exit(0);
+	}
+
+	for (u32 k = 0; k < reductions.size(); k++) {
+		const Reduction& r = reductions[k];
+		float value = std::get<TYPE_NUMBER>(outer->Get(r.name));
+		for (u32 c = 0; c < chunks; c++)
+			value = Reduce(r.op, value, partials[c * reductions.size() + k]);
+		outer->Assign(r.name, value);
+	}
+	return Flow::NORMAL;
+}
+
+#endif
@@ -3,33 +3,128 @@
 
 #include "util.h"
 #include "AST.h"
+#include "analysis.h"
+#include <filesystem>
 #include <initializer_list>
 #include <stdexcept>
+#include <unordered_set>
 
 class Parser {
 private:
+	// Lexical scopes seen while parsing, used to give function locals frame
+	// slots. Variables outside functions keep slot -1 and live in an
+	// Environment at runtime; scopes[0] is the global scope.
+	struct Scope {
+		std::unordered_map<std::string, i32> names;
+		u32 function = 0; // How many functions enclose this scope
+	};
 	std::vector<Token> tokens;
 	u32 current = 0;
 	bool had_error = false;
 	u8 loop_count = 0; // To prevent break and continue statements from appearing outside a loop
+	std::vector<Scope> scopes = std::vector<Scope>(1);
+	std::vector<u32> frame_sizes; // One per function being parsed
+	// Inside a 'parallel for' body or a 'spawn' block, which run on other
+	// threads: the body's first scope, the only outside names it may assign
+	// (reductions) and what it's called in errors
+	i32 isolated_scope = -1;
+	std::vector<std::string> isolated_writable;
+	const char* isolated_by = 0;
+	u8 parallel_loop = 0; // loop_count of the 'parallel for' being parsed
+	// Globals that 'memo' functions rely on, themselves included, and the
+	// first one relying on each. Nothing can redefine them after that.
+	std::unordered_map<std::string, std::string> memo_relied_on;
+	std::unordered_set<std::string> memo_functions;
+	bool imported = false; // A module could have redefined anything
+	bool ran_out = false; // Every error was the tokens ending inside a statement
 public:
 	bool HadError() { return had_error; }
+	// The tokens parsed last could still be the start of a program, since
+	// they only failed by ending too soon
+	bool RanOut() { return had_error && ran_out; }
+	const std::unordered_map<std::string, std::string>& MemoReliedOn() { return memo_relied_on; }
 	std::vector<Stmt*> statements;
+	std::vector<std::pair<u32, u32>> ranges; // Tokens [first, last) of each statement
+	std::string directory; // Of the file being parsed, which imports are relative to
+	std::ostream* errors = &std::cout;
 	// TODO: eliminate copying of the vector
 	void Parse(const std::vector<Token> &toks) {
 		tokens = toks;
+		scopes.assign(1, Scope());
+		frame_sizes.clear();
+		memo_relied_on.clear();
+		memo_functions.clear();
+		imported = false;
+		ParseTokens();
+	}
+	// More statements of the program parsed before, as the REPL reads them.
+	// The global names and what 'memo' functions rely on carry over. Takes
+	// 'toks' and leaves the previous tokens in it, so both keep their memory.
+	void ParseMore(std::vector<Token>& toks) {
+		tokens.swap(toks);
+		ParseTokens();
+	}
+	// What ParseMore leaves behind for later entries, so the REPL can take
+	// an entry back and parse it again once more of it is typed
+	struct Globals {
+		Scope scope;
+		std::unordered_map<std::string, std::string> memo_relied_on;
+		std::unordered_set<std::string> memo_functions;
+		bool imported;
+	};
+	Globals SaveGlobals() {
+		return {scopes[0], memo_relied_on, memo_functions, imported};
+	}
+	void RestoreGlobals(Globals& saved) {
+		scopes[0] = std::move(saved.scope);
+		memo_relied_on = std::move(saved.memo_relied_on);
+		memo_functions = std::move(saved.memo_functions);
+		imported = saved.imported;
+	}
+private:
+	void ParseTokens() {
 		current = 0;
 		had_error = false;
+		ran_out = true;
 		statements.clear();
+		ranges.clear();
 		while(!AtEnd()) {
+			u32 first = current;
 			try {
 				statements.push_back(Declaration());
+				ranges.push_back({first, current});
 			} catch (std::exception e) {
-				Synchronize();
+				scopes.resize(1);
+				frame_sizes.clear();
+				loop_count = 0;
+				isolated_scope = -1;
+				isolated_writable.clear();
+				isolated_by = 0;
+				parallel_loop = 0;
+				if (!SkipBlocks(first))
+					Synchronize();
 			}
 		}
 	}
-private:
+	// Skips to the end of the blocks a failed statement starting at 'first'
+	// was in, so their closing braces don't read as statements of their own,
+	// and over what the statement goes on with after them: the ';' after a
+	// 'spawn' block or the 'else' of an 'if', whose branch is then parsed as a
+	// statement. False if it wasn't in one.
+	bool SkipBlocks(u32 first) {
+		i32 depth = 0;
+		for (u32 i = first; i < current; i++)
+			if (tokens[i].type == TokenType::LEFT_BRACE) depth++;
+			else if (tokens[i].type == TokenType::RIGHT_BRACE) depth--;
+		if (depth <= 0) return false;
+		while (depth > 0 && !AtEnd()) {
+			if (Peek().type == TokenType::LEFT_BRACE) depth++;
+			else if (Peek().type == TokenType::RIGHT_BRACE) depth--;
+			Advance();
+		}
+		Match({TokenType::SEMICOLON, TokenType::ELSE});
+		return true;
+	}
 	void Synchronize() {
 		Advance();
 		while (!AtEnd()) {
@@ -61,7 +156,11 @@ private:
 
 			if (expr->Type() == NodeType::VAR_EXPR) {
 				Token identifier = ((VarExpr*)expr)->identifier;
-				return new AssignExpr(identifier, value);
+				CheckIsolatedWrite(identifier);
+				CheckMemoWrite(identifier);
+				AssignExpr* assign = new AssignExpr(identifier, value);
+				assign->slot = ((VarExpr*)expr)->slot;
+				return assign;
 			}
 
 			Error(equals.line, "Invalid l-value.");
@@ -153,21 +252,78 @@ private:
 			Expr* right = Unary();
 			return new UnaryExpr(op, right);
 		}
+		if (Match({TokenType::SPAWN}))
+			return Spawn();
 		return Prefix();
 	}
+	Expr* Spawn() {
+		Token keyword = Prev();
+		if (Match({TokenType::LEFT_BRACE})) {
+			// Runs like a top-level block, so it has no frame to share
+			if (InFunction())
+				Error(keyword.line, "'spawn' blocks can only be used outside functions; spawn a call instead.");
+			i32 outer_scope = isolated_scope;
+			std::vector<std::string> outer_writable = isolated_writable;
+			const char* outer_by = isolated_by;
+			u8 outer_loop_count = loop_count;
+			u8 outer_parallel_loop = parallel_loop;
+			isolated_writable.clear();
+			isolated_by = "'spawn' block";
+			loop_count = 0;
+			parallel_loop = 0;
+			BeginScope();
+			isolated_scope = scopes.size() - 1;
+			BlockStmt* block = new BlockStmt(Block());
+			EndScope();
+			isolated_scope = outer_scope;
+			isolated_writable = outer_writable;
+			isolated_by = outer_by;
+			loop_count = outer_loop_count;
+			parallel_loop = outer_parallel_loop;
+			return new SpawnExpr(keyword, 0, block);
+		}
+		Expr* call = Call();
+		if (call->Type() != NodeType::CALL_EXPR)
+			Error(keyword.line, "Expected a call or a block after 'spawn'.");
+		return new SpawnExpr(keyword, (CallExpr*)call, 0);
+	}
 	Expr* Prefix() {
 		if (Match({TokenType::PLUS_PLUS, TokenType::MINUS_MINUS})) {
 			Token op = Prev();
 			Expr* expr = Primary();
+			if (expr->Type() == NodeType::VAR_EXPR) {
+				CheckIsolatedWrite(((VarExpr*)expr)->identifier);
+				CheckMemoWrite(((VarExpr*)expr)->identifier);
+			}
 			return new UnaryExpr(op, expr, false);
 		}
 
 		return Postfix();
 	}
 	Expr* Postfix() {
-		Expr* expr = Primary();
-		if (Match({TokenType::PLUS_PLUS, TokenType::MINUS_MINUS}))
+		Expr* expr = Call();
+		if (Match({TokenType::PLUS_PLUS, TokenType::MINUS_MINUS})) {
+			if (expr->Type() == NodeType::VAR_EXPR) {
+				CheckIsolatedWrite(((VarExpr*)expr)->identifier);
+				CheckMemoWrite(((VarExpr*)expr)->identifier);
+			}
 			return new UnaryExpr(Prev(), expr, true);
+		}
+		return expr;
+	}
+	Expr* Call() {
+		Expr* expr = Primary();
+		while (Match({TokenType::LEFT_PAREN})) {
+			Token paren = Prev();
+			std::vector<Expr*> arguments;
+			if (!Check(TokenType::RIGHT_PAREN)) {
+				do {
+					arguments.push_back(Expression());
+				} while (Match({TokenType::COMMA}));
+			}
+			Consume(TokenType::RIGHT_PAREN, "Expected ')' after arguments.");
+			expr = new CallExpr(expr, paren, arguments);
+		}
 		return expr;
 	}
 	Expr* Primary() {
@@ -177,16 +333,34 @@ private:
 		if (Match({TokenType::NUMBER, TokenType::STRING}))
 			return new LiteralExpr(Prev().literal);
 		
-		if (Match({TokenType::IDENTIFIER}))
-			return new VarExpr(Prev());
+		if (Match({TokenType::IDENTIFIER})) {
+			VarExpr* var = new VarExpr(Prev());
+			var->slot = Resolve(Prev());
+			return var;
+		}
 
 		if (Match({TokenType::LEFT_PAREN})) {
 			Expr *expr = Expression();
 			Consume(TokenType::RIGHT_PAREN, "Expected ')' after expression.");
 			return new GroupExpr(expr);
 		}
+
+		if (Match({TokenType::LEFT_BRACE})) {
+			Token brace = Prev();
+			std::vector<Expr*> keys, values;
+			if (!Check(TokenType::RIGHT_BRACE)) {
+				do {
+					keys.push_back(Expression());
+					Consume(TokenType::COLON, "Expected ':' after map key.");
+					values.push_back(Expression());
+				} while (Match({TokenType::COMMA}));
+			}
+			Consume(TokenType::RIGHT_BRACE, "Expected '}' after map entries.");
+			return new MapExpr(brace, keys, values);
+		}
+		bool at_end = AtEnd();
 		Advance();
-		Error(Prev().line, "Unexpected token: '" + Prev().lexeme + "'.");
+		Error(Prev().line, "Unexpected token: '" + Prev().lexeme + "'.", at_end);
 		had_error = true;
 		throw std::runtime_error("Parser error");
 		return new LiteralExpr(Object(0.0f)); // Placeholder expression so parser doesn't crash
@@ -194,6 +368,17 @@ private:
 	Stmt* Declaration() {
 		if (Match({TokenType::VAR}))
 			return VarDecl();
+		if (Match({TokenType::FN}))
+			return FnDecl();
+		if (Check(TokenType::IDENTIFIER) && Peek().lexeme == "memo" && PeekNext().type == TokenType::FN) {
+			Advance();
+			Advance();
+			return FnDecl(true);
+		}
+		if (Match({TokenType::IMPORT}))
+			return Import();
+		if (Match({TokenType::SNAPSHOT}))
+			return Snapshot();
 		return Statement();
 	}
 	Stmt* VarDecl() {
@@ -203,13 +388,136 @@ private:
 		if (Match({TokenType::EQUAL}))
 			expr = Expression();
 		Consume(TokenType::SEMICOLON, "Expected ';' after variable declaration");
-		return new VarDeclStmt(identifier, expr);
+		if (scopes.size() == 1)
+			CheckMemoWrite(identifier);
+		// Declared after the initializer so 'var x = x;' reads the outer 'x'
+		VarDeclStmt* decl = new VarDeclStmt(identifier, expr);
+		decl->slot = Declare(identifier);
+		return decl;
+	}
+	Stmt* Import() {
+		Token keyword = Prev();
+		if (scopes.size() > 1)
+			Error(keyword.line, "'import' can only be used at the top level of a file.");
+		Token name = Consume(TokenType::STRING, "Expected a module path after 'import'.");
+		Consume(TokenType::SEMICOLON, "Expected ';' after import.");
+		if (!memo_relied_on.empty())
+			Error(keyword.line, "'import' can't come after a 'memo' function, since the module could redefine what it relies on.");
+		imported = true;
+		std::filesystem::path path = ObjStr(name.literal);
+		if (!directory.empty() && path.is_relative())
+			path = std::filesystem::path(directory) / path;
+		return new ImportStmt(keyword, ObjStr(name.literal), path.string());
+	}
+	Stmt* Snapshot() {
+		Token keyword = Prev();
+		if (scopes.size() > 1)
+			Error(keyword.line, "'snapshot' can only be used at the top level of a file.");
+		Consume(TokenType::SEMICOLON, "Expected ';' after 'snapshot'.");
+		return new SnapshotStmt(keyword);
+	}
+	Stmt* FnDecl(bool memo = false) {
+		Token name = Consume(TokenType::IDENTIFIER, "Expected a function name.");
+		bool top_level = scopes.size() == 1;
+		i32 slot = Declare(name); // Before the body, so the function can recurse
+		Consume(TokenType::LEFT_PAREN, "Expected '(' after function name.");
+
+		u8 outer_loop_count = loop_count;
+		u8 outer_parallel_loop = parallel_loop;
+		loop_count = 0;
+		parallel_loop = 0;
+		frame_sizes.push_back(0);
+		BeginScope();
+		std::vector<std::string> params;
+		if (!Check(TokenType::RIGHT_PAREN)) {
+			do {
+				Token param = Consume(TokenType::IDENTIFIER, "Expected a parameter name.");
+				if (scopes.back().names.count(param.lexeme))
+					Error(param.line, "Duplicate parameter '" + param.lexeme + "'.");
+				Declare(param);
+				params.push_back(param.lexeme);
+			} while (Match({TokenType::COMMA}));
+		}
+		Consume(TokenType::RIGHT_PAREN, "Expected ')' after parameters.");
+		Consume(TokenType::LEFT_BRACE, "Expected '{' before function body.");
+		std::vector<Stmt*> body = Block();
+		EndScope();
+		u32 frame_size = frame_sizes.back();
+		frame_sizes.pop_back();
+		loop_count = outer_loop_count;
+		parallel_loop = outer_parallel_loop;
+
+		Function* function = heap.New<Function>(name.lexeme, params, body, frame_size);
+		FnDeclStmt* decl = new FnDeclStmt(name, function, slot);
+		if (top_level)
+			CheckMemoWrite(name);
+		if (memo && !top_level)
+			Error(name.line, "'memo' functions can only be declared at the top level of a file.");
+		if (memo && imported)
+			Error(name.line, "'memo' functions can't be declared after an 'import', since the module could have redefined what they rely on.");
+		if (memo) {
+			RelyOnPurity(name, body);
+			function->memo = NewMemoTable();
+		}
+		return decl;
+	}
+	// A 'memo' function may only use its own locals, other 'memo' functions
+	// declared before it and built-ins that touch nothing but their arguments
+	void RelyOnPurity(const Token& name, const std::vector<Stmt*>& body) {
+		std::vector<std::string> used;
+		PurityCheck check;
+		check.can_use = [&](const std::string& global) {
+			bool pure = global == name.lexeme || memo_functions.count(global);
+			if (!pure && !scopes[0].names.count(global)) {
+				const Builtin* builtin = FindBuiltin(global);
+				pure = builtin && builtin->pure;
+			}
+			if (pure) used.push_back(global);
+			return pure;
+		};
+		if (!check.Pure(body))
+			Error(check.line ? check.line : name.line, "'memo' function '" + name.lexeme + "' " + check.problem + ".");
+		memo_functions.insert(name.lexeme);
+		used.push_back(name.lexeme);
+		for (const std::string& global : used)
+			memo_relied_on.emplace(global, name.lexeme);
+	}
+	// Whether 'name' is a global here, rather than a local or a variable of
+	// a block outside functions
+	bool IsGlobal(const std::string& name) {
+		for (u32 i = scopes.size() - 1; i > 0; i--)
+			if (scopes[i].names.count(name)) return false;
+		return true;
+	}
+	void CheckMemoWrite(const Token& name) {
+		auto iter = memo_relied_on.find(name.lexeme);
+		if (iter == memo_relied_on.end() || !IsGlobal(name.lexeme))
+			return;
+		if (iter->second == name.lexeme)
+			Error(name.line, "Can't redefine the 'memo' function '" + name.lexeme + "'.");
+		Error(name.line, "Can't redefine '" + name.lexeme + "', which the 'memo' function '" + iter->second + "' relies on.");
 	}
 	Stmt* Statement() {
 		if (Match({TokenType::PRINT}))
 			return Print();
-		else if (Match({TokenType::LEFT_BRACE}))
-			return new BlockStmt(Block());
+		else if (Check(TokenType::IDENTIFIER) && Peek().lexeme == "parallel" && PeekNext().type == TokenType::FOR) {
+			Advance();
+			Advance();
+			return ParallelFor();
+		}
+		else if (Check(TokenType::SPAWN) && PeekNext().type == TokenType::LEFT_BRACE) {
+			// A spawned block reads like any other, without a ';'
+			Expr* expr = Unary();
+			Match({TokenType::SEMICOLON});
+			return new ExprStmt(expr);
+		}
+		else if (Match({TokenType::LEFT_BRACE})) {
+			BeginScope();
+			BlockStmt* block = new BlockStmt(Block());
+			EndScope();
+			block->scoped = !InFunction();
+			return block;
+		}
 		else if (Match({TokenType::IF}))
 			return If();
 		else if (Match({TokenType::WHILE}))
@@ -220,6 +528,8 @@ private:
 			return Break();
 		else if (Match({TokenType::CONTINUE}))
 			return Continue();
+		else if (Match({TokenType::RETURN}))
+			return Return();
 
 		return ExpressionStmt();
 	}
@@ -264,7 +574,11 @@ private:
 	Stmt* For() {
 		loop_count++;
 		Consume(TokenType::LEFT_PAREN, "Expected '(' after 'for'.");
+
+		if (Check(TokenType::IDENTIFIER) && PeekNext().type == TokenType::IN)
+			return RangeFor();
 		
+		BeginScope();
 		Stmt* initializer;
 		if (Match({TokenType::SEMICOLON}))
 			initializer = 0;
@@ -284,29 +598,192 @@ private:
 		Consume(TokenType::RIGHT_PAREN, "Expected ')' after for clauses.");
 
 		Stmt* body = Statement();
+		EndScope();
 
 		loop_count--;
-		return new ForStmt(initializer, condition, increment, body);
+		ForStmt* loop = new ForStmt(initializer, condition, increment, body);
+		loop->scoped = !InFunction();
+		DetectCountedLoop(loop);
+		return loop;
+	}
+	// 'parallel for (i in a..b) reduce (sum x, max y) body', a range loop
+	// whose iterations may run in any order on any thread
+	Stmt* ParallelFor() {
+		Token keyword = Prev();
+		if (InFunction())
+			Error(keyword.line, "'parallel for' loops can only be used outside functions.");
+		if (parallel_loop)
+			Error(keyword.line, "'parallel for' loops can't be nested.");
+		loop_count++;
+		Consume(TokenType::LEFT_PAREN, "Expected '(' after 'for'.");
+		if (!Check(TokenType::IDENTIFIER) || PeekNext().type != TokenType::IN)
+			Error(Peek().line, "Expected 'name in start..end' after 'parallel for'.");
+		return RangeFor(true);
+	}
+	std::vector<Reduction> Reductions() {
+		std::vector<Reduction> reductions;
+		if (!Check(TokenType::IDENTIFIER) || Peek().lexeme != "reduce")
+			return reductions;
+		Advance();
+		Consume(TokenType::LEFT_PAREN, "Expected '(' after 'reduce'.");
+		do {
+			Token op = Consume(TokenType::IDENTIFIER, "Expected sum, product, min or max.");
+			Reduction reduction;
+			if (op.lexeme == "sum") reduction.op = Reduction::SUM;
+			else if (op.lexeme == "product") reduction.op = Reduction::PRODUCT;
+			else if (op.lexeme == "min") reduction.op = Reduction::MIN;
+			else if (op.lexeme == "max") reduction.op = Reduction::MAX;
+			else Error(op.line, "Expected sum, product, min or max, not '" + op.lexeme + "'.");
+			reduction.name = Consume(TokenType::IDENTIFIER, "Expected a variable to reduce into.");
+			CheckMemoWrite(reduction.name);
+			for (const Reduction& other : reductions)
+				if (other.name.lexeme == reduction.name.lexeme)
+					Error(reduction.name.line, "'" + reduction.name.lexeme + "' is reduced twice.");
+			reductions.push_back(reduction);
+		} while (Match({TokenType::COMMA}));
+		Consume(TokenType::RIGHT_PAREN, "Expected ')' after reductions.");
+		return reductions;
+	}
+	// Code on other threads can't share writes, so anything declared outside
+	// a parallel loop body or spawn block is read-only there
+	void CheckIsolatedWrite(const Token& name) {
+		if (isolated_scope < 0) return;
+		for (const std::string& writable : isolated_writable)
+			if (writable == name.lexeme) return;
+		for (i32 i = scopes.size() - 1; i >= isolated_scope; i--)
+			if (scopes[i].names.count(name.lexeme)) return;
+		std::string what = parallel_loop ? "its own variables and reductions" : "its own variables";
+		Error(name.line, std::string("A ") + isolated_by + " can only assign to " + what + ", not '" + name.lexeme + "'.");
+	}
+	Stmt* RangeFor(bool parallel = false) {
+		Token identifier = Advance();
+		Consume(TokenType::IN, "Expected 'in' after loop variable.");
+		Expr* start = Expression();
+		if (!parallel && !Check(TokenType::DOT_DOT))
+			return ForIn(identifier, start);
+		Consume(TokenType::DOT_DOT, "Expected '..' after range start.");
+		Expr* end = Expression();
+		Expr* step = 0;
+		if (Check(TokenType::IDENTIFIER) && Peek().lexeme == "step") {
+			Advance();
+			step = Expression();
+		}
+		Consume(TokenType::RIGHT_PAREN, "Expected ')' after range.");
+		std::vector<Reduction> reductions;
+		// A 'parallel for' can be inside a spawn block, whose limits come back after it
+		i32 outer_scope = isolated_scope;
+		std::vector<std::string> outer_writable = isolated_writable;
+		const char* outer_by = isolated_by;
+		if (parallel) {
+			reductions = Reductions();
+			isolated_writable.clear();
+			for (const Reduction& r : reductions)
+				isolated_writable.push_back(r.name.lexeme);
+			isolated_by = "'parallel for'";
+			parallel_loop = loop_count;
+		}
+
+		BeginScope();
+		if (parallel) isolated_scope = scopes.size() - 1;
+		i32 slot = Declare(identifier);
+		Stmt* body = Statement();
+		EndScope();
+		if (parallel) {
+			isolated_scope = outer_scope;
+			isolated_writable = outer_writable;
+			isolated_by = outer_by;
+			parallel_loop = 0;
+		}
+
+		loop_count--;
+		RangeForStmt* loop = new RangeForStmt(identifier, start, end, step, body);
+		loop->slot = slot;
+		loop->parallel = parallel;
+		loop->reductions = reductions;
+		return loop;
+	}
+	Stmt* ForIn(Token identifier, Expr* collection) {
+		Consume(TokenType::RIGHT_PAREN, "Expected ')' after map.");
+		BeginScope();
+		i32 slot = Declare(identifier);
+		Stmt* body = Statement();
+		EndScope();
+
+		loop_count--;
+		ForInStmt* loop = new ForInStmt(identifier, collection, body);
+		loop->slot = slot;
+		return loop;
 	}
 	Stmt* Break() {
 		if (loop_count == 0)
 			Error(Prev().line, "'break' statements must be inside a loop.");
+		if (parallel_loop && loop_count == parallel_loop)
+			Error(Prev().line, "'break' can't end a 'parallel for' early.");
 		Consume(TokenType::SEMICOLON, "Expected ';' after 'break' statement.");
 		return new BreakStmt;
 	}
+	Stmt* Return() {
+		Token keyword = Prev();
+		if (!InFunction())
+			Error(keyword.line, "'return' statements must be inside a function.");
+		Expr* value = 0;
+		if (!Check(TokenType::SEMICOLON))
+			value = Expression();
+		Consume(TokenType::SEMICOLON, "Expected ';' after return value.");
+		bool tail = value && value->Type() == NodeType::CALL_EXPR;
+		return new ReturnStmt(keyword, value, tail);
+	}
 	Stmt* Continue() {
 		if (loop_count == 0)
 			Error(Prev().line, "'continue' statements must be inside a loop.");
 		Consume(TokenType::SEMICOLON, "Expected ';' after 'continue' statement.");
 		return new ContinueStmt;
 	}
+	bool InFunction() {
+		return !frame_sizes.empty();
+	}
+	void BeginScope() {
+		Scope scope;
+		scope.function = frame_sizes.size();
+		scopes.push_back(scope);
+	}
+	void EndScope() {
+		scopes.pop_back();
+	}
+	// Returns the frame slot for a new function local, or -1 outside functions
+	i32 Declare(const Token& name) {
+		auto iter = scopes.back().names.find(name.lexeme);
+		if (iter != scopes.back().names.end())
+			return iter->second;
+		i32 slot = InFunction() ? (i32)frame_sizes.back()++ : -1;
+		scopes.back().names[name.lexeme] = slot;
+		return slot;
+	}
+	// Frame slot of a local of the current function, or -1 for a global.
+	// Functions have no closures, so locals of anything enclosing them
+	// can't be reached from inside.
+	i32 Resolve(const Token& name) {
+		for (i32 i = scopes.size() - 1; i >= 0; i--) {
+			auto iter = scopes[i].names.find(name.lexeme);
+			if (iter == scopes[i].names.end())
+				continue;
+			if (scopes[i].function == frame_sizes.size() || i == 0)
+				return iter->second;
+			Error(name.line, "Functions can't use '" + name.lexeme + "', a local variable of an enclosing scope.");
+		}
+		return -1;
+	}
 	bool AtEnd() {
 		return Peek().type == TokenType::EOF;
 	}
-	Token Peek() {
+	const Token& Peek() {
 		return tokens[current];
 	}
-	Token Prev() {
+	const Token& PeekNext() {
+		if (AtEnd()) return Peek();
+		return tokens[current+1];
+	}
+	const Token& Prev() {
 		return tokens[current-1];
 	}
 	bool Check(TokenType type) {
@@ -328,16 +805,22 @@ private:
 		}
 		return false;
 	}
-	void Error(u16 line, const std::string &message) {
-		std::cout << "Error on line " << line << ": " << message << "\n";
+	void Error(u16 line, const std::string &message, bool at_end = false) {
+		*errors << "Error on line " << line << ": " << message << "\n";
 		had_error = true;
+		ran_out = ran_out && at_end;
 		throw std::runtime_error(message);
 	}
 	Token Consume(TokenType type, const std::string& message) {
 		if (Check(type))
 			return Advance();
-		Error(Peek().line, message);
+		Error(Peek().line, message, AtEnd());
 		return Token();
 	}
 };
+
+// For Parser::directory
+std::string DirectoryOf(const std::string& path) {
+	return std::filesystem::path(path).parent_path().string();
+}
 #endif
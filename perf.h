@@ -0,0 +1,140 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include "util.h"
+#include "stats.h"
+#include <cstdio>
+#include <cstring>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+// Hardware counters for --perf-counters, read separately for each phase in
+// Stats::Phase. Each counter is opened on its own so one the kernel or the
+// CPU doesn't support only blanks out that column.
+class PerfCounters {
+public:
+	enum Counter { CYCLES = 0, INSTRUCTIONS, BRANCH_MISSES, CACHE_MISSES, COUNTER_COUNT };
+
+	// Returns false if no counter at all could be opened
+	bool Open() {
+		bool any = false;
+#ifdef __linux__
+		const u64 configs[COUNTER_COUNT] = {
+			PERF_COUNT_HW_CPU_CYCLES,
+			PERF_COUNT_HW_INSTRUCTIONS,
+			PERF_COUNT_HW_BRANCH_MISSES,
+			PERF_COUNT_HW_CACHE_MISSES
+		};
+		for (i32 i = 0; i < COUNTER_COUNT; i++) {
+			struct perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.size = sizeof(attr);
+			attr.config = configs[i];
+			attr.disabled = 1;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+			mFds[i] = (i32)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+			if (mFds[i] >= 0)
+				any = true;
+			else
+				mError = strerror(errno);
+		}
+#else
+		mError = "perf_event_open is only available on Linux";
+#endif
+		return any;
+	}
+	void Close() {
+#ifdef __linux__
+		for (i32 i = 0; i < COUNTER_COUNT; i++) {
+			if (mFds[i] >= 0) close(mFds[i]);
+			mFds[i] = -1;
+		}
+#endif
+	}
+	void Begin(Stats::Phase phase) {
+		mRunning = phase;
+#ifdef __linux__
+		for (i32 i = 0; i < COUNTER_COUNT; i++) {
+			if (mFds[i] < 0) continue;
+			ioctl(mFds[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(mFds[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+#endif
+	}
+	void End() {
+		if (mRunning < 0) return;
+#ifdef __linux__
+		for (i32 i = 0; i < COUNTER_COUNT; i++) {
+			if (mFds[i] < 0) continue;
+			ioctl(mFds[i], PERF_EVENT_IOC_DISABLE, 0);
+			u64 data[3] = {}; // value, time enabled, time running
+			if (read(mFds[i], data, sizeof(data)) != sizeof(data))
+				continue;
+			// Scale up if the kernel had to multiplex the counter
+			double value = (double)data[0];
+			if (data[2] != 0 && data[2] < data[1])
+				value *= (double)data[1] / data[2];
+			mValues[mRunning][i] += (u64)value;
+		}
+#endif
+		mRunning = -1;
+	}
+	void Report(bool json) {
+		End();
+		static const char* names[COUNTER_COUNT] = { "cycles", "instructions", "branch_misses", "cache_misses" };
+		bool any = false;
+		for (i32 i = 0; i < COUNTER_COUNT; i++)
+			any = any || mFds[i] >= 0;
+		if (!any) {
+			if (json) fprintf(stderr, "{\"perf_counters\": null, \"error\": \"%s\"}\n", mError.c_str());
+			else fprintf(stderr, "perf counters unavailable: %s\n", mError.c_str());
+			return;
+		}
+		if (json) {
+			fprintf(stderr, "{\"perf_counters\": {");
+			for (i32 phase = Stats::LEX; phase < Stats::PHASE_COUNT; phase++) {
+				fprintf(stderr, "%s\"%s\": {", phase != Stats::LEX ? ", " : "", Stats::PhaseName(phase));
+				for (i32 i = 0; i < COUNTER_COUNT; i++) {
+					fprintf(stderr, "%s\"%s\": ", i ? ", " : "", names[i]);
+					if (mFds[i] >= 0) fprintf(stderr, "%llu", (unsigned long long)mValues[phase][i]);
+					else fprintf(stderr, "null");
+				}
+				fprintf(stderr, "}");
+			}
+			fprintf(stderr, "}}\n");
+			return;
+		}
+		fprintf(stderr, "%-8s", "phase");
+		for (i32 i = 0; i < COUNTER_COUNT; i++)
+			fprintf(stderr, " %16s", names[i]);
+		fprintf(stderr, " %8s\n", "ipc");
+		for (i32 phase = Stats::LEX; phase < Stats::PHASE_COUNT; phase++) {
+			fprintf(stderr, "%-8s", Stats::PhaseName(phase));
+			for (i32 i = 0; i < COUNTER_COUNT; i++) {
+				if (mFds[i] >= 0) fprintf(stderr, " %16llu", (unsigned long long)mValues[phase][i]);
+				else fprintf(stderr, " %16s", "n/a");
+			}
+			if (mFds[CYCLES] >= 0 && mFds[INSTRUCTIONS] >= 0 && mValues[phase][CYCLES])
+				fprintf(stderr, " %8.2f\n", (double)mValues[phase][INSTRUCTIONS] / mValues[phase][CYCLES]);
+			else
+				fprintf(stderr, " %8s\n", "n/a");
+		}
+	}
+private:
+	i32 mFds[COUNTER_COUNT] = { -1, -1, -1, -1 };
+	u64 mValues[Stats::PHASE_COUNT][COUNTER_COUNT] = {};
+	i32 mRunning = -1;
+	std::string mError;
+};
+
+PerfCounters perf_counters;
+
+#endif
@@ -0,0 +1,430 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include "util.h"
+#include "stats.h"
+#include "interpreter.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <ucontext.h>
+#endif
+
+/*
+A work-stealing thread pool whose tasks run as fibers: each gets a stack of
+its own, so a task that has to wait (on a channel, a join, or a parallel
+loop it started) parks and lets its worker run something else.
+
+Every worker has a queue. It takes new tasks from the back of its own and,
+once that's empty, steals from the front of another's. Queue 0 takes what
+threads outside the pool hand in; those threads don't run tasks, they sleep
+until what they wait for is done.
+
+A task that has started stays on its worker, since code compiled for one
+thread may keep the address of a thread_local across a switch (see
+scheduler.h). So only tasks that haven't started are stolen, and a parked
+task goes back on the "ready" list of the worker it started on.
+*/
+
+typedef std::function<void()> Task;
+
+const size_t FIBER_STACK_SIZE = 8 << 20; // Reserved, only touched pages are used
+const u32 FIBER_VALUE_STACK_SIZE = STACK_SIZE / 32; // Enough for MAX_CALL_DEPTH small frames
+const i64 FIBER_SLICE = 10000; // Ticks before the other tasks on a worker get a turn
+const u32 SPARE_STACKS = 16; // Kept by each worker for its next tasks
+
+// Thrown from ErrorRT() in a task (see end_script) and caught where the task
+// started, so an error ends only that task
+struct TaskFailed {};
+
+#ifndef _WIN32
+
+// Returns 0 if the stack can't be mapped
+char* AllocateStack() {
+	void* stack = mmap(0, FIBER_STACK_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+	if (stack == MAP_FAILED)
+		return 0;
+	mprotect(stack, 4096, PROT_NONE); // Overflowing faults instead of corrupting memory
+	return (char*)stack;
+}
+void FreeStack(char* stack) {
+	munmap(stack, FIBER_STACK_SIZE);
+}
+
+struct Fiber {
+	Task task;
+	Task finished; // Runs on the worker once the task is done and its state is gone
+	InterpreterState state{Ref<Environment>()}; // The task sets its own globals
+	const char* script_name = 0;
+	ucontext_t context;
+	char* stack = 0;
+	u32 home = 0; // The worker it started on, the only one that may resume it
+	bool done = false;
+	static thread_local Fiber* current;
+};
+thread_local Fiber* Fiber::current = 0;
+
+// Something blocked until Wake(): a parked fiber, or a thread outside the pool
+struct Waiter {
+	Fiber* fiber = Fiber::current;
+	std::atomic<bool> woken{false};
+};
+
+class ThreadPool {
+public:
+	// Workers; zero means one per core. --threads sets it before the pool is
+	// first used.
+	static u32 threads;
+	static ThreadPool& Get() {
+		// Never destroyed, so exit() doesn't wait on sleeping workers
+		static ThreadPool* pool = mInstance = new ThreadPool(threads ? threads : std::max(1u, std::thread::hardware_concurrency()));
+		return *pool;
+	}
+	// Returns once every task is done or blocked for good, so a script's
+	// output is complete when it ends
+	static void Drain() {
+		if (!mInstance) return;
+		std::unique_lock<std::mutex> lock(mInstance->mSleepLock);
+		mInstance->mOutsideWake.wait(lock, [] { return mInstance->mActive == 0; });
+	}
+	// Queues 'task' to run as a fiber; 'finished' runs after it on the same
+	// worker
+	void Spawn(Task task, Task finished) {
+		Fiber* fiber = new Fiber();
+		fiber->task = std::move(task);
+		fiber->finished = std::move(finished);
+		fiber->script_name = script_name;
+		fiber->state.value_stack_size = FIBER_VALUE_STACK_SIZE;
+		output.Flush(); // What was printed before the task comes before what it prints
+		threads_share_objects++;
+		mActive++;
+		stats.tasks++;
+		Queue& queue = mQueues[mIndex];
+		{
+			std::lock_guard<std::mutex> guard(queue.lock);
+			queue.fresh.push_back(fiber);
+			stats.max_queue_depth = std::max<u64>(stats.max_queue_depth, queue.fresh.size());
+		}
+		mQueued++;
+		Notify(mWake);
+	}
+	// Returns once every task has run
+	void Run(std::vector<Task>& tasks, u16 line) {
+		if (tasks.empty()) return;
+		std::atomic<u32> left{(u32)tasks.size()};
+		Waiter waiter;
+		for (Task& task : tasks)
+			Spawn(std::move(task), [this, &left, &waiter] {
+				if (--left == 0) Wake(waiter);
+			});
+		Wait(waiter, line);
+	}
+	// Returns once Wake(waiter) has been called, which may be before this is
+	void Wait(Waiter& waiter, u16 line) {
+		if (waiter.fiber) {
+			stats.context_switches++;
+			if (--mActive == 0) Notify(mOutsideWake);
+			Switch();
+			return;
+		}
+		output.Flush();
+		std::unique_lock<std::mutex> lock(mSleepLock);
+		while (!waiter.woken) {
+			// Only a task could wake this thread, and they're all parked
+			if (mActive == 0) {
+				lock.unlock();
+				ErrorRT(line, "Every task is blocked, so this would wait forever.");
+			}
+			mOutsideWake.wait(lock);
+		}
+	}
+	void Wake(Waiter& waiter) {
+		if (Fiber* fiber = waiter.fiber) {
+			mActive++;
+			MakeReady(fiber);
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> guard(mSleepLock);
+			waiter.woken = true;
+		}
+		mOutsideWake.notify_all();
+	}
+	// From Tick(), when the running task has used up its slice
+	void Yield() {
+		stats.context_switches++;
+		MakeReady(Fiber::current);
+		Switch();
+	}
+private:
+	struct Queue {
+		std::mutex lock;
+		std::deque<Fiber*> fresh; // Not started, so any worker may take them
+		std::deque<Fiber*> ready; // Started here and able to go on
+		std::atomic<u32> ready_count{0};
+	};
+	std::vector<Queue> mQueues; // Queue i belongs to worker i, 0 to everyone else
+	std::atomic<u32> mQueued{0}; // Fresh fibers in all queues
+	std::atomic<u32> mActive{0}; // Fibers that aren't done or parked
+	std::mutex mSleepLock;
+	std::condition_variable mWake; // Idle workers sleep on this
+	std::condition_variable mOutsideWake; // And threads outside the pool on this
+	static ThreadPool* mInstance;
+	static thread_local u32 mIndex;
+	static thread_local ucontext_t mLoop; // Where a worker picks its next fiber
+	static thread_local std::vector<char*> mSpareStacks;
+
+	ThreadPool(u32 workers) : mQueues(workers + 1) {
+		for (u32 i = 1; i <= workers; i++)
+			std::thread(&ThreadPool::Work, this, i).detach();
+	}
+	// Taking the lock first means a sleeper that has just checked its
+	// condition is already waiting when this notifies
+	void Notify(std::condition_variable& sleepers) {
+		{
+			std::lock_guard<std::mutex> guard(mSleepLock);
+		}
+		sleepers.notify_all();
+	}
+	void MakeReady(Fiber* fiber) {
+		Queue& queue = mQueues[fiber->home];
+		{
+			std::lock_guard<std::mutex> guard(queue.lock);
+			queue.ready.push_back(fiber);
+		}
+		queue.ready_count++;
+		Notify(mWake);
+	}
+	// Back to the worker's loop, from the fiber's own stack
+	void Switch() {
+		output.Flush();
+		swapcontext(&Fiber::current->context, &mLoop);
+	}
+	Fiber* Next() {
+		Queue& own = mQueues[mIndex];
+		{
+			std::lock_guard<std::mutex> guard(own.lock);
+			if (!own.ready.empty()) {
+				Fiber* fiber = own.ready.front();
+				own.ready.pop_front();
+				own.ready_count--;
+				return fiber;
+			}
+			if (!own.fresh.empty()) {
+				Fiber* fiber = own.fresh.back();
+				own.fresh.pop_back();
+				mQueued--;
+				return fiber;
+			}
+		}
+		for (u32 i = 1; i < mQueues.size(); i++) {
+			Queue& victim = mQueues[(mIndex + i) % mQueues.size()];
+			std::lock_guard<std::mutex> guard(victim.lock);
+			if (!victim.fresh.empty()) {
+				Fiber* fiber = victim.fresh.front();
+				victim.fresh.pop_front();
+				mQueued--;
+				if (&victim != &mQueues[0])
+					stats.steals++;
+				return fiber;
+			}
+		}
+		return 0;
+	}
+	void Work(u32 index) {
+		mIndex = index;
+		end_script = [] { throw TaskFailed(); };
+		globals = Ref<Environment>(); // Every fiber brings its own
+		environment = 0;
+		while (true) {
+			Fiber* fiber = Next();
+			if (!fiber) {
+				std::unique_lock<std::mutex> lock(mSleepLock);
+				mWake.wait(lock, [&] { return mQueued > 0 || mQueues[index].ready_count > 0; });
+				continue;
+			}
+			Resume(fiber);
+			if (fiber->done)
+				Finish(fiber);
+		}
+	}
+	void Resume(Fiber* fiber) {
+		if (!fiber->stack && !Start(fiber)) {
+			output.Flush();
+			std::cout << "Error: Could not allocate a stack for a task.\n";
+			fiber->done = true;
+			return;
+		}
+		Fiber::current = fiber;
+		script_name = fiber->script_name;
+		fiber->state.Swap();
+		budget = FIBER_SLICE;
+		swapcontext(&mLoop, &fiber->context);
+		budget = INT64_MAX;
+		fiber->state.Swap();
+		script_name = 0;
+		Fiber::current = 0;
+	}
+	bool Start(Fiber* fiber) {
+		if (!mSpareStacks.empty()) {
+			fiber->stack = mSpareStacks.back();
+			mSpareStacks.pop_back();
+		}
+		else if (!(fiber->stack = AllocateStack()))
+			return false;
+		fiber->home = mIndex;
+		getcontext(&fiber->context);
+		fiber->context.uc_stack.ss_sp = fiber->stack;
+		fiber->context.uc_stack.ss_size = FIBER_STACK_SIZE;
+		fiber->context.uc_link = &mLoop;
+		makecontext(&fiber->context, Entry, 0);
+		return true;
+	}
+	// Returns to mLoop through uc_link when the task is done
+	static void Entry() {
+		Fiber* fiber = Fiber::current;
+		try {
+			fiber->task();
+		} catch (const TaskFailed&) {}
+		output.Flush();
+		fiber->done = true;
+	}
+	void Finish(Fiber* fiber) {
+		if (fiber->stack) {
+			if (mSpareStacks.size() < SPARE_STACKS)
+				mSpareStacks.push_back(fiber->stack);
+			else
+				FreeStack(fiber->stack);
+		}
+		Task finished = std::move(fiber->finished);
+		delete fiber;
+		if (finished)
+			finished();
+		finished = Task();
+		// Nothing else collects a worker's counters, and Drain() returns
+		// once they're in
+		MergeWorkerStats();
+		threads_share_objects--;
+		if (--mActive == 0)
+			Notify(mOutsideWake);
+	}
+};
+u32 ThreadPool::threads = 0;
+ThreadPool* ThreadPool::mInstance = 0;
+thread_local u32 ThreadPool::mIndex = 0;
+thread_local ucontext_t ThreadPool::mLoop;
+thread_local std::vector<char*> ThreadPool::mSpareStacks;
+
+#else
+
+struct Fiber {
+	static thread_local Fiber* current;
+};
+thread_local Fiber* Fiber::current = 0;
+
+struct Waiter {
+	std::atomic<bool> woken{false};
+};
+
+// Without ucontext a task can't park, so tasks run in place as they're
+// handed in, and waiting for something that hasn't happened yet is an error
+class ThreadPool {
+public:
+	static u32 threads;
+	static ThreadPool& Get() {
+		static ThreadPool pool;
+		return pool;
+	}
+	static void Drain() {}
+	void Spawn(Task task, Task finished) {
+		stats.tasks++;
+		InterpreterState saved{globals};
+		saved.Swap();
+		// The value stack is shared, with the task's frames above the spawner's
+		value_stack.swap(saved.value_stack);
+		stack_top = saved.stack_top;
+		void (*prev)() = end_script;
+		end_script = [] { throw TaskFailed(); };
+		try {
+			task();
+		} catch (const TaskFailed&) {}
+		end_script = prev;
+		value_stack.swap(saved.value_stack);
+		saved.Swap();
+		if (finished) finished();
+	}
+	void Run(std::vector<Task>& tasks, u16 line) {
+		for (Task& task : tasks)
+			Spawn(std::move(task), Task());
+	}
+	void Wait(Waiter& waiter, u16 line) {
+		if (!waiter.woken)
+			ErrorRT(line, "Every task is blocked, so this would wait forever.");
+	}
+	void Wake(Waiter& waiter) {
+		waiter.woken = true;
+	}
+	void Yield() {}
+};
+u32 ThreadPool::threads = 0;
+
+#endif
+
+// Things waiting for one event, like a channel getting room or a task ending
+class WaitList {
+public:
+	// Adds 'waiter' unless 'ready' is true once it's counted, which closes
+	// the gap between a failed attempt and going to sleep. Returns whether
+	// it was added.
+	template <typename Ready>
+	bool Add(Waiter& waiter, Ready ready) {
+		std::lock_guard<std::mutex> guard(mLock);
+		mCount++;
+		if (ready()) {
+			mCount--;
+			return false;
+		}
+		mWaiters.push_back(&waiter);
+		return true;
+	}
+	void WakeOne() {
+		std::atomic_thread_fence(std::memory_order_seq_cst); // The caller's change comes before the check
+		if (mCount == 0) return;
+		Waiter* waiter = 0;
+		{
+			std::lock_guard<std::mutex> guard(mLock);
+			if (!mWaiters.empty()) {
+				waiter = mWaiters.front();
+				mWaiters.pop_front();
+				mCount--;
+			}
+		}
+		if (waiter)
+			ThreadPool::Get().Wake(*waiter);
+	}
+	void WakeAll() {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (mCount == 0) return;
+		std::deque<Waiter*> waiters;
+		{
+			std::lock_guard<std::mutex> guard(mLock);
+			std::swap(waiters, mWaiters);
+			mCount = 0;
+		}
+		for (Waiter* waiter : waiters)
+			ThreadPool::Get().Wake(*waiter);
+	}
+private:
+	std::mutex mLock;
+	std::deque<Waiter*> mWaiters;
+	std::atomic<u32> mCount{0};
+};
+
+#endif
@@ -0,0 +1,149 @@
+#ifndef REPL_H
+#define REPL_H
+
+#include "util.h"
+#include "lexer.h"
+#include "parser.h"
+#include "interpreter.h"
+#include "types.h"
+#include "simplify.h"
+#include "pool.h"
+#include <iostream>
+#include <sstream>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+/*
+The interactive prompt, when bomac runs without a script. Each line is lexed
+once, on its own, and added to the entry being typed. The whole entry is
+parsed after every line as more of the same program: the parser keeps its
+global names and 'memo' protection from earlier entries (Parser::ParseMore),
+and the globals stay between entries. If the parse only failed by running
+out of tokens, the entry is held for the next line, and the parser's globals
+are put back as they were (Parser::SaveGlobals) so the retry starts clean.
+An entry ending in an 'if' without 'else' is held the same way until a line
+that doesn't start with 'else'.
+
+An entry's statements are freed once it has run. Functions and spawned
+blocks own the parts of it they keep. The token and statement buffers are
+reused for the next entry, so a long session keeps using the same memory.
+A runtime error ends only the entry it happened in.
+
+Calls aren't tied to built-ins (see TypeInference), since a later entry
+could still define a function of the same name.
+*/
+
+struct EntryFailed {};
+
+class Repl {
+public:
+	Repl(bool simplify, bool cse) : mSimplify(simplify), mCse(cse) {
+		mTypes.bind_builtins = false;
+		mParser.errors = &mErrors;
+	}
+	// Reads lines until 'in' ends. Prompts only when stdin is a terminal.
+	void Run(std::istream& in) {
+		bool prompt = isatty(0);
+		std::string line;
+		while (true) {
+			output.Flush();
+			if (prompt) {
+				std::cout << (mPending.empty() ? ">>> " : "... ");
+				std::cout.flush();
+			}
+			if (!std::getline(in, line)) break;
+			Feed(line);
+		}
+		if (!mPending.empty())
+			Execute(true);
+		ThreadPool::Drain();
+		output.Flush();
+	}
+	// Adds 'line' to the entry and runs it once it's complete
+	void Feed(const std::string& line) {
+		mLexer.Begin(line, 0, mLine++);
+		mLexer.ScanUntil(line.size());
+		if (mHeldIf && (mLexer.tokens.empty() || mLexer.tokens[0].type != TokenType::ELSE))
+			Execute(true);
+		if (mLexer.HadError()) {
+			mPending.clear();
+			mHeldIf = false;
+			return;
+		}
+		for (Token& token : mLexer.tokens)
+			mPending.push_back(std::move(token));
+		if (!mLexer.tokens.empty())
+			Execute(false);
+	}
+private:
+	Lexer mLexer;
+	Parser mParser;
+	TypeInference mTypes;
+	bool mSimplify, mCse;
+	std::vector<Token> mPending; // Of the entry being typed
+	std::vector<Token> mEntry; // mPending and an EOF, as the parser takes them
+	bool mHeldIf = false; // mPending is complete, but could go on with 'else'
+	std::ostringstream mErrors; // Of the last parse
+	u32 mLine = 1;
+
+	// An 'if' an 'else' could still be added to, at the end of its chain
+	static bool OpenIf(Stmt* stmt) {
+		while (stmt->Type() == NodeType::IF_STMT) {
+			IfStmt* branch = (IfStmt*)stmt;
+			if (!branch->else_branch) return true;
+			stmt = branch->else_branch;
+		}
+		return false;
+	}
+	// Parses the entry and runs it, unless it could go on and 'last' isn't set
+	void Execute(bool last) {
+		mEntry.assign(mPending.begin(), mPending.end());
+		Token eof;
+		eof.type = TokenType::EOF;
+		eof.line = mPending.back().line;
+		mEntry.push_back(eof);
+		Parser::Globals names = mParser.SaveGlobals();
+		mErrors.str("");
+		mParser.ParseMore(mEntry);
+		std::vector<Stmt*>& statements = mParser.statements;
+		mHeldIf = !last && !mParser.HadError() && !statements.empty() && OpenIf(statements.back());
+		bool hold = mHeldIf || (!last && mParser.RanOut());
+		if (hold)
+			mParser.RestoreGlobals(names);
+		else {
+			output.Flush(); // What the entry before printed comes first
+			if (mParser.RanOut())
+				GenericError("Input ended inside an unfinished statement.");
+			else
+				std::cout << mErrors.str();
+			mPending.clear();
+		}
+		if (!hold && !mParser.HadError()) {
+			mTypes.Run(statements);
+			if (mSimplify)
+				Simplifier(mCse).Run(statements);
+			end_script = [] { throw EntryFailed(); };
+			try {
+				for (Stmt* stmt : statements)
+					stmt->Evaluate();
+			} catch (const EntryFailed&) {
+				environment = globals.Get();
+				frame = 0;
+				stack_top = 0;
+				call_depth = 0;
+				tail_callee = 0;
+			}
+			end_script = 0;
+		}
+		for (Stmt* stmt : statements) {
+			stmt->Destroy();
+			delete stmt;
+		}
+		statements.clear();
+	}
+};
+
+#endif
@@ -0,0 +1,213 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "util.h"
+#include "lexer.h"
+#include "parser.h"
+#include "interpreter.h"
+#include "closure.h"
+#include "types.h"
+#include "simplify.h"
+#include "server.h"
+#include "pool.h"
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <thread>
+
+/*
+Green threads: running several scripts at once on a few OS threads. Every
+script gets its own stack and its own InterpreterState, and runs until it
+has used up a budget of ticks (loop iterations and calls, see Tick()). Then
+it yields to its worker thread, which takes turns between the scripts it
+was given. A script stays on one worker for its whole life: code compiled
+for one thread may keep the address of a thread_local across a switch.
+
+A runtime error ends only the script that hit it.
+*/
+
+const i64 DEFAULT_SLICE = 10000; // Ticks per turn
+
+#ifndef _WIN32
+
+struct GreenThread {
+	std::string name;
+	std::vector<Stmt*> statements;
+	InterpreterState state;
+	ucontext_t context;
+	char* stack = 0;
+	bool started = false;
+	bool done = false;
+};
+
+struct ScriptEnded {};
+
+class Worker {
+public:
+	std::deque<GreenThread*> queue;
+	Worker(RunOptions options, i64 slice) : mOptions(options), mSlice(slice) {}
+	void Run() {
+		current = this;
+		end_script = [] { throw ScriptEnded(); };
+		while (!queue.empty()) {
+			GreenThread* thread = queue.front();
+			queue.pop_front();
+			Resume(thread);
+			if (thread->done)
+				Finish(thread);
+			else
+				queue.push_back(thread);
+		}
+		output.Flush();
+		globals = Ref<Environment>(); // This thread's own, made by the first Swap()
+		environment = 0;
+		MergeWorkerStats();
+	}
+	// Called from Tick() on the green thread's own stack
+	static void Yield() {
+		stats.context_switches++;
+		output.Flush();
+		swapcontext(&current->mRunning->context, &current->mContext);
+	}
+	static thread_local Worker* current;
+private:
+	RunOptions mOptions;
+	i64 mSlice;
+	ucontext_t mContext;
+	GreenThread* mRunning = 0;
+
+	void Resume(GreenThread* thread) {
+		if (!thread->started && !Start(thread)) {
+			thread->done = true;
+			return;
+		}
+		mRunning = thread;
+		script_name = thread->name.c_str();
+		thread->state.Swap();
+		budget = mSlice;
+		swapcontext(&mContext, &thread->context);
+		budget = INT64_MAX;
+		thread->state.Swap();
+		script_name = 0;
+		mRunning = 0;
+	}
+	bool Start(GreenThread* thread) {
+		thread->stack = AllocateStack();
+		if (!thread->stack) {
+			GenericError("Could not allocate a stack for " + thread->name);
+			return false;
+		}
+		getcontext(&thread->context);
+		thread->context.uc_stack.ss_sp = thread->stack;
+		thread->context.uc_stack.ss_size = FIBER_STACK_SIZE;
+		thread->context.uc_link = &mContext;
+		makecontext(&thread->context, Entry, 0);
+		thread->started = true;
+		return true;
+	}
+	// Returns to mContext through uc_link when the script is done
+	static void Entry() {
+		Worker* worker = current;
+		GreenThread* thread = worker->mRunning;
+		try {
+			ClosureCompiler compiler;
+			if (worker->mOptions.use_closures && compiler.Compile(thread->statements))
+				compiler.Run();
+			else
+				for (Stmt* stmt : thread->statements)
+					stmt->Evaluate();
+		} catch (const ScriptEnded&) {}
+		output.Flush();
+		thread->done = true;
+	}
+	void Finish(GreenThread* thread) {
+		for (Stmt* stmt : thread->statements) {
+			stmt->Destroy();
+			delete stmt;
+		}
+		if (thread->stack)
+			FreeStack(thread->stack);
+		delete thread;
+	}
+};
+thread_local Worker* Worker::current = 0;
+
+// The budget only runs out in a green thread or in a task on the pool
+void Preempt() {
+	if (Worker::current)
+		Worker::Yield();
+	else if (Fiber::current)
+		ThreadPool::Get().Yield();
+	else
+		budget = INT64_MAX;
+}
+
+// Compile errors are printed and the script is left out
+GreenThread* Load(const char* path, RunOptions options) {
+	std::ifstream file(path);
+	if (!file.is_open()) {
+		GenericError("Could not open file: " + std::string(path));
+		return 0;
+	}
+	std::string source, line;
+	while (std::getline(file, line))
+		source += line + "\n";
+	Lexer lexer;
+	Parser parser;
+	parser.directory = DirectoryOf(path);
+	lexer.Lex(source);
+	parser.Parse(lexer.tokens);
+	stats.tokens += lexer.tokens.size();
+	if (parser.HadError()) {
+		for (Stmt* stmt : parser.statements) {
+			stmt->Destroy();
+			delete stmt;
+		}
+		return 0;
+	}
+	TypeInference().Run(parser.statements);
+	if (options.simplify)
+		Simplifier(options.cse).Run(parser.statements);
+	GreenThread* thread = new GreenThread();
+	thread->name = path;
+	thread->statements = parser.statements;
+	thread->state.value_stack_size = FIBER_VALUE_STACK_SIZE;
+	return thread;
+}
+
+// Runs every script to completion, 'slice' ticks at a time, spread over
+// 'threads' workers
+i32 Schedule(const std::vector<const char*>& paths, RunOptions options, u32 threads, i64 slice) {
+	std::vector<GreenThread*> scripts;
+	for (const char* path : paths)
+		if (GreenThread* thread = Load(path, options))
+			scripts.push_back(thread);
+	threads = std::max(1u, std::min(threads, (u32)scripts.size()));
+	modules.shared = threads > 1;
+	std::vector<Worker> workers(threads, Worker(options, slice));
+	for (u32 i = 0; i < scripts.size(); i++)
+		workers[i % threads].queue.push_back(scripts[i]);
+	output.Flush();
+	std::cout.flush();
+	std::vector<std::thread> pool;
+	for (Worker& worker : workers)
+		pool.emplace_back(&Worker::Run, &worker);
+	for (std::thread& thread : pool)
+		thread.join();
+	ThreadPool::Drain();
+	return 0;
+}
+
+#else
+
+void Preempt() {
+	budget = INT64_MAX;
+}
+i32 Schedule(const std::vector<const char*>& paths, RunOptions options, u32 threads, i64 slice) {
+	GenericError("Running several scripts at once needs ucontext, which this platform doesn't have.");
+	return 1;
+}
+
+#endif
+
+#endif
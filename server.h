@@ -0,0 +1,510 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "util.h"
+#include "lexer.h"
+#include "parser.h"
+#include "types.h"
+#include "simplify.h"
+#include "closure.h"
+#include "modules.h"
+#include "pool.h"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#ifndef _WIN32
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+/*
+--serve <socket> keeps one process around that runs scripts sent to it over
+a Unix domain socket, and --client <socket> <script> is the other end.
+
+Request:  "RUN <path>\n" or "SRC <length>\n" followed by <length> bytes
+Response: "<exit status> <output length> <latency in us>\n" then the output
+
+Scripts are lexed, parsed and simplified once and cached, by path (checked
+against the file's mtime and size) or by source text. Each request runs in
+a forked child, so it starts from the server's clean state and can't affect
+the next one; the output comes back through a pipe.
+
+Up to MAX_CONNECTIONS requests are handled at once. Client sockets are
+non-blocking and polled along with the children's pipes, so neither a slow
+script nor a slow client holds up the others. A child that runs past the
+request timeout is killed, and a client gets CLIENT_TIMEOUT_S in total to
+send its request and again to take its response. Sources longer than
+MAX_SOURCE are refused before reading them.
+*/
+
+struct RunOptions {
+	bool use_closures = false;
+	bool simplify = true;
+	bool cse = false;
+	u32 timeout_ms = 30000; // Of a --serve request, 0 for none
+};
+
+#ifndef _WIN32
+
+// A cached program. Compile errors are kept as text and replayed as output.
+struct Program {
+	std::vector<Stmt*> statements;
+	std::string errors;
+	bool runnable = false;
+	time_t mtime = 0;
+	off_t size = 0;
+};
+
+class Server {
+public:
+	Server(const char* path, RunOptions options) : mPath(path), mOptions(options) {}
+	i32 Run() {
+		mSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+		sockaddr_un address = Address(mPath);
+		if (mSocket < 0 || strlen(mPath) >= sizeof(address.sun_path)) {
+			GenericError("Could not create socket: " + std::string(mPath));
+			return 1;
+		}
+		unlink(mPath);
+		if (bind(mSocket, (sockaddr*)&address, sizeof(address)) != 0 || listen(mSocket, 64) != 0) {
+			GenericError("Could not listen on socket: " + std::string(mPath));
+			return 1;
+		}
+		// Sized once here so children share its pages instead of each
+		// allocating and zeroing it on their first call
+		value_stack.resize(STACK_SIZE);
+		socket_path = mPath;
+		signal(SIGINT, Stop);
+		signal(SIGTERM, Stop);
+		signal(SIGPIPE, SIG_IGN);
+		fprintf(stderr, "serving on %s\n", mPath);
+		std::vector<pollfd> fds;
+		while (true) {
+			fds.clear();
+			if (mConnections.size() < MAX_CONNECTIONS)
+				fds.push_back({mSocket, POLLIN, 0});
+			for (Connection& conn : mConnections) {
+				if (conn.state == Connection::READING)
+					fds.push_back({conn.client, POLLIN, 0});
+				else if (conn.state == Connection::WRITING)
+					fds.push_back({conn.client, POLLOUT, 0});
+				else if (conn.output >= 0)
+					fds.push_back({conn.output, POLLIN, 0});
+			}
+			poll(fds.data(), fds.size(), WaitMs());
+			for (pollfd& fd : fds) {
+				if (!fd.revents) continue;
+				if (fd.fd == mSocket) {
+					i32 client = accept(mSocket, 0, 0);
+					if (client >= 0) Accept(client);
+				}
+				else
+					Ready(fd.fd);
+			}
+			Reap();
+		}
+	}
+	static sockaddr_un Address(const char* path) {
+		sockaddr_un address;
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+		return address;
+	}
+	static bool WriteAll(i32 fd, const std::string& data) {
+		size_t sent = 0;
+		while (sent < data.size()) {
+			ssize_t count = write(fd, data.data() + sent, data.size() - sent);
+			if (count <= 0) return false;
+			sent += count;
+		}
+		return true;
+	}
+private:
+	const char* mPath;
+	RunOptions mOptions;
+	i32 mSocket = -1;
+	std::unordered_map<std::string, Program> mByPath;
+	std::unordered_map<std::string, Program> mBySource;
+	static constexpr u32 MAX_CACHED = 256;
+	static constexpr u32 MAX_CONNECTIONS = 64;
+	static constexpr size_t MAX_SOURCE = 16 << 20; // Bytes of an SRC request
+	static constexpr size_t MAX_LINE = 8192; // Bytes of a request's first line
+	static constexpr u32 CLIENT_TIMEOUT_S = 5; // For reading a request, and again for writing its response
+
+	// A client, from reading its request through running its script (until
+	// the child has exited and all of its output is read) to writing the
+	// response
+	struct Connection {
+		enum State { READING, RUNNING, WRITING } state = READING;
+		i32 client;
+		std::string in; // The request as read so far
+		i32 output = -1; // Read end of the child's stdout, -1 once it's closed
+		pid_t pid = 0;
+		bool exited = false;
+		bool killed = false; // By the timeout
+		i32 status = 0;
+		std::string out; // The whole response once WRITING
+		size_t sent = 0;
+		std::string label;
+		bool cached = false;
+		std::chrono::steady_clock::time_point start;
+		std::chrono::steady_clock::time_point deadline; // For the client while READING or WRITING
+	};
+	std::vector<Connection> mConnections;
+
+	static const char* socket_path;
+	static void Stop(int) {
+		unlink(socket_path);
+		_exit(0);
+	}
+
+	void Compile(const std::string& source, const std::string& directory, Program& program) {
+		// Lexer and parser errors go to std::cout
+		std::ostringstream errors;
+		std::streambuf* prev = std::cout.rdbuf(errors.rdbuf());
+		Lexer lexer;
+		Parser parser;
+		parser.directory = directory;
+		if (!lexer.Lex(source))
+			parser.Parse(lexer.tokens);
+		std::cout.rdbuf(prev);
+		program.errors = errors.str();
+		program.runnable = !lexer.HadError() && !parser.HadError();
+		program.statements = parser.statements;
+		if (program.runnable) {
+			TypeInference().Run(program.statements);
+			if (mOptions.simplify)
+				Simplifier(mOptions.cse).Run(program.statements);
+			modules.Preload(program.statements);
+		}
+	}
+	static void Evict(std::unordered_map<std::string, Program>& cache) {
+		if (cache.size() < MAX_CACHED) return;
+		for (auto& entry : cache)
+			for (Stmt* stmt : entry.second.statements) {
+				stmt->Destroy();
+				delete stmt;
+			}
+		cache.clear();
+	}
+
+	// Returns 0 with 'error' set if the file can't be read
+	Program* Lookup(const std::string& path, bool& cached, std::string& error) {
+		struct stat info;
+		if (stat(path.c_str(), &info) != 0) {
+			error = "Error: Could not open file: " + path + "\n";
+			return 0;
+		}
+		auto iter = mByPath.find(path);
+		if (iter != mByPath.end() &&
+			iter->second.mtime == info.st_mtime && iter->second.size == info.st_size) {
+			cached = true;
+			return &iter->second;
+		}
+		std::ifstream file(path);
+		if (!file.is_open()) {
+			error = "Error: Could not open file: " + path + "\n";
+			return 0;
+		}
+		std::string source, line;
+		while (std::getline(file, line))
+			source += line + "\n";
+		if (iter != mByPath.end()) {
+			for (Stmt* stmt : iter->second.statements) {
+				stmt->Destroy();
+				delete stmt;
+			}
+			mByPath.erase(iter);
+		}
+		Evict(mByPath);
+		Program& program = mByPath[path];
+		program.mtime = info.st_mtime;
+		program.size = info.st_size;
+		Compile(source, DirectoryOf(path), program);
+		return &program;
+	}
+	Program* LookupSource(const std::string& source, bool& cached) {
+		auto iter = mBySource.find(source);
+		if (iter != mBySource.end()) {
+			cached = true;
+			return &iter->second;
+		}
+		Evict(mBySource);
+		Program& program = mBySource[source];
+		Compile(source, "", program); // Imports are relative to the server's directory
+		return &program;
+	}
+
+	// Starts 'program' in a child, which prints into the pipe 'pipe_out'
+	// reads. Returns the child's pid, or 0 with 'error' set.
+	pid_t Launch(Program* program, i32& pipe_out, std::string& error) {
+		i32 fds[2];
+		if (pipe(fds) != 0) {
+			error = "Error: Could not create pipe.\n";
+			return 0;
+		}
+		pid_t pid = fork();
+		if (pid == 0) {
+			close(fds[0]);
+			close(mSocket);
+			for (Connection& conn : mConnections) {
+				close(conn.client);
+				if (conn.output >= 0) close(conn.output);
+			}
+			dup2(fds[1], STDOUT_FILENO);
+			close(fds[1]);
+			std::cout << program->errors;
+			if (program->runnable) {
+				ClosureCompiler compiler;
+				if (mOptions.use_closures && compiler.Compile(program->statements))
+					compiler.Run();
+				else
+					for (Stmt* stmt : program->statements)
+						stmt->Evaluate();
+			}
+			ThreadPool::Drain();
+			output.Flush();
+			std::cout.flush();
+			_exit(0);
+		}
+		close(fds[1]);
+		if (pid < 0) {
+			close(fds[0]);
+			error = "Error: Could not start the script.\n";
+			return 0;
+		}
+		pipe_out = fds[0];
+		return pid;
+	}
+	void Accept(i32 client) {
+		fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+		Connection conn;
+		conn.client = client;
+		conn.start = std::chrono::steady_clock::now();
+		conn.deadline = conn.start + std::chrono::seconds(CLIENT_TIMEOUT_S);
+		mConnections.push_back(std::move(conn));
+	}
+	// Handles poll() reporting 'fd' ready, which is a client socket or a
+	// child's pipe
+	void Ready(i32 fd) {
+		for (u32 i = 0; i < mConnections.size(); i++) {
+			Connection& conn = mConnections[i];
+			if (conn.output == fd) {
+				ReadOutput(conn);
+				return;
+			}
+			if (conn.client != fd || conn.state == Connection::RUNNING) continue;
+			if (conn.state == Connection::READING ? !ReadRequest(conn) : !WriteResponse(conn)) {
+				close(conn.client);
+				mConnections.erase(mConnections.begin() + i);
+			}
+			return;
+		}
+	}
+	static bool Blocked() {
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+	}
+	void ReadOutput(Connection& conn) {
+		char buffer[1 << 16];
+		ssize_t count = read(conn.output, buffer, sizeof(buffer));
+		if (count > 0)
+			conn.out.append(buffer, count);
+		else if (count == 0 || !Blocked()) {
+			close(conn.output);
+			conn.output = -1;
+		}
+	}
+	// Reads what the client has sent and starts the script once the request
+	// is complete, or answers it right away if it can't run. Returns false if
+	// the client has gone.
+	bool ReadRequest(Connection& conn) {
+		char buffer[1 << 16];
+		ssize_t count = read(conn.client, buffer, sizeof(buffer));
+		if (count < 0) return Blocked();
+		if (count == 0) return false;
+		conn.in.append(buffer, count);
+		size_t end = conn.in.find('\n');
+		if (end == std::string::npos) {
+			if (conn.in.size() > MAX_LINE) {
+				conn.out = "Error: Bad request.\n";
+				Reply(conn, 1);
+			}
+			return true;
+		}
+		std::string request = conn.in.substr(0, end);
+		Program* program = 0;
+		if (request.compare(0, 4, "RUN ") == 0) {
+			conn.label = request.substr(4);
+			program = Lookup(conn.label, conn.cached, conn.out);
+		}
+		else if (request.compare(0, 4, "SRC ") == 0) {
+			conn.label = "<source>";
+			size_t length = strtoull(request.c_str() + 4, 0, 10);
+			if (length > MAX_SOURCE)
+				conn.out = "Error: The source is longer than " + std::to_string(MAX_SOURCE) + " bytes.\n";
+			else if (conn.in.size() - end - 1 < length)
+				return true;
+			else
+				program = LookupSource(conn.in.substr(end + 1, length), conn.cached);
+		}
+		else
+			conn.out = "Error: Bad request.\n";
+		std::string().swap(conn.in);
+		conn.pid = program ? Launch(program, conn.output, conn.out) : 0;
+		if (conn.pid)
+			conn.state = Connection::RUNNING;
+		else
+			Reply(conn, 1);
+		return true;
+	}
+	// Returns false once the response is sent or the client has gone
+	static bool WriteResponse(Connection& conn) {
+		ssize_t count = write(conn.client, conn.out.data() + conn.sent, conn.out.size() - conn.sent);
+		if (count < 0) return Blocked();
+		conn.sent += count;
+		return conn.sent < conn.out.size();
+	}
+	// Puts the header in front of the output and starts writing them out
+	static void Reply(Connection& conn, i32 status) {
+		auto now = std::chrono::steady_clock::now();
+		u64 latency = std::chrono::duration_cast<std::chrono::microseconds>(now - conn.start).count();
+		conn.out = std::to_string(status) + " " + std::to_string(conn.out.size()) + " " + std::to_string(latency) + "\n" + conn.out;
+		conn.state = Connection::WRITING;
+		conn.deadline = now + std::chrono::seconds(CLIENT_TIMEOUT_S);
+		fprintf(stderr, "%s: status %d, %.3f ms%s\n", conn.label.c_str(), status, latency / 1e3, conn.cached ? ", cached" : "");
+	}
+	// Collects children that have exited, kills the ones past the timeout,
+	// answers the requests that are done and drops clients past their deadline
+	void Reap() {
+		auto now = std::chrono::steady_clock::now();
+		for (u32 i = 0; i < mConnections.size();) {
+			Connection& conn = mConnections[i];
+			if (conn.state != Connection::RUNNING) {
+				if (now >= conn.deadline) {
+					close(conn.client);
+					mConnections.erase(mConnections.begin() + i);
+				}
+				else
+					i++;
+				continue;
+			}
+			int status = 0;
+			if (!conn.exited && waitpid(conn.pid, &status, WNOHANG) == conn.pid) {
+				conn.exited = true;
+				conn.status = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+			}
+			if (!conn.exited && !conn.killed && mOptions.timeout_ms && now - conn.start >= std::chrono::milliseconds(mOptions.timeout_ms)) {
+				kill(conn.pid, SIGKILL);
+				conn.killed = true;
+			}
+			if (conn.exited && conn.output < 0) {
+				if (conn.killed)
+					conn.out += "Error: The script was stopped after " + std::to_string(mOptions.timeout_ms) + " ms.\n";
+				Reply(conn, conn.status);
+			}
+			i++;
+		}
+	}
+	// How long poll() may wait before Reap() has something to do
+	int WaitMs() {
+		if (mConnections.empty()) return -1;
+		auto now = std::chrono::steady_clock::now();
+		i64 wait = 1000;
+		for (Connection& conn : mConnections) {
+			std::chrono::steady_clock::time_point until = conn.deadline;
+			if (conn.state == Connection::RUNNING) {
+				if (conn.output < 0 || conn.killed)
+					return 1; // Output done, waiting for the exit
+				if (!mOptions.timeout_ms) continue;
+				until = conn.start + std::chrono::milliseconds(mOptions.timeout_ms);
+			}
+			i64 left = std::chrono::duration_cast<std::chrono::milliseconds>(until - now).count() + 1;
+			wait = std::min(wait, std::max<i64>(left, 0));
+		}
+		return wait;
+	}
+
+};
+const char* Server::socket_path = 0;
+
+i32 Serve(const char* path, RunOptions options) {
+	Server server(path, options);
+	return server.Run();
+}
+
+// Sends 'script' to the server at 'path' (a file path, or "-" for source on
+// stdin), prints its output and returns its exit status
+i32 Client(const char* path, const char* script, bool print_latency) {
+	std::string request;
+	if (std::string(script) == "-") {
+		std::ostringstream source;
+		source << std::cin.rdbuf();
+		request = "SRC " + std::to_string(source.str().size()) + "\n" + source.str();
+	}
+	else {
+		char* full = realpath(script, 0);
+		request = "RUN " + std::string(full ? full : script) + "\n";
+		free(full);
+	}
+	auto start = std::chrono::steady_clock::now();
+	i32 fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	sockaddr_un address = Server::Address(path);
+	if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) != 0) {
+		GenericError("Could not connect to " + std::string(path));
+		return 1;
+	}
+	Server::WriteAll(fd, request);
+	std::string header, data;
+	char c;
+	while (read(fd, &c, 1) == 1 && c != '\n')
+		header += c;
+	int status = 1;
+	unsigned long long length = 0, latency = 0;
+	if (sscanf(header.c_str(), "%d %llu %llu", &status, &length, &latency) != 3) {
+		GenericError("Bad response from " + std::string(path));
+		close(fd);
+		return 1;
+	}
+	data.resize(length);
+	size_t got = 0;
+	while (got < length) {
+		ssize_t count = read(fd, &data[got], length - got);
+		if (count <= 0) break;
+		got += count;
+	}
+	close(fd);
+	fwrite(data.data(), 1, got, stdout);
+	fflush(stdout);
+	if (print_latency) {
+		u64 total = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+		fprintf(stderr, "%-16s %12.3f ms\n", "server", latency / 1e3);
+		fprintf(stderr, "%-16s %12.3f ms\n", "round trip", total / 1e3);
+	}
+	return status;
+}
+
+#else
+
+i32 Serve(const char* path, RunOptions options) {
+	GenericError("--serve needs Unix domain sockets, which this platform doesn't have.");
+	return 1;
+}
+i32 Client(const char* path, const char* script, bool print_latency) {
+	GenericError("--client needs Unix domain sockets, which this platform doesn't have.");
+	return 1;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,444 @@
+#ifndef SIMPLIFY_H
+#define SIMPLIFY_H
+
+#include "util.h"
+#include "AST.h"
+#include "analysis.h"
+#include "interpreter.h"
+#include <cfloat>
+#include <unordered_set>
+
+/*
+AST rewriting after type inference. Every rewrite gives bit-for-bit the same
+result and the same errors as the original, so it only touches operators
+whose operands are proven numbers:
+- constant operands are folded
+- x * 1, 1 * x, x / 1 and x - 0 become x (x + 0 doesn't, since -0 + 0 is 0)
+- x ** n for a small integer n multiplies out (see Power)
+- x / c becomes x * (1 / c) when c is a power of two, where both round the same
+- x % c uses a mask when c is a power of two
+- groups are dropped
+
+With 'cse' set, repeated subexpressions of an expression that makes no calls
+and assigns nothing are evaluated once (see CseDefExpr).
+*/
+
+class Simplifier {
+public:
+	Simplifier(bool cse) : mCse(cse) {}
+	void Run(const std::vector<Stmt*>& statements) {
+		for (Stmt* stmt : statements)
+			SimplifyStmt(stmt);
+	}
+private:
+	bool mCse;
+
+	static void Free(Expr* expr) {
+		expr->Destroy();
+		delete expr;
+	}
+	static bool IsNumber(Expr* expr) {
+		return expr->value_type == TYPE_NUMBER;
+	}
+	static bool IsConstant(Expr* expr, float value) {
+		if (expr->Type() != NodeType::LITERAL_EXPR || ((LiteralExpr*)expr)->value.index() != TYPE_NUMBER)
+			return false;
+		float constant = std::get<TYPE_NUMBER>(((LiteralExpr*)expr)->value);
+		return constant == value && !std::signbit(constant);
+	}
+	static bool NumberLiteral(Expr* expr, float& value) {
+		if (expr->Type() != NodeType::LITERAL_EXPR || ((LiteralExpr*)expr)->value.index() != TYPE_NUMBER)
+			return false;
+		value = std::get<TYPE_NUMBER>(((LiteralExpr*)expr)->value);
+		return true;
+	}
+	static bool IsPowerOfTwo(float value) {
+		int exponent;
+		return std::isfinite(value) && value != 0 && std::fabs(std::frexp(value, &exponent)) == 0.5f;
+	}
+	static Expr* Literal(Object value) {
+		LiteralExpr* literal = new LiteralExpr(value);
+		literal->value_type = (i8)value.index();
+		return literal;
+	}
+
+	Expr* Replace(Expr* old, Expr* replacement) {
+		Free(old);
+		return replacement;
+	}
+	// Takes a child out of its parent, so the parent can be freed alone
+	Expr* Detach(Expr*& child) {
+		Expr* result = child;
+		child = 0;
+		return result;
+	}
+
+	Expr* SimplifyBinary(BinaryExpr* e) {
+		e->left = SimplifyExpr(e->left);
+		e->right = SimplifyExpr(e->right);
+		Expr* l = e->left;
+		Expr* r = e->right;
+		bool literals = l->Type() == NodeType::LITERAL_EXPR && r->Type() == NodeType::LITERAL_EXPR;
+		i8 lt = l->value_type, rt = r->value_type;
+		switch (e->op.type) {
+		case TokenType::EQUAL_EQUAL:
+		case TokenType::BANG_EQUAL:
+			if (literals) return Replace(e, Literal(e->Evaluate()));
+			return e;
+		case TokenType::PLUS:
+			if (literals && lt == rt && (lt == TYPE_NUMBER || lt == TYPE_STRING))
+				return Replace(e, Literal(e->Evaluate()));
+			return e;
+		default:
+			break;
+		}
+		if (!IsNumber(l) || !IsNumber(r)) return e;
+		float constant;
+		if (literals) {
+			// '%' by zero traps, so it's left for the program to reach
+			if (e->op.type == TokenType::MODULO && NumberLiteral(r, constant) && (i32)std::floor(constant) == 0)
+				return e;
+			return Replace(e, Literal(e->Evaluate()));
+		}
+		switch (e->op.type) {
+		case TokenType::STAR:
+			if (IsConstant(r, 1)) return Replace(e, Detach(e->left));
+			if (IsConstant(l, 1)) return Replace(e, Detach(e->right));
+			break;
+		case TokenType::SLASH:
+			if (IsConstant(r, 1)) return Replace(e, Detach(e->left));
+			if (NumberLiteral(r, constant) && IsPowerOfTwo(constant)) {
+				float inverse = 1 / constant;
+				if (std::isfinite(inverse) && std::fabs(inverse) >= FLT_MIN)
+					return Reduce(e, ReducedExpr::SCALE, inverse);
+			}
+			break;
+		case TokenType::MINUS:
+			if (IsConstant(r, 0)) return Replace(e, Detach(e->left));
+			break;
+		case TokenType::STAR_STAR:
+			if (NumberLiteral(r, constant) && constant >= 2 && constant <= MAX_INT_POWER && constant == (i32)constant)
+				return Reduce(e, ReducedExpr::POWER, constant);
+			break;
+		case TokenType::MODULO:
+			if (NumberLiteral(r, constant) && constant >= 1 && constant <= (1 << 30) && IsPowerOfTwo(constant))
+				return Reduce(e, ReducedExpr::MASK, constant);
+			break;
+		default:
+			break;
+		}
+		return e;
+	}
+	Expr* Reduce(BinaryExpr* e, ReducedExpr::Kind kind, float constant) {
+		ReducedExpr* reduced = new ReducedExpr(kind, Detach(e->left), constant);
+		reduced->value_type = TYPE_NUMBER;
+		return Replace(e, reduced);
+	}
+
+	Expr* SimplifyExpr(Expr* expr) {
+		if (!expr) return expr;
+		switch (expr->Type()) {
+		case NodeType::ASSIGN_EXPR:
+			((AssignExpr*)expr)->expr = SimplifyExpr(((AssignExpr*)expr)->expr);
+			return expr;
+		case NodeType::IF_EXPR: {
+			IfExpr* e = (IfExpr*)expr;
+			e->condition = SimplifyExpr(e->condition);
+			e->then_branch = SimplifyExpr(e->then_branch);
+			e->else_branch = SimplifyExpr(e->else_branch);
+			return expr;
+		}
+		case NodeType::LOGIC_EXPR:
+			((LogicExpr*)expr)->left = SimplifyExpr(((LogicExpr*)expr)->left);
+			((LogicExpr*)expr)->right = SimplifyExpr(((LogicExpr*)expr)->right);
+			return expr;
+		case NodeType::BINARY_EXPR:
+			return SimplifyBinary((BinaryExpr*)expr);
+		case NodeType::GROUP_EXPR: {
+			GroupExpr* e = (GroupExpr*)expr;
+			return Replace(e, SimplifyExpr(Detach(e->expr)));
+		}
+		case NodeType::UNARY_EXPR: {
+			UnaryExpr* e = (UnaryExpr*)expr;
+			e->expr = SimplifyExpr(e->expr);
+			if (e->expr->Type() != NodeType::LITERAL_EXPR) return expr;
+			if (e->op.type == TokenType::BANG || (e->op.type == TokenType::MINUS && IsNumber(e->expr)))
+				return Replace(e, Literal(e->Evaluate()));
+			return expr;
+		}
+		case NodeType::CALL_EXPR: {
+			CallExpr* e = (CallExpr*)expr;
+			e->callee = SimplifyExpr(e->callee);
+			for (Expr*& arg : e->arguments)
+				arg = SimplifyExpr(arg);
+			return expr;
+		}
+		case NodeType::MAP_EXPR: {
+			MapExpr* e = (MapExpr*)expr;
+			for (u32 i = 0; i < e->keys.size(); i++) {
+				e->keys[i] = SimplifyExpr(e->keys[i]);
+				e->values[i] = SimplifyExpr(e->values[i]);
+			}
+			return expr;
+		}
+		case NodeType::SPAWN_EXPR: {
+			SpawnExpr* e = (SpawnExpr*)expr;
+			if (e->call)
+				SimplifyExpr(e->call);
+			else
+				SimplifyStmt(e->block);
+			return expr;
+		}
+		default:
+			return expr;
+		}
+	}
+
+	// Simplifies a whole expression of a statement, then shares its repeats
+	Expr* SimplifyRoot(Expr* expr) {
+		expr = SimplifyExpr(expr);
+		if (mCse && expr) expr = EliminateCommon(expr);
+		return expr;
+	}
+
+	void SimplifyStmt(Stmt* stmt) {
+		switch (stmt->Type()) {
+		case NodeType::PRINT_STMT:
+			((PrintStmt*)stmt)->expr = SimplifyRoot(((PrintStmt*)stmt)->expr);
+			break;
+		case NodeType::BLOCK_STMT:
+			for (Stmt* s : ((BlockStmt*)stmt)->statements)
+				SimplifyStmt(s);
+			break;
+		case NodeType::EXPR_STMT:
+			((ExprStmt*)stmt)->expr = SimplifyRoot(((ExprStmt*)stmt)->expr);
+			break;
+		case NodeType::VAR_DECL_STMT:
+			((VarDeclStmt*)stmt)->expr = SimplifyRoot(((VarDeclStmt*)stmt)->expr);
+			break;
+		case NodeType::IF_STMT: {
+			IfStmt* s = (IfStmt*)stmt;
+			s->condition = SimplifyRoot(s->condition);
+			SimplifyStmt(s->then_branch);
+			if (s->else_branch) SimplifyStmt(s->else_branch);
+			break;
+		}
+		case NodeType::WHILE_STMT:
+			((WhileStmt*)stmt)->condition = SimplifyRoot(((WhileStmt*)stmt)->condition);
+			SimplifyStmt(((WhileStmt*)stmt)->statement);
+			break;
+		case NodeType::FOR_STMT: {
+			ForStmt* s = (ForStmt*)stmt;
+			if (s->initializer) SimplifyStmt(s->initializer);
+			s->condition = SimplifyRoot(s->condition);
+			s->increment = SimplifyRoot(s->increment);
+			SimplifyStmt(s->body);
+			// Groups may be gone from the condition, and a folded limit can
+			// make the loop countable
+			s->counted = false;
+			DetectCountedLoop(s);
+			break;
+		}
+		case NodeType::RANGE_FOR_STMT: {
+			RangeForStmt* s = (RangeForStmt*)stmt;
+			s->start = SimplifyRoot(s->start);
+			s->end = SimplifyRoot(s->end);
+			s->step = SimplifyRoot(s->step);
+			SimplifyStmt(s->body);
+			break;
+		}
+		case NodeType::FOR_IN_STMT: {
+			ForInStmt* s = (ForInStmt*)stmt;
+			s->collection = SimplifyRoot(s->collection);
+			SimplifyStmt(s->body);
+			break;
+		}
+		case NodeType::FN_DECL_STMT:
+			for (Stmt* s : ((FnDeclStmt*)stmt)->function->body)
+				SimplifyStmt(s);
+			break;
+		case NodeType::RETURN_STMT: {
+			ReturnStmt* s = (ReturnStmt*)stmt;
+			// A tail call's CallExpr has to stay where it is
+			if (s->tail) SimplifyExpr(s->value);
+			else s->value = SimplifyRoot(s->value);
+			break;
+		}
+		default:
+			break;
+		}
+	}
+
+	// Common subexpressions. Keys identify structurally equal expressions;
+	// an empty key means the node can't be shared.
+	std::unordered_map<Expr*, std::string> mKeys;
+	std::unordered_map<std::string, u32> mCounts;
+	std::unordered_map<std::string, u32> mTemps;
+	std::unordered_set<std::string> mUsed;
+	std::vector<CseDefExpr*> mDefs;
+
+	static bool IsPure(Expr* expr) {
+		if (!expr) return true;
+		switch (expr->Type()) {
+		case NodeType::IF_EXPR:
+			return IsPure(((IfExpr*)expr)->condition) && IsPure(((IfExpr*)expr)->then_branch) && IsPure(((IfExpr*)expr)->else_branch);
+		case NodeType::LOGIC_EXPR:
+			return IsPure(((LogicExpr*)expr)->left) && IsPure(((LogicExpr*)expr)->right);
+		case NodeType::BINARY_EXPR:
+			return IsPure(((BinaryExpr*)expr)->left) && IsPure(((BinaryExpr*)expr)->right);
+		case NodeType::UNARY_EXPR:
+			return ((UnaryExpr*)expr)->op.type != TokenType::PLUS_PLUS && IsPure(((UnaryExpr*)expr)->expr);
+		case NodeType::REDUCED_EXPR:
+			return IsPure(((ReducedExpr*)expr)->expr);
+		case NodeType::VAR_EXPR:
+		case NodeType::LITERAL_EXPR:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	// Computes the key of every node that is evaluated unconditionally,
+	// which excludes both sides of '?:' and the right side of 'and'/'or'
+	std::string Key(Expr* expr) {
+		std::string key;
+		switch (expr->Type()) {
+		case NodeType::BINARY_EXPR: {
+			BinaryExpr* e = (BinaryExpr*)expr;
+			std::string l = Key(e->left), r = Key(e->right);
+			if (!l.empty() && !r.empty())
+				key = "(" + e->op.lexeme + " " + l + " " + r + ")";
+			break;
+		}
+		case NodeType::UNARY_EXPR: {
+			UnaryExpr* e = (UnaryExpr*)expr;
+			std::string operand = Key(e->expr);
+			if (!operand.empty() && e->op.type != TokenType::PLUS_PLUS)
+				key = "(" + e->op.lexeme + " " + operand + ")";
+			break;
+		}
+		case NodeType::REDUCED_EXPR: {
+			ReducedExpr* e = (ReducedExpr*)expr;
+			std::string operand = Key(e->expr);
+			if (!operand.empty())
+				key = "(" + std::to_string(e->kind) + " " + operand + " " + NumberToStr(e->constant) + ")";
+			break;
+		}
+		case NodeType::LOGIC_EXPR:
+			Key(((LogicExpr*)expr)->left);
+			break;
+		case NodeType::IF_EXPR:
+			Key(((IfExpr*)expr)->condition);
+			break;
+		case NodeType::VAR_EXPR:
+			return "$" + ((VarExpr*)expr)->identifier.lexeme;
+		case NodeType::LITERAL_EXPR: {
+			const Object& value = ((LiteralExpr*)expr)->value;
+			return value.index() == TYPE_STRING ? "\"" + ObjStr(value) + "\"" : ObjToStr(value);
+		}
+		default:
+			break;
+		}
+		if (!key.empty()) {
+			mKeys[expr] = key;
+			mCounts[key]++;
+		}
+		return key;
+	}
+
+	// Walks the same nodes in evaluation order. The first occurrence of a
+	// repeated key becomes its definition; the ones after it become uses.
+	// Nothing inside a shared node is visited, so uses never overlap a
+	// definition and always run after it.
+	Expr* Share(Expr* expr) {
+		auto key = mKeys.find(expr);
+		if (key != mKeys.end() && mCounts[key->second] > 1) {
+			auto temp = mTemps.find(key->second);
+			if (temp != mTemps.end()) {
+				mUsed.insert(key->second);
+				CseUseExpr* use = new CseUseExpr(temp->second);
+				use->value_type = expr->value_type;
+				return Replace(expr, use);
+			}
+			if (mTemps.size() < MAX_CSE_TEMPS) {
+				u32 index = mTemps.size();
+				mTemps[key->second] = index;
+				CseDefExpr* def = new CseDefExpr(expr, index);
+				def->value_type = expr->value_type;
+				mDefs.push_back(def);
+				return def;
+			}
+		}
+		switch (expr->Type()) {
+		case NodeType::BINARY_EXPR:
+			((BinaryExpr*)expr)->left = Share(((BinaryExpr*)expr)->left);
+			((BinaryExpr*)expr)->right = Share(((BinaryExpr*)expr)->right);
+			break;
+		case NodeType::UNARY_EXPR:
+			((UnaryExpr*)expr)->expr = Share(((UnaryExpr*)expr)->expr);
+			break;
+		case NodeType::REDUCED_EXPR:
+			((ReducedExpr*)expr)->expr = Share(((ReducedExpr*)expr)->expr);
+			break;
+		case NodeType::LOGIC_EXPR:
+			((LogicExpr*)expr)->left = Share(((LogicExpr*)expr)->left);
+			break;
+		case NodeType::IF_EXPR:
+			((IfExpr*)expr)->condition = Share(((IfExpr*)expr)->condition);
+			break;
+		default:
+			break;
+		}
+		return expr;
+	}
+
+	// A definition whose uses were all inside another shared node is
+	// unwrapped again
+	Expr* Unwrap(Expr* expr) {
+		if (!expr) return expr;
+		switch (expr->Type()) {
+		case NodeType::CSE_DEF_EXPR: {
+			CseDefExpr* def = (CseDefExpr*)expr;
+			def->expr = Unwrap(def->expr);
+			if (!mUsed.count(mKeys[def->expr]))
+				return Replace(def, Detach(def->expr));
+			return expr;
+		}
+		case NodeType::BINARY_EXPR:
+			((BinaryExpr*)expr)->left = Unwrap(((BinaryExpr*)expr)->left);
+			((BinaryExpr*)expr)->right = Unwrap(((BinaryExpr*)expr)->right);
+			break;
+		case NodeType::UNARY_EXPR:
+			((UnaryExpr*)expr)->expr = Unwrap(((UnaryExpr*)expr)->expr);
+			break;
+		case NodeType::REDUCED_EXPR:
+			((ReducedExpr*)expr)->expr = Unwrap(((ReducedExpr*)expr)->expr);
+			break;
+		case NodeType::LOGIC_EXPR:
+			((LogicExpr*)expr)->left = Unwrap(((LogicExpr*)expr)->left);
+			break;
+		case NodeType::IF_EXPR:
+			((IfExpr*)expr)->condition = Unwrap(((IfExpr*)expr)->condition);
+			break;
+		default:
+			break;
+		}
+		return expr;
+	}
+
+	Expr* EliminateCommon(Expr* expr) {
+		if (!IsPure(expr)) return expr;
+		mKeys.clear();
+		mCounts.clear();
+		mTemps.clear();
+		mUsed.clear();
+		mDefs.clear();
+		Key(expr);
+		expr = Share(expr);
+		if (!mDefs.empty())
+			expr = Unwrap(expr);
+		return expr;
+	}
+};
+
+#endif
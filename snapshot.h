@@ -0,0 +1,839 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "util.h"
+#include "AST.h"
+#include "analysis.h"
+#include "interpreter.h"
+#include "map.h"
+#include "builtins.h"
+#include "types.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+--snapshot <file> saves the program when it reaches 'snapshot;': the
+globals, every value they reach and the top-level statements still to run.
+--restore <file> maps that file and carries on from the same point, without
+lexing, parsing or running what came before it.
+
+Syntax trees are saved as simplified, so they aren't parsed or simplified
+again. Their types are inferred again on loading, starting from the types
+of the restored globals, since the engines trust them without checks. Values are written where they're first reached
+and by number after that, so shared and self-containing maps come back the
+same. Tasks, channels and files can't be saved.
+
+A snapshot stores things as this build lays them out, and is only loaded by
+the build that wrote it.
+*/
+
+const char SNAPSHOT_MAGIC[8] = {'B', 'O', 'M', 'A', 'C', 'S', 'N', 'P'};
+const u32 SNAPSHOT_FORMAT = 4;
+const std::string BUILD_ID = std::string(__DATE__ " " __TIME__ " object ") + std::to_string(sizeof(Object));
+const u8 NO_NODE = 0xFF;
+const u8 SEEN_OBJECT = 0xFF; // In place of a type: a value written before, by number
+
+// Set by main for --snapshot: the file, and the program whose statements
+// after 'snapshot;' are saved
+const char* snapshot_path = 0;
+const std::vector<Stmt*>* snapshot_program = 0;
+
+class SnapshotWriter {
+public:
+	std::string data;
+	// Returns false with 'error' set if something reachable can't be saved
+	bool Program(Environment* env, const std::vector<Stmt*>& rest, std::string& error) {
+		data.append(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+		U32(SNAPSHOT_FORMAT);
+		Str(BUILD_ID);
+		U32(env->values.size());
+		for (auto& entry : env->values) {
+			Str(entry.first);
+			Value(entry.second);
+		}
+		U32(env->imported.size());
+		for (const std::string& path : env->imported)
+			Str(path);
+		U32(rest.size());
+		for (Stmt* stmt : rest)
+			Node(stmt);
+		error = mError;
+		return mError.empty();
+	}
+private:
+	std::unordered_map<HeapObject*, u32> mIds;
+	std::string mError;
+
+	template <typename T>
+	void Raw(T value) {
+		data.append((const char*)&value, sizeof(value));
+	}
+	void U8(u8 value) { Raw(value); }
+	void U16(u16 value) { Raw(value); }
+	void U32(u32 value) { Raw(value); }
+	void F32(float value) { Raw(value); }
+	void Str(const std::string& value) {
+		U32(value.size());
+		data += value;
+	}
+	void Tok(const Token& token) {
+		U8((u8)token.type);
+		Str(token.lexeme);
+		U16(token.line);
+		U32(token.offset);
+	}
+	// Writes the number of an object seen before, or numbers it and returns false
+	bool Seen(HeapObject* object) {
+		auto iter = mIds.find(object);
+		if (iter != mIds.end()) {
+			U8(SEEN_OBJECT);
+			U32(iter->second);
+			return true;
+		}
+		u32 id = mIds.size();
+		mIds[object] = id;
+		return false;
+	}
+	void Value(const Object& obj) {
+		switch (obj.index()) {
+		case TYPE_BOOLEAN:
+			U8(TYPE_BOOLEAN);
+			U8(std::get<TYPE_BOOLEAN>(obj));
+			break;
+		case TYPE_NUMBER:
+			U8(TYPE_NUMBER);
+			F32(std::get<TYPE_NUMBER>(obj));
+			break;
+		case TYPE_STRING:
+			if (Seen(std::get<TYPE_STRING>(obj).Get())) break;
+			U8(TYPE_STRING);
+			Str(ObjStr(obj));
+			break;
+		case TYPE_FUNCTION: {
+			Function* fn = std::get<TYPE_FUNCTION>(obj).Get();
+			if (Seen(fn)) break;
+			U8(TYPE_FUNCTION);
+			Str(fn->name);
+			U8(fn->native != 0);
+			if (fn->native) break; // Found again by name
+			U32(fn->params.size());
+			for (const std::string& param : fn->params)
+				Str(param);
+			U32(fn->frame_size);
+			U8(fn->memo != 0); // Its results so far aren't kept
+			U32(fn->body.size());
+			for (Stmt* stmt : fn->body)
+				Node(stmt);
+			break;
+		}
+		case TYPE_MAP: {
+			MapObj* map = std::get<TYPE_MAP>(obj).Get();
+			if (Seen(map)) break;
+			U8(TYPE_MAP);
+			std::vector<Object> entries; // Copied out, since writing a value may lock another map
+			{
+				MapGuard guard(map);
+				for (const MapObj::Entry& entry : map->Entries())
+					if (!entry.removed) {
+						entries.push_back(entry.key);
+						entries.push_back(entry.value);
+					}
+			}
+			U32(entries.size() / 2);
+			for (const Object& item : entries)
+				Value(item);
+			break;
+		}
+		default:
+			if (mError.empty())
+				mError = "A snapshot can't hold a " + std::string(TypeName(obj.index())) + ".";
+			U8(TYPE_BOOLEAN); // Keeps the rest readable, though it won't be used
+			U8(0);
+		}
+	}
+	void Node(Stmt* stmt) {
+		if (!stmt) {
+			U8(NO_NODE);
+			return;
+		}
+		U8((u8)stmt->Type());
+		switch (stmt->Type()) {
+		case NodeType::PRINT_STMT:
+			Node(((PrintStmt*)stmt)->expr);
+			break;
+		case NodeType::BLOCK_STMT: {
+			BlockStmt* s = (BlockStmt*)stmt;
+			U8(s->scoped);
+			U32(s->statements.size());
+			for (Stmt* child : s->statements)
+				Node(child);
+			break;
+		}
+		case NodeType::EXPR_STMT:
+			Node(((ExprStmt*)stmt)->expr);
+			break;
+		case NodeType::VAR_DECL_STMT: {
+			VarDeclStmt* s = (VarDeclStmt*)stmt;
+			Tok(s->identifier);
+			Node(s->expr);
+			U32(s->slot);
+			break;
+		}
+		case NodeType::IF_STMT: {
+			IfStmt* s = (IfStmt*)stmt;
+			Node(s->condition);
+			Node(s->then_branch);
+			Node(s->else_branch);
+			break;
+		}
+		case NodeType::WHILE_STMT:
+			Node(((WhileStmt*)stmt)->condition);
+			Node(((WhileStmt*)stmt)->statement);
+			break;
+		case NodeType::FOR_STMT: {
+			ForStmt* s = (ForStmt*)stmt;
+			Node(s->initializer);
+			Node(s->condition);
+			Node(s->increment);
+			Node(s->body);
+			U8(s->scoped);
+			break;
+		}
+		case NodeType::RANGE_FOR_STMT: {
+			RangeForStmt* s = (RangeForStmt*)stmt;
+			Tok(s->identifier);
+			Node(s->start);
+			Node(s->end);
+			Node(s->step);
+			Node(s->body);
+			U32(s->slot);
+			U8(s->parallel);
+			U32(s->reductions.size());
+			for (const Reduction& r : s->reductions) {
+				U8(r.op);
+				Tok(r.name);
+			}
+			break;
+		}
+		case NodeType::FOR_IN_STMT: {
+			ForInStmt* s = (ForInStmt*)stmt;
+			Tok(s->identifier);
+			Node(s->collection);
+			Node(s->body);
+			U32(s->slot);
+			break;
+		}
+		case NodeType::FN_DECL_STMT: {
+			FnDeclStmt* s = (FnDeclStmt*)stmt;
+			Tok(s->name);
+			Value(s->function);
+			U32(s->slot);
+			break;
+		}
+		case NodeType::RETURN_STMT: {
+			ReturnStmt* s = (ReturnStmt*)stmt;
+			Tok(s->keyword);
+			Node(s->value);
+			U8(s->tail);
+			break;
+		}
+		case NodeType::IMPORT_STMT: {
+			ImportStmt* s = (ImportStmt*)stmt;
+			Tok(s->keyword);
+			Str(s->name);
+			Str(s->path);
+			break;
+		}
+		case NodeType::SNAPSHOT_STMT:
+			Tok(((SnapshotStmt*)stmt)->keyword);
+			break;
+		default: // break and continue
+			break;
+		}
+	}
+	void Node(Expr* expr) {
+		if (!expr) {
+			U8(NO_NODE);
+			return;
+		}
+		U8((u8)expr->Type());
+		switch (expr->Type()) {
+		case NodeType::ASSIGN_EXPR: {
+			AssignExpr* e = (AssignExpr*)expr;
+			Tok(e->identifier);
+			Node(e->expr);
+			U32(e->slot);
+			break;
+		}
+		case NodeType::IF_EXPR: {
+			IfExpr* e = (IfExpr*)expr;
+			Node(e->condition);
+			Node(e->then_branch);
+			Node(e->else_branch);
+			break;
+		}
+		case NodeType::LOGIC_EXPR: {
+			LogicExpr* e = (LogicExpr*)expr;
+			Tok(e->op);
+			Node(e->left);
+			Node(e->right);
+			break;
+		}
+		case NodeType::BINARY_EXPR: {
+			BinaryExpr* e = (BinaryExpr*)expr;
+			Tok(e->op);
+			Node(e->left);
+			Node(e->right);
+			break;
+		}
+		case NodeType::GROUP_EXPR:
+			Node(((GroupExpr*)expr)->expr);
+			break;
+		case NodeType::UNARY_EXPR: {
+			UnaryExpr* e = (UnaryExpr*)expr;
+			Tok(e->op);
+			Node(e->expr);
+			U8(e->postfix);
+			break;
+		}
+		case NodeType::VAR_EXPR:
+			Tok(((VarExpr*)expr)->identifier);
+			U32(((VarExpr*)expr)->slot);
+			break;
+		case NodeType::LITERAL_EXPR:
+			Value(((LiteralExpr*)expr)->value);
+			break;
+		case NodeType::CALL_EXPR: {
+			CallExpr* e = (CallExpr*)expr;
+			Node(e->callee);
+			Tok(e->paren);
+			U32(e->arguments.size());
+			for (Expr* arg : e->arguments)
+				Node(arg);
+			break;
+		}
+		case NodeType::REDUCED_EXPR: {
+			ReducedExpr* e = (ReducedExpr*)expr;
+			U8(e->kind);
+			Node(e->expr);
+			F32(e->constant);
+			break;
+		}
+		case NodeType::CSE_DEF_EXPR:
+			Node(((CseDefExpr*)expr)->expr);
+			U32(((CseDefExpr*)expr)->temp);
+			break;
+		case NodeType::CSE_USE_EXPR:
+			U32(((CseUseExpr*)expr)->temp);
+			break;
+		case NodeType::SPAWN_EXPR: {
+			SpawnExpr* e = (SpawnExpr*)expr;
+			Tok(e->keyword);
+			Node(e->call);
+			U8(e->owner.Get() != 0);
+			if (e->owner.Get())
+				Value(e->owner); // Holds the block
+			break;
+		}
+		case NodeType::MAP_EXPR: {
+			MapExpr* e = (MapExpr*)expr;
+			Tok(e->brace);
+			U32(e->keys.size());
+			for (u32 i = 0; i < e->keys.size(); i++) {
+				Node(e->keys[i]);
+				Node(e->values[i]);
+			}
+			break;
+		}
+		default:
+			break;
+		}
+	}
+};
+
+// Checks everything it reads, so a damaged file fails cleanly rather than
+// building a tree that can't run
+class SnapshotReader {
+public:
+	SnapshotReader(const char* data, size_t size) : mData(data), mSize(size) {}
+	// Defines the saved globals in 'env' and gives back the rest of the program
+	bool Program(Environment* env, std::vector<Stmt*>& statements, std::string& error) {
+		if (mSize < sizeof(SNAPSHOT_MAGIC) || memcmp(mData, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+			error = "not a snapshot";
+			return false;
+		}
+		mPos = sizeof(SNAPSHOT_MAGIC);
+		if (U32() != SNAPSHOT_FORMAT || Str() != BUILD_ID) {
+			error = "made by a different build of the interpreter";
+			return false;
+		}
+		for (u32 count = Count(); count > 0 && !mFailed; count--) {
+			std::string name = Str();
+			env->Define(name, Value());
+		}
+		for (u32 count = Count(); count > 0 && !mFailed; count--)
+			env->imported.push_back(Str());
+		for (u32 count = Count(); count > 0 && !mFailed; count--)
+			if (Stmt* stmt = NeedStmt())
+				statements.push_back(stmt);
+		if (!mFailed && mPos == mSize && Typed(env, statements))
+			return true;
+		for (Stmt* stmt : statements) {
+			stmt->Destroy();
+			delete stmt;
+		}
+		statements.clear();
+		error = "damaged";
+		return false;
+	}
+private:
+	const char* mData;
+	size_t mSize;
+	size_t mPos = 0;
+	bool mFailed = false;
+	std::vector<Object> mObjects; // By number, in the order they were written
+	std::vector<Function*> mFunctions; // Script functions, for type inference
+	u32 mFrameSize = 0; // Of the function being read, 0 outside functions
+
+	// Infers the types the engines rely on, from the globals as they are now.
+	// False if a node the simplifier only makes for numbers isn't one.
+	bool Typed(Environment* env, const std::vector<Stmt*>& statements) {
+		TypeInference types;
+		for (auto& entry : env->values) {
+			types.start_types[entry.first] = (i8)entry.second.index();
+			const Builtin* builtin = FindBuiltin(entry.first);
+			if (builtin && (entry.second.index() != TYPE_FUNCTION || std::get<TYPE_FUNCTION>(entry.second)->native != builtin->fn))
+				types.start_rebound.insert(entry.first);
+		}
+		types.start_imports = !env->imported.empty();
+		types.Run(statements, mFunctions);
+		return !types.unproven;
+	}
+
+	template <typename T>
+	T Raw() {
+		T value{};
+		if (mFailed || mSize - mPos < sizeof(T)) {
+			mFailed = true;
+			return value;
+		}
+		memcpy(&value, mData + mPos, sizeof(T));
+		mPos += sizeof(T);
+		return value;
+	}
+	u8 U8() { return Raw<u8>(); }
+	u16 U16() { return Raw<u16>(); }
+	u32 U32() { return Raw<u32>(); }
+	float F32() { return Raw<float>(); }
+	// A count of things that each take at least a byte, so a damaged one
+	// can't ask for more than the file holds
+	u32 Count() {
+		u32 count = U32();
+		if (count > mSize - mPos) {
+			mFailed = true;
+			return 0;
+		}
+		return count;
+	}
+	std::string Str() {
+		u32 size = Count();
+		if (mFailed) return "";
+		std::string value(mData + mPos, size);
+		mPos += size;
+		return value;
+	}
+	Token Tok() {
+		Token token;
+		u8 type = U8();
+		if (type > (u8)TokenType::STRING) mFailed = true;
+		token.type = (TokenType)type;
+		token.lexeme = Str();
+		token.line = U16();
+		token.offset = U32();
+		return token;
+	}
+	bool Bool() {
+		u8 value = U8();
+		if (value > 1) mFailed = true;
+		return value == 1;
+	}
+	template <typename T>
+	T* Fail(T* node) {
+		mFailed = true;
+		return node;
+	}
+	// A frame slot of the function being read, or -1 for a variable kept in
+	// an Environment
+	i32 Slot() {
+		i32 slot = (i32)U32();
+		if (slot != -1 && (slot < 0 || (u32)slot >= mFrameSize)) mFailed = true;
+		return slot;
+	}
+	// Children that have to be there
+	Stmt* NeedStmt() {
+		Stmt* stmt = ReadStmt();
+		if (!stmt) mFailed = true;
+		return stmt;
+	}
+	Expr* NeedExpr() {
+		Expr* expr = ReadExpr();
+		if (!expr) mFailed = true;
+		return expr;
+	}
+	// The ones BinaryExpr has a case for. Another would give a value of a
+	// type that inference didn't expect.
+	static bool BinaryOperator(TokenType type) {
+		switch (type) {
+		case TokenType::PLUS: case TokenType::MINUS: case TokenType::STAR: case TokenType::SLASH:
+		case TokenType::MODULO: case TokenType::STAR_STAR: case TokenType::EQUAL_EQUAL: case TokenType::BANG_EQUAL:
+		case TokenType::LESS: case TokenType::LESS_EQUAL: case TokenType::GREATER: case TokenType::GREATER_EQUAL:
+			return true;
+		default:
+			return false;
+		}
+	}
+	static void Free(Expr* expr) {
+		if (!expr) return;
+		expr->Destroy();
+		delete expr;
+	}
+
+	Object Value() {
+		u8 type = U8();
+		if (mFailed) return Object();
+		switch (type) {
+		case SEEN_OBJECT: {
+			u32 id = U32();
+			if (id >= mObjects.size()) {
+				mFailed = true;
+				return Object();
+			}
+			return mObjects[id];
+		}
+		case TYPE_BOOLEAN:
+			return Bool();
+		case TYPE_NUMBER:
+			return F32();
+		case TYPE_STRING: {
+			Object value = MakeString(Str());
+			mObjects.push_back(value);
+			return value;
+		}
+		case TYPE_FUNCTION: {
+			std::string name = Str();
+			if (Bool()) {
+				const Builtin* builtin = FindBuiltin(name);
+				if (!builtin) {
+					mFailed = true;
+					return Object();
+				}
+				Object value = Ref<Function>(heap.New<Function>(name, builtin->arity, builtin->fn));
+				mObjects.push_back(value);
+				return value;
+			}
+			Ref<Function> fn = heap.New<Function>(name, std::vector<std::string>(), std::vector<Stmt*>(), 0);
+			mObjects.push_back(fn); // Before the body, which may refer back to it
+			for (u32 count = Count(); count > 0 && !mFailed; count--)
+				fn->params.push_back(Str());
+			fn->frame_size = U32();
+			if (fn->frame_size < fn->params.size() || fn->frame_size > STACK_SIZE)
+				mFailed = true;
+			if (Bool())
+				fn->memo = NewMemoTable();
+			u32 outer_frame_size = mFrameSize;
+			mFrameSize = fn->frame_size;
+			for (u32 count = Count(); count > 0 && !mFailed; count--)
+				if (Stmt* stmt = NeedStmt())
+					fn->body.push_back(stmt);
+			mFrameSize = outer_frame_size;
+			mFunctions.push_back(fn.Get());
+			return fn;
+		}
+		case TYPE_MAP: {
+			Ref<MapObj> map = heap.New<MapObj>();
+			mObjects.push_back(map);
+			for (u32 count = Count(); count > 0 && !mFailed; count--) {
+				Object key = Value();
+				Object value = Value();
+				if (key.index() != TYPE_BOOLEAN && key.index() != TYPE_NUMBER && key.index() != TYPE_STRING) {
+					mFailed = true;
+					break;
+				}
+				map->Set(key, HashKey(key, 0), value);
+			}
+			return map;
+		}
+		default:
+			mFailed = true;
+			return Object();
+		}
+	}
+	Stmt* ReadStmt() {
+		u8 type = U8();
+		if (mFailed || type == NO_NODE) return 0;
+		switch ((NodeType)type) {
+		case NodeType::PRINT_STMT:
+			return new PrintStmt(NeedExpr());
+		case NodeType::BLOCK_STMT: {
+			BlockStmt* s = new BlockStmt({});
+			s->scoped = Bool();
+			for (u32 count = Count(); count > 0 && !mFailed; count--)
+				if (Stmt* stmt = NeedStmt())
+					s->statements.push_back(stmt);
+			return s;
+		}
+		case NodeType::EXPR_STMT:
+			return new ExprStmt(NeedExpr());
+		case NodeType::VAR_DECL_STMT: {
+			Token identifier = Tok();
+			VarDeclStmt* s = new VarDeclStmt(identifier, ReadExpr());
+			s->slot = Slot();
+			return s;
+		}
+		case NodeType::IF_STMT: {
+			Expr* condition = NeedExpr();
+			Stmt* then_branch = NeedStmt();
+			return new IfStmt(condition, then_branch, ReadStmt());
+		}
+		case NodeType::WHILE_STMT: {
+			Expr* condition = NeedExpr();
+			return new WhileStmt(condition, NeedStmt());
+		}
+		case NodeType::FOR_STMT: {
+			Stmt* initializer = ReadStmt();
+			Expr* condition = ReadExpr();
+			Expr* increment = ReadExpr();
+			ForStmt* s = new ForStmt(initializer, condition, increment, NeedStmt());
+			s->scoped = Bool();
+			if (!mFailed)
+				DetectCountedLoop(s);
+			return s;
+		}
+		case NodeType::RANGE_FOR_STMT: {
+			Token identifier = Tok();
+			Expr* start = NeedExpr();
+			Expr* end = NeedExpr();
+			Expr* step = ReadExpr();
+			RangeForStmt* s = new RangeForStmt(identifier, start, end, step, NeedStmt());
+			s->slot = Slot();
+			s->parallel = Bool();
+			for (u32 count = Count(); count > 0 && !mFailed; count--) {
+				Reduction r;
+				u8 op = U8();
+				if (op > Reduction::MAX) {
+					mFailed = true;
+					break;
+				}
+				r.op = (Reduction::Op)op;
+				r.name = Tok();
+				s->reductions.push_back(r);
+			}
+			return s;
+		}
+		case NodeType::FOR_IN_STMT: {
+			Token identifier = Tok();
+			Expr* collection = NeedExpr();
+			ForInStmt* s = new ForInStmt(identifier, collection, NeedStmt());
+			s->slot = Slot();
+			return s;
+		}
+		case NodeType::BREAK_STMT:
+			return new BreakStmt;
+		case NodeType::CONTINUE_STMT:
+			return new ContinueStmt;
+		case NodeType::FN_DECL_STMT: {
+			Token name = Tok();
+			Object fn = Value();
+			if (fn.index() != TYPE_FUNCTION)
+				return Fail<Stmt>(0);
+			FnDeclStmt* s = new FnDeclStmt(name, std::get<TYPE_FUNCTION>(fn).Get(), 0);
+			s->slot = Slot();
+			return s;
+		}
+		case NodeType::RETURN_STMT: {
+			Token keyword = Tok();
+			Expr* value = ReadExpr();
+			ReturnStmt* s = new ReturnStmt(keyword, value, Bool());
+			if (s->tail && (!value || value->Type() != NodeType::CALL_EXPR)) mFailed = true;
+			return s;
+		}
+		case NodeType::IMPORT_STMT: {
+			Token keyword = Tok();
+			std::string name = Str();
+			return new ImportStmt(keyword, name, Str());
+		}
+		case NodeType::SNAPSHOT_STMT:
+			return new SnapshotStmt(Tok());
+		default:
+			return Fail<Stmt>(0);
+		}
+	}
+	Expr* ReadExpr() {
+		u8 type = U8();
+		if (mFailed || type == NO_NODE) return 0;
+		switch ((NodeType)type) {
+		case NodeType::ASSIGN_EXPR: {
+			Token identifier = Tok();
+			AssignExpr* e = new AssignExpr(identifier, NeedExpr());
+			e->slot = Slot();
+			return e;
+		}
+		case NodeType::IF_EXPR: {
+			Expr* condition = NeedExpr();
+			Expr* then_branch = NeedExpr();
+			return new IfExpr(condition, then_branch, NeedExpr());
+		}
+		case NodeType::LOGIC_EXPR: {
+			Token op = Tok();
+			Expr* left = NeedExpr();
+			return new LogicExpr(op, left, NeedExpr());
+		}
+		case NodeType::BINARY_EXPR: {
+			Token op = Tok();
+			if (!BinaryOperator(op.type)) mFailed = true;
+			Expr* left = NeedExpr();
+			return new BinaryExpr(op, left, NeedExpr());
+		}
+		case NodeType::GROUP_EXPR:
+			return new GroupExpr(NeedExpr());
+		case NodeType::UNARY_EXPR: {
+			Token op = Tok();
+			if (op.type != TokenType::BANG && op.type != TokenType::MINUS && op.type != TokenType::PLUS_PLUS &&
+					op.type != TokenType::MINUS_MINUS)
+				mFailed = true;
+			UnaryExpr* e = new UnaryExpr(op, NeedExpr());
+			e->postfix = Bool();
+			return e;
+		}
+		case NodeType::VAR_EXPR: {
+			VarExpr* e = new VarExpr(Tok());
+			e->slot = Slot();
+			return e;
+		}
+		case NodeType::LITERAL_EXPR:
+			return new LiteralExpr(Value());
+		case NodeType::CALL_EXPR: {
+			Expr* callee = NeedExpr();
+			Token paren = Tok();
+			CallExpr* e = new CallExpr(callee, paren, {});
+			for (u32 count = Count(); count > 0 && !mFailed; count--)
+				if (Expr* arg = NeedExpr())
+					e->arguments.push_back(arg);
+			return e;
+		}
+		case NodeType::REDUCED_EXPR: {
+			u8 kind = U8();
+			if (kind > ReducedExpr::MASK) mFailed = true;
+			Expr* operand = NeedExpr();
+			return new ReducedExpr((ReducedExpr::Kind)kind, operand, F32());
+		}
+		case NodeType::CSE_DEF_EXPR: {
+			Expr* operand = NeedExpr();
+			CseDefExpr* e = new CseDefExpr(operand, U32());
+			if (e->temp >= MAX_CSE_TEMPS) mFailed = true;
+			return e;
+		}
+		case NodeType::CSE_USE_EXPR: {
+			CseUseExpr* e = new CseUseExpr(U32());
+			if (e->temp >= MAX_CSE_TEMPS) mFailed = true;
+			return e;
+		}
+		case NodeType::SPAWN_EXPR: {
+			Token keyword = Tok();
+			Expr* call = ReadExpr();
+			if (call && call->Type() != NodeType::CALL_EXPR) mFailed = true;
+			SpawnExpr* e = new SpawnExpr(keyword, (CallExpr*)call, 0);
+			if (Bool()) {
+				Object owner = Value();
+				Function* fn = owner.index() == TYPE_FUNCTION ? std::get<TYPE_FUNCTION>(owner).Get() : 0;
+				if (!fn || fn->body.size() != 1 || !fn->body[0] || fn->body[0]->Type() != NodeType::BLOCK_STMT)
+					return Fail<Expr>(e);
+				e->owner = Ref<Function>(fn);
+				e->block = (BlockStmt*)fn->body[0];
+			}
+			if (!e->call && !e->block) mFailed = true;
+			return e;
+		}
+		case NodeType::MAP_EXPR: {
+			MapExpr* e = new MapExpr(Tok(), {}, {});
+			for (u32 count = Count(); count > 0 && !mFailed; count--) {
+				Expr* key = NeedExpr();
+				Expr* value = NeedExpr();
+				if (!key || !value) {
+					Free(key);
+					Free(value);
+					break;
+				}
+				e->keys.push_back(key);
+				e->values.push_back(value);
+			}
+			return e;
+		}
+		default:
+			return Fail<Expr>(0);
+		}
+	}
+};
+
+Flow SnapshotStmt::Evaluate() {
+	if (!snapshot_path) return Flow::NORMAL;
+	const std::vector<Stmt*>* program = snapshot_program;
+	auto self = program ? std::find(program->begin(), program->end(), this) : std::vector<Stmt*>::const_iterator();
+	if (!program || self == program->end())
+		ErrorRT(keyword.line, "Only the main script can take a snapshot.");
+	SnapshotWriter writer;
+	std::string error;
+	if (!writer.Program(globals.Get(), std::vector<Stmt*>(self + 1, program->end()), error))
+		ErrorRT(keyword.line, error);
+	// Written aside and renamed, so a reader never sees half a snapshot
+	std::string temp = std::string(snapshot_path) + ".tmp";
+	std::ofstream file(temp, std::ios::binary);
+	file.write(writer.data.data(), writer.data.size());
+	file.close();
+	if (!file || std::rename(temp.c_str(), snapshot_path) != 0)
+		ErrorRT(keyword.line, "Could not write the snapshot to " + std::string(snapshot_path) + ".");
+	return Flow::NORMAL;
+}
+
+// Loads a snapshot into the globals; prints why and returns false if it can't
+bool Restore(const char* path, std::vector<Stmt*>& statements) {
+	std::string error;
+	bool restored = false;
+#ifndef _WIN32
+	int fd = open(path, O_RDONLY);
+	struct stat info;
+	if (fd < 0 || fstat(fd, &info) != 0) {
+		if (fd >= 0) close(fd);
+		GenericError("Could not open snapshot: " + std::string(path));
+		return false;
+	}
+	void* data = info.st_size ? mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (data == MAP_FAILED)
+		error = "empty or unreadable";
+	else {
+		restored = SnapshotReader((const char*)data, info.st_size).Program(globals.Get(), statements, error);
+		munmap(data, info.st_size);
+	}
+#else
+	std::ifstream file(path, std::ios::binary);
+	if (!file.is_open()) {
+		GenericError("Could not open snapshot: " + std::string(path));
+		return false;
+	}
+	std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	restored = SnapshotReader(data.data(), data.size()).Program(globals.Get(), statements, error);
+#endif
+	if (!restored)
+		GenericError("Snapshot " + std::string(path) + " is " + error + ".");
+	return restored;
+}
+
+#endif
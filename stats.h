@@ -0,0 +1,190 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "util.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+// Counters behind --stats. They are always collected; printing them is what
+// the flag controls. Every thread keeps its own, and other threads hand
+// theirs over with MergeWorkerStats(), which Report() adds in.
+struct Stats {
+	enum Phase { READ = 0, LEX, PARSE, EVAL, PHASE_COUNT };
+	u64 phase_ns[PHASE_COUNT] = {};
+	u64 tokens = 0;
+	u64 ast_nodes = 0;
+	u64 environments = 0;
+	u64 allocations = 0;
+	u64 allocated_bytes = 0;
+	u64 context_switches = 0;
+	u64 tasks = 0;
+	u64 steals = 0; // Tasks a worker took from another worker's queue
+	u64 max_queue_depth = 0;
+	u64 module_imports = 0; // Imports that went to the module cache
+	u64 modules_loaded = 0; // Of those, the ones that lexed and parsed a file
+	u64 memo_hits = 0; // Calls of 'memo' functions answered from their table
+	u64 memo_misses = 0; // And the ones that ran the body
+	u64 tier_ups = 0; // Hot loops and blocks compiled while running (tiers.h)
+
+	// The phase being timed, so a report printed from an exit() in the
+	// middle of evaluation still accounts for it
+	i32 running = -1;
+	std::chrono::steady_clock::time_point started;
+
+	static const char* PhaseName(i32 phase) {
+		switch (phase) {
+			case READ: return "read";
+			case LEX: return "lex";
+			case PARSE: return "parse";
+			case EVAL: return "eval";
+			default: return "unknown";
+		}
+	}
+	void Merge(const Stats& other) {
+		tokens += other.tokens;
+		ast_nodes += other.ast_nodes;
+		environments += other.environments;
+		allocations += other.allocations;
+		allocated_bytes += other.allocated_bytes;
+		context_switches += other.context_switches;
+		tasks += other.tasks;
+		steals += other.steals;
+		max_queue_depth = std::max(max_queue_depth, other.max_queue_depth);
+		module_imports += other.module_imports;
+		modules_loaded += other.modules_loaded;
+		memo_hits += other.memo_hits;
+		memo_misses += other.memo_misses;
+		tier_ups += other.tier_ups;
+	}
+	void Begin(Phase phase) {
+		running = phase;
+		started = std::chrono::steady_clock::now();
+	}
+	void End() {
+		if (running < 0) return;
+		auto elapsed = std::chrono::steady_clock::now() - started;
+		phase_ns[running] += std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+		running = -1;
+	}
+	static u64 PeakRSSKilobytes() {
+#ifndef _WIN32
+		struct rusage usage;
+		if (getrusage(RUSAGE_SELF, &usage) == 0)
+			return usage.ru_maxrss; // Kilobytes on Linux
+#endif
+		return 0;
+	}
+	// Imports that found the module already parsed
+	double ModuleHitRate() {
+		return module_imports ? 1 - (double)modules_loaded / module_imports : 0;
+	}
+	void Report(bool json);
+};
+
+thread_local Stats stats;
+
+Stats worker_stats;
+HeapStats worker_heap_stats;
+std::mutex worker_stats_lock;
+
+// Moves what this thread has counted so far into the totals
+void MergeWorkerStats() {
+	std::lock_guard<std::mutex> guard(worker_stats_lock);
+	worker_stats.Merge(stats);
+	worker_heap_stats.Merge(heap.stats);
+	stats = Stats();
+	heap.stats = HeapStats();
+}
+
+// Goes to stderr so it never mixes with the script's own output
+void Stats::Report(bool json) {
+	End();
+	{
+		std::lock_guard<std::mutex> guard(worker_stats_lock);
+		Merge(worker_stats);
+		heap.stats.Merge(worker_heap_stats);
+	}
+	u64 rss = PeakRSSKilobytes();
+	if (json) {
+		fprintf(stderr, "{\"phases_ms\": {");
+		for (i32 i = 0; i < PHASE_COUNT; i++)
+			fprintf(stderr, "%s\"%s\": %.3f", i ? ", " : "", PhaseName(i), phase_ns[i] / 1e6);
+		fprintf(stderr, "}, \"tokens\": %llu, \"ast_nodes\": %llu, \"environments\": %llu, "
+			"\"allocations\": %llu, \"allocated_bytes\": %llu, \"context_switches\": %llu, "
+			"\"tasks\": %llu, \"steals\": %llu, \"max_queue_depth\": %llu, "
+			"\"module_imports\": %llu, \"modules_loaded\": %llu, \"module_hit_rate\": %.3f, "
+			"\"memo_hits\": %llu, \"memo_misses\": %llu, \"tier_ups\": %llu, \"peak_rss_kb\": %llu, "
+			"\"heap\": {\"allocated\": %llu, \"freed\": %llu, \"live_bytes\": %llu, \"peak_bytes\": %llu}}\n",
+			(unsigned long long)tokens, (unsigned long long)ast_nodes,
+			(unsigned long long)environments, (unsigned long long)allocations,
+			(unsigned long long)allocated_bytes, (unsigned long long)context_switches,
+			(unsigned long long)tasks, (unsigned long long)steals, (unsigned long long)max_queue_depth,
+			(unsigned long long)module_imports, (unsigned long long)modules_loaded, ModuleHitRate(),
+			(unsigned long long)memo_hits, (unsigned long long)memo_misses, (unsigned long long)tier_ups, (unsigned long long)rss,
+			(unsigned long long)heap.stats.allocated, (unsigned long long)heap.stats.freed,
+			(unsigned long long)heap.stats.live_bytes, (unsigned long long)heap.stats.peak_bytes);
+		return;
+	}
+	for (i32 i = 0; i < PHASE_COUNT; i++)
+		fprintf(stderr, "%-16s %12.3f ms\n", PhaseName(i), phase_ns[i] / 1e6);
+	fprintf(stderr, "%-16s %12llu\n", "tokens", (unsigned long long)tokens);
+	fprintf(stderr, "%-16s %12llu\n", "ast nodes", (unsigned long long)ast_nodes);
+	fprintf(stderr, "%-16s %12llu\n", "environments", (unsigned long long)environments);
+	fprintf(stderr, "%-16s %12llu\n", "allocations", (unsigned long long)allocations);
+	fprintf(stderr, "%-16s %12llu\n", "allocated bytes", (unsigned long long)allocated_bytes);
+	fprintf(stderr, "%-16s %12llu\n", "context switches", (unsigned long long)context_switches);
+	fprintf(stderr, "%-16s %12llu\n", "tasks", (unsigned long long)tasks);
+	fprintf(stderr, "%-16s %12llu\n", "steals", (unsigned long long)steals);
+	fprintf(stderr, "%-16s %12llu\n", "max queue depth", (unsigned long long)max_queue_depth);
+	fprintf(stderr, "%-16s %12llu\n", "module imports", (unsigned long long)module_imports);
+	fprintf(stderr, "%-16s %12llu\n", "modules loaded", (unsigned long long)modules_loaded);
+	fprintf(stderr, "%-16s %12.1f %%\n", "module hit rate", ModuleHitRate() * 100);
+	fprintf(stderr, "%-16s %12llu\n", "memo hits", (unsigned long long)memo_hits);
+	fprintf(stderr, "%-16s %12llu\n", "memo misses", (unsigned long long)memo_misses);
+	fprintf(stderr, "%-16s %12llu\n", "tier ups", (unsigned long long)tier_ups);
+	fprintf(stderr, "%-16s %12llu KB\n", "peak rss", (unsigned long long)rss);
+	fprintf(stderr, "%-16s %12llu\n", "heap objects", (unsigned long long)heap.stats.allocated);
+	fprintf(stderr, "%-16s %12llu\n", "heap freed", (unsigned long long)heap.stats.freed);
+	fprintf(stderr, "%-16s %12llu\n", "heap live bytes", (unsigned long long)heap.stats.live_bytes);
+	fprintf(stderr, "%-16s %12llu\n", "heap peak bytes", (unsigned long long)heap.stats.peak_bytes);
+}
+
+// Counting allocator hook, for programs that define BOMAC_COUNT_ALLOCATIONS
+// before including this: main.cpp does, the library (bomac.cpp) doesn't, so
+// it leaves the allocator of the program embedding it alone. Every operator
+// new then goes through here, including the ones inside the standard
+// containers. Kept out of line so the compiler doesn't pair the malloc and
+// free inside them with new and delete at the call sites.
+#ifdef BOMAC_COUNT_ALLOCATIONS
+__attribute__((noinline)) void* operator new(size_t size) {
+	stats.allocations++;
+	stats.allocated_bytes += size;
+	void* ptr = malloc(size ? size : 1);
+	if (!ptr) throw std::bad_alloc();
+	return ptr;
+}
+__attribute__((noinline)) void* operator new[](size_t size) {
+	return operator new(size);
+}
+__attribute__((noinline)) void operator delete(void* ptr) noexcept {
+	free(ptr);
+}
+__attribute__((noinline)) void operator delete[](void* ptr) noexcept {
+	free(ptr);
+}
+__attribute__((noinline)) void operator delete(void* ptr, size_t) noexcept {
+	free(ptr);
+}
+__attribute__((noinline)) void operator delete[](void* ptr, size_t) noexcept {
+	free(ptr);
+}
+#endif
+
+#endif
@@ -0,0 +1,253 @@
+#ifndef TASKS_H
+#define TASKS_H
+
+#include "util.h"
+#include "AST.h"
+#include "interpreter.h"
+#include "pool.h"
+#include <atomic>
+#include <memory>
+
+/*
+'spawn f(x)' runs a call as a task on the thread pool and 'spawn { ... }' a
+block, and both give back a task that join() waits for. Tasks talk through
+channels: bounded queues that send() and receive() block on when full or
+empty.
+
+A task sees the script as it was when it was spawned: its globals, and for
+a block the variables around it, are a read-only copy. The copy of the
+globals is shared by every task spawned until they change again.
+
+A channel is a lock-free ring buffer (Vyukov's bounded MPMC queue). The
+locks in WaitList are only taken by a sender or receiver that has to wait,
+and by whoever wakes it.
+*/
+
+const u32 MAX_CHANNEL_CAPACITY = 1 << 24;
+
+class ChannelObj : public HeapObject {
+public:
+	WaitList senders; // Waiting for room
+	WaitList receivers; // Waiting for a value, or for the channel to close
+	std::atomic<bool> closed{false};
+	ChannelObj(u32 capacity) : mCells(new Cell[capacity]), mCapacity(capacity) {
+		for (u32 i = 0; i < capacity; i++)
+			mCells[i].sequence = i;
+	}
+	bool TrySend(const Object& value) {
+		u64 pos = mTail.load(std::memory_order_relaxed);
+		Cell* cell;
+		while (true) {
+			cell = &mCells[pos % mCapacity];
+			i64 diff = (i64)cell->sequence.load(std::memory_order_acquire) - (i64)pos;
+			if (diff == 0) {
+				if (mTail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+				return false; // Full
+			else
+				pos = mTail.load(std::memory_order_relaxed);
+		}
+		cell->value = value;
+		cell->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+	bool TryReceive(Object& value) {
+		u64 pos = mHead.load(std::memory_order_relaxed);
+		Cell* cell;
+		while (true) {
+			cell = &mCells[pos % mCapacity];
+			i64 diff = (i64)cell->sequence.load(std::memory_order_acquire) - (i64)(pos + 1);
+			if (diff == 0) {
+				if (mHead.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+				return false; // Empty
+			else
+				pos = mHead.load(std::memory_order_relaxed);
+		}
+		value = std::move(cell->value);
+		cell->value = Object();
+		cell->sequence.store(pos + mCapacity, std::memory_order_release);
+		return true;
+	}
+	bool HasRoom() {
+		u64 pos = mTail.load();
+		return mCells[pos % mCapacity].sequence.load() == pos;
+	}
+	bool HasValue() {
+		u64 pos = mHead.load();
+		return mCells[pos % mCapacity].sequence.load() == pos + 1;
+	}
+	size_t Bytes() { return sizeof(*this) + mCapacity * sizeof(Cell); }
+private:
+	struct Cell {
+		std::atomic<u64> sequence;
+		Object value;
+	};
+	std::unique_ptr<Cell[]> mCells;
+	u64 mCapacity;
+	std::atomic<u64> mHead{0};
+	std::atomic<u64> mTail{0};
+};
+
+class TaskObj : public HeapObject {
+public:
+	Object result = 0.0f;
+	bool failed = false;
+	std::atomic<bool> done{false};
+	WaitList joiners;
+	size_t Bytes() { return sizeof(*this); }
+};
+
+ChannelObj* ExpectChannel(const Object& obj, u16 line) {
+	if (obj.index() != TYPE_CHANNEL)
+		ErrorRT(line, "Expected a channel.");
+	return std::get<TYPE_CHANNEL>(obj).Get();
+}
+
+Object Channel(Object* args, u16 line) {
+	if (args[0].index() != TYPE_NUMBER)
+		ErrorRT(line, "Expected the capacity of a channel to be a number.");
+	float capacity = std::get<TYPE_NUMBER>(args[0]);
+	if (capacity < 1 || capacity > MAX_CHANNEL_CAPACITY || capacity != (u32)capacity)
+		ErrorRT(line, "Expected the capacity of a channel to be a whole number from 1 to " + std::to_string(MAX_CHANNEL_CAPACITY) + ".");
+	return Ref<ChannelObj>(heap.New<ChannelObj>((u32)capacity));
+}
+
+Object Send(Object* args, u16 line) {
+	ChannelObj* channel = ExpectChannel(args[0], line);
+	while (true) {
+		if (channel->closed)
+			ErrorRT(line, "Can't send on a closed channel.");
+		if (channel->TrySend(args[1])) {
+			channel->receivers.WakeOne();
+			return args[1];
+		}
+		Waiter waiter;
+		if (channel->senders.Add(waiter, [&] { return channel->closed || channel->HasRoom(); }))
+			ThreadPool::Get().Wait(waiter, line);
+	}
+}
+
+// Gives 'false' once the channel is closed and empty
+Object Receive(Object* args, u16 line) {
+	ChannelObj* channel = ExpectChannel(args[0], line);
+	while (true) {
+		Object value;
+		bool closed = channel->closed; // Before trying, so a value sent just before closing isn't missed
+		if (channel->TryReceive(value)) {
+			channel->senders.WakeOne();
+			return value;
+		}
+		if (closed)
+			return false;
+		Waiter waiter;
+		if (channel->receivers.Add(waiter, [&] { return channel->closed || channel->HasValue(); }))
+			ThreadPool::Get().Wait(waiter, line);
+	}
+}
+
+Object Close(Object* args, u16 line) {
+	ChannelObj* channel = ExpectChannel(args[0], line);
+	if (channel->closed.exchange(true))
+		ErrorRT(line, "The channel is already closed.");
+	channel->senders.WakeAll();
+	channel->receivers.WakeAll();
+	return args[0];
+}
+
+Object Join(Object* args, u16 line) {
+	if (args[0].index() != TYPE_TASK)
+		ErrorRT(line, "Expected a task.");
+	TaskObj* task = std::get<TYPE_TASK>(args[0]).Get();
+	while (!task->done) {
+		Waiter waiter;
+		if (task->joiners.Add(waiter, [&] { return task->done.load(); }))
+			ThreadPool::Get().Wait(waiter, line);
+	}
+	if (task->failed)
+		ErrorRT(line, "The task being joined ended with an error.");
+	return task->result;
+}
+
+const Builtin task_builtins[] = {
+	{"channel", 1, Channel, TYPE_CHANNEL},
+	{"send", 2, Send},
+	{"receive", 1, Receive},
+	{"close", 1, Close, TYPE_CHANNEL},
+	{"join", 1, Join},
+};
+
+// A read-only copy of 'env' alone, in front of the same (read-only) built-ins
+// an embedded run's globals have (bomac.cpp). Copies of an environment that
+// can change are kept and reused until it does.
+Ref<Environment> Snapshot(Environment* env) {
+	if (!env->frozen && env->snapshot && env->snapshot_version == env->version)
+		return env->snapshot;
+	Ref<Environment> copy = heap.New<Environment>(env->enclosing.Get());
+	copy->values = env->values;
+	copy->frozen = true;
+	// A frozen one may be read by other threads, which rules out writing it
+	if (!env->frozen) {
+		env->snapshot = copy;
+		env->snapshot_version = env->version;
+	}
+	return copy;
+}
+
+Object SpawnExpr::Evaluate() {
+	Ref<Function> fn;
+	std::vector<Object> args;
+	if (call) {
+		fn = Ref<Function>(CheckCallable(call->callee->Evaluate(), call->arguments.size(), call->paren.line));
+		for (Expr* arg : call->arguments)
+			args.push_back(arg->Evaluate());
+	}
+	Ref<Environment> task_globals = Snapshot(globals.Get());
+	// A block sees the variables around it, flattened into one frozen scope
+	Ref<Environment> scope;
+	if (block) {
+		scope = heap.New<Environment>(task_globals.Get());
+		for (Environment* env = environment; env && env != globals.Get(); env = env->enclosing.Get())
+			scope->values.insert(env->values.begin(), env->values.end());
+		scope->frozen = true;
+	}
+	Ref<TaskObj> task = heap.New<TaskObj>();
+	Ref<Function> body = owner;
+	BlockStmt* stmt = block;
+	u16 line = keyword.line;
+	ThreadPool::Get().Spawn([task, task_globals, scope, body, stmt, fn, args, line] {
+		globals = task_globals;
+		environment = scope ? scope.Get() : globals.Get();
+		try {
+			if (stmt)
+				stmt->Evaluate();
+			else {
+				if (value_stack.empty())
+					value_stack.resize(value_stack_size);
+				u32 base = stack_top;
+				if (base + args.size() > value_stack.size())
+					ErrorRT(line, "Stack overflow.");
+				for (const Object& arg : args)
+					value_stack[stack_top++] = arg;
+				if (fn->native) {
+					task->result = fn->native(&value_stack[base], line);
+					stack_top = base;
+				}
+				else
+					task->result = CallFunction(fn.Get(), base, line);
+			}
+		} catch (const TaskFailed&) {
+			task->failed = true;
+		}
+	}, [task] {
+		task->done = true;
+		task->joiners.WakeAll();
+	});
+	return task;
+}
+
+#endif
@@ -0,0 +1,22 @@
+#!/bin/sh
+# Checks what scripts print against the expected output next to them, under
+# each engine. Usage: tests/output.sh [path/to/bomac]
+cd "$(dirname "$0")/.."
+BOMAC=${1:-./bomac}
+if [ ! -x "$BOMAC" ]; then
+	g++ -std=c++17 -O2 -o "$BOMAC" main.cpp || exit 1
+fi
+
+status=0
+for script in tests/output/*.bomac; do
+	expected=$(cat "${script%.bomac}.out")
+	for flags in "" "--closure" "--no-simplify"; do
+		actual=$("$BOMAC" $flags "$script")
+		if [ "$actual" != "$expected" ]; then
+			echo "FAIL $script $flags"
+			status=1
+		fi
+	done
+done
+[ $status -eq 0 ] && echo "all outputs as expected"
+exit $status
@@ -0,0 +1,22 @@
+#!/bin/sh
+# Checks that the simplifier and common subexpression elimination never
+# change what a program prints. Usage: tests/simplify.sh [path/to/bomac]
+cd "$(dirname "$0")/.."
+BOMAC=${1:-./bomac}
+if [ ! -x "$BOMAC" ]; then
+	g++ -std=c++17 -O2 -o "$BOMAC" main.cpp || exit 1
+fi
+
+status=0
+for script in tests/simplify/*.bomac; do
+	expected=$("$BOMAC" --no-simplify "$script")
+	for flags in "" "--cse" "--closure" "--closure --cse"; do
+		actual=$("$BOMAC" $flags "$script")
+		if [ "$actual" != "$expected" ]; then
+			echo "FAIL $script $flags"
+			status=1
+		fi
+	done
+done
+[ $status -eq 0 ] && echo "all outputs identical"
+exit $status
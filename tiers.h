@@ -0,0 +1,168 @@
+#ifndef TIERS_H
+#define TIERS_H
+
+#include "util.h"
+#include "AST.h"
+#include "interpreter.h"
+#include "closure.h"
+
+/*
+Tiered execution. The tree-walker counts the runs of every loop body and
+block (see Heat() in interpreter.h), and once one has run
+hot_loop_threshold or hot_block_threshold times, it's compiled by the closure engine (closure.h) and runs compiled
+from then on. A loop switches between two iterations, going on from where
+the walked ones stopped; a block switches the next time it's entered.
+
+A tier gets its own copies of the variables it uses from outside, taken
+each time it starts and written back when it stops, even by a runtime
+error. Loops and blocks the closure engine can't compile, such as ones that
+call functions, stay walked.
+*/
+
+class Tier {
+public:
+	ClosureCompiler compiler;
+	StmtFn body;
+	ExprFn condition; // Of a while or for loop
+	ExprFn increment; // Of a for loop
+	Object* counter = 0; // A range loop's variable
+	// Copies the outer variables in. False if one of them isn't defined
+	// yet, or is read-only where it is and the tier assigns to it.
+	bool Enter() {
+		mPlaces.resize(compiler.outer.size());
+		for (u32 i = 0; i < compiler.outer.size(); i++) {
+			ClosureCompiler::Outer& var = compiler.outer[i];
+			if (var.slot >= 0) {
+				*var.value = frame[var.slot];
+				continue;
+			}
+			Environment* env = environment;
+			for (; env; env = env->enclosing.Get()) {
+				auto iter = env->values.find(var.name->lexeme);
+				if (iter == env->values.end()) continue;
+				mPlaces[i] = {env, &iter->second}; // Element references in an unordered_map survive rehashing
+				break;
+			}
+			if (!env || (var.written && env->frozen)) {
+				compiler.ClearSlots();
+				return false;
+			}
+			*var.value = *mPlaces[i].value;
+		}
+		return true;
+	}
+	void Leave() {
+		for (u32 i = 0; i < compiler.outer.size(); i++) {
+			ClosureCompiler::Outer& var = compiler.outer[i];
+			if (!var.written) continue;
+			if (var.slot >= 0)
+				frame[var.slot] = *var.value;
+			else {
+				*mPlaces[i].value = *var.value;
+				mPlaces[i].env->version++;
+			}
+		}
+		compiler.ClearSlots();
+	}
+private:
+	struct Place {
+		Environment* env;
+		Object* value;
+	};
+	std::vector<Place> mPlaces; // Of each outer variable kept in an Environment
+};
+
+void FreeTier(Tier* tier) {
+	delete tier;
+}
+
+// Leaves a tier however its run ends
+class TierRun {
+public:
+	TierRun(Tier* tier) : mTier(tier) {}
+	~TierRun() { mTier->Leave(); }
+private:
+	Tier* mTier;
+};
+
+// The tier of a hot loop or block, compiled by 'compile' the first time and
+// entered. 0 if it can't be compiled or entered, so the caller walks on.
+template <typename F>
+Tier* EnterTier(Hotness& hot, F compile) {
+	if (!hot.tier) {
+		Tier* tier = new Tier();
+		tier->compiler.BeginRegion();
+		compile(*tier);
+		if (!tier->compiler.Supported()) {
+			delete tier;
+			hot.cold = true;
+			return 0;
+		}
+		hot.tier = tier;
+		stats.tier_ups++;
+	}
+	if (!hot.tier->Enter()) {
+		hot.count = 0; // Tried again once it has run as often again
+		return 0;
+	}
+	return hot.tier;
+}
+
+bool RunTier(WhileStmt* loop) {
+	Tier* tier = EnterTier(loop->hot, [loop](Tier& tier) {
+		tier.condition = tier.compiler.RegionExpr(loop->condition);
+		tier.body = tier.compiler.RegionStmt(loop->statement);
+	});
+	if (!tier) return false;
+	TierRun run(tier);
+	while (ObjIsTruthy(tier->condition())) {
+		Tick();
+		if (tier->body() == Flow::BREAK) break;
+	}
+	return true;
+}
+
+// From the condition on, after the initializer
+bool RunTier(ForStmt* loop) {
+	Tier* tier = EnterTier(loop->hot, [loop](Tier& tier) {
+		if (loop->condition) tier.condition = tier.compiler.RegionExpr(loop->condition);
+		if (loop->increment) tier.increment = tier.compiler.RegionExpr(loop->increment);
+		tier.body = tier.compiler.RegionStmt(loop->body);
+	});
+	if (!tier) return false;
+	TierRun run(tier);
+	while (!tier->condition || ObjIsTruthy(tier->condition())) {
+		Tick();
+		if (tier->body() == Flow::BREAK) break;
+		if (tier->increment) tier->increment();
+	}
+	return true;
+}
+
+// The iterations from 'from' on
+bool RunTier(RangeForStmt* loop, float from, float to, float step) {
+	Tier* tier = EnterTier(loop->hot, [loop](Tier& tier) {
+		tier.counter = tier.compiler.RegionVariable(loop->identifier.lexeme);
+		tier.body = tier.compiler.RegionStmt(loop->body);
+	});
+	if (!tier) return false;
+	TierRun run(tier);
+	for (float i = from; step > 0 ? i < to : i > to; i += step) {
+		Tick();
+		*tier->counter = i;
+		if (tier->body() == Flow::BREAK) break;
+	}
+	return true;
+}
+
+bool RunTier(BlockStmt* block, Flow& flow) {
+	Tier* tier = EnterTier(block->hot, [block](Tier& tier) {
+		tier.body = tier.compiler.RegionStmt(block);
+	});
+	if (!tier) return false;
+	TierRun run(tier);
+	flow = tier->body();
+	return true;
+}
+
+#endif
@@ -12,15 +12,15 @@ enum class TokenType {
 
 	EQUAL_EQUAL, BANG_EQUAL, LESS,
 	GREATER, LESS_EQUAL, GREATER_EQUAL,
-	MINUS_GREATER,
+	MINUS_GREATER, DOT_DOT,
 
 	LEFT_PAREN, RIGHT_PAREN,
 	LEFT_BRACKET, RIGHT_BRACKET,
 	LEFT_BRACE, RIGHT_BRACE,
 
-	IDENTIFIER, SEMICOLON, IF, ELSE, WHILE, FOR, BREAK, CONTINUE,
+	IDENTIFIER, SEMICOLON, COLON, COMMA, IF, ELSE, WHILE, FOR, IN, BREAK, CONTINUE,
 	VAR, PRINT, TRUE, FALSE, AND, OR,
-	CLASS, FN, RETURN, NUMBER, STRING
+	CLASS, FN, RETURN, SPAWN, IMPORT, SNAPSHOT, NUMBER, STRING
 };
 
 struct Token {
@@ -28,6 +28,7 @@ struct Token {
 	std::string lexeme;
 	Object literal;
 	u16 line = 0;
+	u32 offset = 0; // Of the first character in the source
 	static std::string TypeStr(TokenType _type) {
 		std::string type_str;
 		switch(_type) {
@@ -48,6 +49,8 @@ struct Token {
 			case TokenType::GREATER: type_str = "GREATER"; break;
 			case TokenType::LESS_EQUAL: type_str = "LESS_EQUAL"; break;
 			case TokenType::GREATER_EQUAL: type_str = "GREATER_EQUAL"; break;
+			case TokenType::MINUS_GREATER: type_str = "MINUS_GREATER"; break;
+			case TokenType::DOT_DOT: type_str = "DOT_DOT"; break;
 			case TokenType::LEFT_PAREN: type_str = "LEFT_PAREN"; break;
 			case TokenType::RIGHT_PAREN: type_str = "RIGHT_PAREN"; break;
 			case TokenType::LEFT_BRACKET: type_str = "LEFT_BRACKET"; break;
@@ -55,12 +58,15 @@ struct Token {
 			case TokenType::LEFT_BRACE: type_str = "LEFT_BRACE"; break;
 			case TokenType::RIGHT_BRACE: type_str = "RIGHT_BRACE"; break;
 			case TokenType::IDENTIFIER: type_str = "IDENTIFIER"; break;
-			case TokenType::SEMICOLON: type_str = "COLON"; break;
+			case TokenType::SEMICOLON: type_str = "SEMICOLON"; break;
+			case TokenType::COLON: type_str = "COLON"; break;
+			case TokenType::COMMA: type_str = "COMMA"; break;
 			case TokenType::VAR: type_str = "VAR"; break;
 			case TokenType::IF: type_str = "IF"; break;
 			case TokenType::ELSE: type_str = "ELSE"; break;
 			case TokenType::WHILE: type_str = "WHILE"; break;
 			case TokenType::FOR: type_str = "FOR"; break;
+			case TokenType::IN: type_str = "IN"; break;
 			case TokenType::BREAK: type_str = "BREAK"; break;
 			case TokenType::CONTINUE: type_str = "CONTINUE"; break;
 			case TokenType::PRINT: type_str = "PRINT"; break;
@@ -69,6 +75,9 @@ struct Token {
 			case TokenType::CLASS: type_str = "CLASS"; break;
 			case TokenType::FN: type_str = "FN"; break;
 			case TokenType::RETURN: type_str = "RETURN"; break;
+			case TokenType::SPAWN: type_str = "SPAWN"; break;
+			case TokenType::IMPORT: type_str = "IMPORT"; break;
+			case TokenType::SNAPSHOT: type_str = "SNAPSHOT"; break;
 			case TokenType::AND: type_str = "AND"; break;
 			case TokenType::OR: type_str = "OR"; break;
 			case TokenType::TRUE: type_str = "TRUE"; break;
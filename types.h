@@ -0,0 +1,503 @@
+#ifndef TYPES_H
+#define TYPES_H
+
+#include "util.h"
+#include "AST.h"
+#include <unordered_set>
+
+/*
+Flow-sensitive type inference over the parsed program. Every expression gets
+the type it is guaranteed to have when it runs (or TYPE_UNKNOWN), and the
+operators whose operands are proven numbers are marked 'numeric' so both
+engines skip the operand checks there.
+
+A variable's type follows its assignments in program order. Branches and
+loop iterations join: a variable keeps its type only if every path agrees.
+Loops are re-analyzed until their entry state stops changing, and the
+annotations from that last pass are the ones left on the nodes. A call can
+run any function, which can assign any global, so at the top level every
+call forgets what is known about the globals.
+
+A call by name to a built-in that no code in the program can give another
+value, and nothing it imports either, is tied to the built-in. It then
+skips looking the name up, and since built-ins run no script code it
+forgets nothing and its result has the built-in's type. That takes a
+second pass, once the whole program has been seen.
+*/
+
+const char* TypeName(i8 type) {
+	switch (type) {
+	case TYPE_BOOLEAN: return "bool";
+	case TYPE_NUMBER: return "number";
+	case TYPE_STRING: return "string";
+	case TYPE_FUNCTION: return "function";
+	case TYPE_TASK: return "task";
+	case TYPE_CHANNEL: return "channel";
+	case TYPE_MAP: return "map";
+	case TYPE_FILE: return "file";
+	default: return "unknown";
+	}
+}
+
+class TypeInference {
+public:
+	// Off for a module, whose globals are the importing script's
+	bool bind_builtins = true;
+	// For a program picked up part way, as a restored snapshot is: the
+	// types of the globals it starts with, the ones that no longer hold
+	// their built-in, and whether it imported anything before
+	std::unordered_map<std::string, i8> start_types;
+	std::unordered_set<std::string> start_rebound;
+	bool start_imports = false;
+	// Set when a reduced expression's operand isn't proven a number, which
+	// the simplifier never makes, so only a damaged snapshot has one
+	bool unproven = false;
+	// 'functions' are analysed too, for ones held only by values
+	void Run(const std::vector<Stmt*>& statements, const std::vector<Function*>& functions = {}) {
+		mRebound = start_rebound;
+		mImports = start_imports;
+		mCalls.clear();
+		mBound = false;
+		unproven = false;
+		Pass(statements, functions);
+		for (CallExpr* call : mCalls) {
+			const std::string& name = ((VarExpr*)call->callee)->identifier.lexeme;
+			const Builtin* builtin = FindBuiltin(name);
+			if (bind_builtins && !mImports && builtin && builtin->arity == call->arguments.size() && !mRebound.count(name)) {
+				call->builtin = builtin;
+				mBound = true;
+			}
+		}
+		if (mBound)
+			Pass(statements, functions);
+	}
+	// Every operator that checks its operands, in source order, and whether
+	// the check could be dropped
+	void Dump() {
+		u32 typed = 0;
+		for (Expr* site : mSites) {
+			bool numeric;
+			const Token* op;
+			std::string operands;
+			if (site->Type() == NodeType::BINARY_EXPR) {
+				BinaryExpr* e = (BinaryExpr*)site;
+				numeric = e->numeric;
+				op = &e->op;
+				operands = std::string(TypeName(e->left->value_type)) + ", " + TypeName(e->right->value_type);
+			}
+			else {
+				UnaryExpr* e = (UnaryExpr*)site;
+				numeric = e->numeric;
+				op = &e->op;
+				operands = TypeName(e->expr->value_type);
+			}
+			if (numeric) typed++;
+			output.Write("line " + std::to_string(op->line) + ": " + site->Str() + "  " +
+				operands + "  " + (numeric ? "unchecked" : "checked") + "\n");
+		}
+		output.Write(std::to_string(typed) + " of " + std::to_string(mSites.size()) + " operator sites typed\n");
+	}
+private:
+	using TypeScope = std::unordered_map<std::string, i8>;
+	using TypeState = std::vector<TypeScope>;
+	struct Loop {
+		u32 depth; // Scopes outside the loop, the part of a jump's state kept
+		std::vector<TypeState> jumps; // State at each break and continue
+	};
+	TypeState mScopes;
+	std::vector<Loop> mLoops;
+	u32 mFunctionDepth = 0;
+	std::vector<Expr*> mSites;
+	std::unordered_set<Expr*> mSeen;
+	std::unordered_set<std::string> mRebound; // Globals the program declares or assigns
+	bool mImports = false;
+	std::vector<CallExpr*> mCalls; // By the name of a global, from the first pass
+	bool mBound = false; // In the second pass
+	std::unordered_map<u32, i8> mTemps; // Of CSE temporaries defined so far in this expression
+	u32 mExprDepth = 0;
+
+	void Pass(const std::vector<Stmt*>& statements, const std::vector<Function*>& functions) {
+		mScopes.assign(1, TypeScope());
+		for (auto& entry : start_types)
+			if (entry.second != TYPE_UNKNOWN)
+				mScopes.front()[entry.first] = entry.second;
+		mLoops.clear();
+		mFunctionDepth = 0;
+		mSites.clear();
+		mSeen.clear();
+		for (Stmt* stmt : statements)
+			InferStmt(stmt);
+		for (Function* fn : functions)
+			InferFunction(fn);
+	}
+	void Rebind(const std::string& name, i32 slot) {
+		if (slot < 0) mRebound.insert(name);
+	}
+
+	static i8 Join(i8 a, i8 b) {
+		return a == b ? a : (i8)TYPE_UNKNOWN;
+	}
+	// A variable declared on only one side may not exist at runtime, which
+	// is an error, so its type there doesn't matter; it still joins to unknown
+	static void JoinInto(TypeState& into, const TypeState& other) {
+		for (u32 i = 0; i < into.size() && i < other.size(); i++) {
+			for (auto& entry : into[i]) {
+				auto iter = other[i].find(entry.first);
+				entry.second = iter == other[i].end() ? (i8)TYPE_UNKNOWN : Join(entry.second, iter->second);
+			}
+			for (auto& entry : other[i])
+				if (!into[i].count(entry.first))
+					into[i][entry.first] = TYPE_UNKNOWN;
+		}
+	}
+
+	i8 Lookup(const std::string& name) {
+		for (auto scope = mScopes.rbegin(); scope != mScopes.rend(); scope++) {
+			auto iter = scope->find(name);
+			if (iter != scope->end())
+				return iter->second;
+		}
+		return TYPE_UNKNOWN;
+	}
+	// At the top level the outermost scope only holds the globals whose type
+	// is known, so a call can forget them all without visiting every global
+	void Set(const std::string& name, i8 type) {
+		for (auto scope = mScopes.rbegin(); scope != mScopes.rend(); scope++) {
+			auto iter = scope->find(name);
+			if (iter != scope->end()) {
+				iter->second = type;
+				return;
+			}
+		}
+		if (mFunctionDepth == 0 && type != TYPE_UNKNOWN)
+			mScopes.front()[name] = type;
+	}
+	void Declare(const std::string& name, i8 type) {
+		if (mFunctionDepth == 0 && mScopes.size() == 1 && type == TYPE_UNKNOWN)
+			mScopes.front().erase(name);
+		else
+			mScopes.back()[name] = type;
+	}
+	// Called functions run against the globals, which are the outermost
+	// scope at the top level and aren't tracked inside a function body
+	void ForgetGlobals() {
+		if (mFunctionDepth > 0) return;
+		mScopes.front().clear();
+	}
+	void AddSite(Expr* expr) {
+		if (mSeen.insert(expr).second)
+			mSites.push_back(expr);
+	}
+
+	void InferFunction(Function* fn) {
+		TypeState outer = std::move(mScopes);
+		std::vector<Loop> outer_loops = std::move(mLoops);
+		mScopes.assign(1, TypeScope());
+		mLoops.clear();
+		mFunctionDepth++;
+		for (const std::string& param : fn->params)
+			Declare(param, TYPE_UNKNOWN);
+		for (Stmt* stmt : fn->body)
+			InferStmt(stmt);
+		mFunctionDepth--;
+		mScopes = std::move(outer);
+		mLoops = std::move(outer_loops);
+	}
+
+	// 'counter' is a range loop variable, which is a number at the top of
+	// every iteration whatever the body assigns to it
+	void InferLoop(Expr* condition, Stmt* body, Expr* increment, const std::string* counter) {
+		while (true) {
+			TypeState head = mScopes;
+			if (counter)
+				Declare(*counter, TYPE_NUMBER);
+			if (condition)
+				InferExpr(condition);
+			TypeState exit = mScopes;
+			mLoops.push_back(Loop{(u32)mScopes.size(), {}});
+			InferStmt(body);
+			Loop loop = std::move(mLoops.back());
+			mLoops.pop_back();
+			for (const TypeState& jump : loop.jumps) {
+				JoinInto(mScopes, jump);
+				JoinInto(exit, jump);
+			}
+			if (increment)
+				InferExpr(increment);
+			TypeState next = head;
+			JoinInto(next, mScopes);
+			if (next == head) {
+				mScopes = std::move(exit);
+				return;
+			}
+			mScopes = std::move(next);
+		}
+	}
+
+	void InferStmt(Stmt* stmt) {
+		switch (stmt->Type()) {
+		case NodeType::PRINT_STMT:
+			InferExpr(((PrintStmt*)stmt)->expr);
+			break;
+		case NodeType::BLOCK_STMT:
+			mScopes.emplace_back();
+			for (Stmt* s : ((BlockStmt*)stmt)->statements)
+				InferStmt(s);
+			mScopes.pop_back();
+			break;
+		case NodeType::EXPR_STMT:
+			InferExpr(((ExprStmt*)stmt)->expr);
+			break;
+		case NodeType::VAR_DECL_STMT: {
+			VarDeclStmt* s = (VarDeclStmt*)stmt;
+			i8 type = s->expr ? InferExpr(s->expr) : (i8)TYPE_NUMBER;
+			Declare(s->identifier.lexeme, type);
+			Rebind(s->identifier.lexeme, s->slot);
+			break;
+		}
+		case NodeType::IF_STMT: {
+			IfStmt* s = (IfStmt*)stmt;
+			InferExpr(s->condition);
+			TypeState before = mScopes;
+			InferStmt(s->then_branch);
+			std::swap(before, mScopes);
+			if (s->else_branch)
+				InferStmt(s->else_branch);
+			JoinInto(mScopes, before);
+			break;
+		}
+		case NodeType::WHILE_STMT:
+			InferLoop(((WhileStmt*)stmt)->condition, ((WhileStmt*)stmt)->statement, 0, 0);
+			break;
+		case NodeType::FOR_STMT: {
+			ForStmt* s = (ForStmt*)stmt;
+			mScopes.emplace_back();
+			if (s->initializer)
+				InferStmt(s->initializer);
+			InferLoop(s->condition, s->body, s->increment, 0);
+			mScopes.pop_back();
+			break;
+		}
+		case NodeType::RANGE_FOR_STMT: {
+			RangeForStmt* s = (RangeForStmt*)stmt;
+			InferExpr(s->start);
+			InferExpr(s->end);
+			if (s->step)
+				InferExpr(s->step);
+			mScopes.emplace_back();
+			// Every chunk of a parallel loop starts its reductions from a number
+			for (const Reduction& r : s->reductions) {
+				Declare(r.name.lexeme, TYPE_NUMBER);
+				Rebind(r.name.lexeme, -1);
+			}
+			Declare(s->identifier.lexeme, TYPE_NUMBER);
+			Rebind(s->identifier.lexeme, s->slot);
+			InferLoop(0, s->body, 0, &s->identifier.lexeme);
+			mScopes.pop_back();
+			for (const Reduction& r : s->reductions)
+				Set(r.name.lexeme, TYPE_NUMBER);
+			break;
+		}
+		case NodeType::FOR_IN_STMT: {
+			ForInStmt* s = (ForInStmt*)stmt;
+			InferExpr(s->collection);
+			mScopes.emplace_back();
+			Declare(s->identifier.lexeme, TYPE_UNKNOWN);
+			Rebind(s->identifier.lexeme, s->slot);
+			InferLoop(0, s->body, 0, 0);
+			mScopes.pop_back();
+			break;
+		}
+		case NodeType::BREAK_STMT:
+		case NodeType::CONTINUE_STMT:
+			if (!mLoops.empty()) {
+				Loop& loop = mLoops.back();
+				loop.jumps.emplace_back(mScopes.begin(), mScopes.begin() + loop.depth);
+			}
+			break;
+		case NodeType::FN_DECL_STMT: {
+			FnDeclStmt* s = (FnDeclStmt*)stmt;
+			Declare(s->name.lexeme, TYPE_FUNCTION);
+			Rebind(s->name.lexeme, s->slot);
+			InferFunction(s->function.Get());
+			break;
+		}
+		case NodeType::RETURN_STMT:
+			if (((ReturnStmt*)stmt)->value)
+				InferExpr(((ReturnStmt*)stmt)->value);
+			break;
+		case NodeType::IMPORT_STMT:
+			ForgetGlobals(); // The module can assign any of them
+			mImports = true;
+			break;
+		default:
+			break;
+		}
+	}
+
+	i8 InferExpr(Expr* expr) {
+		if (mExprDepth++ == 0)
+			mTemps.clear();
+		i8 type = InferNode(expr);
+		mExprDepth--;
+		expr->value_type = type;
+		return type;
+	}
+
+	i8 InferBinary(BinaryExpr* e) {
+		i8 l = InferExpr(e->left);
+		i8 r = InferExpr(e->right);
+		switch (e->op.type) {
+		case TokenType::EQUAL_EQUAL:
+		case TokenType::BANG_EQUAL:
+			return TYPE_BOOLEAN;
+		case TokenType::PLUS:
+			e->numeric = l == TYPE_NUMBER && r == TYPE_NUMBER;
+			AddSite(e);
+			// Anything but number + number or string + string is an error,
+			// so one known side decides the result
+			if (l == TYPE_NUMBER || r == TYPE_NUMBER) return TYPE_NUMBER;
+			if (l == TYPE_STRING || r == TYPE_STRING) return TYPE_STRING;
+			return TYPE_UNKNOWN;
+		case TokenType::LESS:
+		case TokenType::LESS_EQUAL:
+		case TokenType::GREATER:
+		case TokenType::GREATER_EQUAL:
+			e->numeric = l == TYPE_NUMBER && r == TYPE_NUMBER;
+			AddSite(e);
+			return TYPE_BOOLEAN;
+		default:
+			e->numeric = l == TYPE_NUMBER && r == TYPE_NUMBER;
+			AddSite(e);
+			return TYPE_NUMBER;
+		}
+	}
+
+	i8 InferUnary(UnaryExpr* e) {
+		i8 operand = InferExpr(e->expr);
+		bool step = e->op.type == TokenType::PLUS_PLUS || e->op.type == TokenType::MINUS_MINUS;
+		if (step && e->expr->Type() == NodeType::VAR_EXPR)
+			Rebind(((VarExpr*)e->expr)->identifier.lexeme, ((VarExpr*)e->expr)->slot);
+		switch (e->op.type) {
+		case TokenType::BANG:
+			return TYPE_BOOLEAN;
+		case TokenType::MINUS:
+			e->numeric = operand == TYPE_NUMBER;
+			AddSite(e);
+			return TYPE_NUMBER;
+		case TokenType::PLUS_PLUS:
+			if (e->expr->Type() != NodeType::VAR_EXPR)
+				return TYPE_UNKNOWN;
+			e->numeric = operand == TYPE_NUMBER;
+			AddSite(e);
+			Set(((VarExpr*)e->expr)->identifier.lexeme, TYPE_NUMBER);
+			return TYPE_NUMBER;
+		default:
+			return TYPE_UNKNOWN;
+		}
+	}
+
+	i8 InferNode(Expr* expr) {
+		switch (expr->Type()) {
+		case NodeType::ASSIGN_EXPR: {
+			AssignExpr* e = (AssignExpr*)expr;
+			i8 type = InferExpr(e->expr);
+			Set(e->identifier.lexeme, type);
+			Rebind(e->identifier.lexeme, e->slot);
+			return type;
+		}
+		case NodeType::IF_EXPR: {
+			IfExpr* e = (IfExpr*)expr;
+			InferExpr(e->condition);
+			TypeState before = mScopes;
+			auto temps = mTemps;
+			i8 then_type = InferExpr(e->then_branch);
+			std::swap(before, mScopes);
+			i8 else_type = InferExpr(e->else_branch);
+			JoinInto(mScopes, before);
+			mTemps = std::move(temps);
+			return Join(then_type, else_type);
+		}
+		case NodeType::LOGIC_EXPR: {
+			// The right side may not run, and either side can be the result
+			LogicExpr* e = (LogicExpr*)expr;
+			i8 left = InferExpr(e->left);
+			TypeState short_circuit = mScopes;
+			auto temps = mTemps;
+			i8 right = InferExpr(e->right);
+			JoinInto(mScopes, short_circuit);
+			mTemps = std::move(temps);
+			return Join(left, right);
+		}
+		case NodeType::BINARY_EXPR:
+			return InferBinary((BinaryExpr*)expr);
+		case NodeType::GROUP_EXPR:
+			return InferExpr(((GroupExpr*)expr)->expr);
+		case NodeType::UNARY_EXPR:
+			return InferUnary((UnaryExpr*)expr);
+		case NodeType::VAR_EXPR:
+			return Lookup(((VarExpr*)expr)->identifier.lexeme);
+		case NodeType::LITERAL_EXPR:
+			return (i8)((LiteralExpr*)expr)->value.index();
+		case NodeType::CALL_EXPR: {
+			CallExpr* e = (CallExpr*)expr;
+			InferExpr(e->callee);
+			for (Expr* arg : e->arguments)
+				InferExpr(arg);
+			if (mBound && e->builtin)
+				return e->builtin->type;
+			e->builtin = 0; // From an earlier run, over statements since edited around it
+			if (!mBound && e->callee->Type() == NodeType::VAR_EXPR && ((VarExpr*)e->callee)->slot < 0)
+				mCalls.push_back(e);
+			ForgetGlobals();
+			mTemps.clear();
+			return TYPE_UNKNOWN;
+		}
+		case NodeType::MAP_EXPR: {
+			MapExpr* e = (MapExpr*)expr;
+			for (u32 i = 0; i < e->keys.size(); i++) {
+				InferExpr(e->keys[i]);
+				InferExpr(e->values[i]);
+			}
+			return TYPE_MAP;
+		}
+		case NodeType::SPAWN_EXPR: {
+			// The task runs on a copy, so it can't change what's known here
+			SpawnExpr* e = (SpawnExpr*)expr;
+			if (e->call) {
+				InferExpr(e->call->callee);
+				for (Expr* arg : e->call->arguments)
+					InferExpr(arg);
+			}
+			else {
+				TypeState before = mScopes;
+				auto temps = mTemps;
+				u32 depth = mExprDepth;
+				mExprDepth = 0; // Its statements are expressions of their own
+				InferStmt(e->block);
+				mExprDepth = depth;
+				mScopes = std::move(before);
+				mTemps = std::move(temps);
+			}
+			return TYPE_TASK;
+		}
+		// Only in a restored snapshot, which was simplified before it was saved
+		case NodeType::REDUCED_EXPR:
+			if (InferExpr(((ReducedExpr*)expr)->expr) != TYPE_NUMBER)
+				unproven = true;
+			return TYPE_NUMBER;
+		case NodeType::CSE_DEF_EXPR: {
+			CseDefExpr* e = (CseDefExpr*)expr;
+			return mTemps[e->temp] = InferExpr(e->expr);
+		}
+		case NodeType::CSE_USE_EXPR: {
+			auto iter = mTemps.find(((CseUseExpr*)expr)->temp);
+			return iter == mTemps.end() ? (i8)TYPE_UNKNOWN : iter->second;
+		}
+		default:
+			return TYPE_UNKNOWN;
+		}
+	}
+};
+
+#endif
@@ -7,6 +7,8 @@
 #include <unordered_map>
 #include <memory>
 #include <variant>
+#include <charconv>
+#include "output.h"
 
 typedef int8_t i8;
 typedef uint8_t u8;
@@ -17,34 +19,98 @@ typedef uint32_t u32;
 typedef int64_t i64;
 typedef uint64_t u64;
 
+#include "heap.h"
+
 void GenericError(const std::string &message) {
+	output.Flush();
 	std::cout << "Error: " << message << "\n";
 }
+// Set while a script runs as a green thread (scheduler.h), so a runtime
+// error ends only that script. It doesn't return.
+thread_local void (*end_script)() = 0;
+thread_local const char* script_name = 0; // Of that script, for its errors
+// Gets the error instead of stdout, when set by an embedding program (bomac.cpp)
+thread_local std::string* error_message = 0;
 void ErrorRT(u16 line, const std::string &message) {
-	std::cout << "Runtime error on line " << line << ": " << message << "\n";
+	output.Flush();
+	if (error_message)
+		*error_message = "Runtime error on line " + std::to_string(line) + ": " + message;
+	else {
+		if (script_name) std::cout << script_name << ": ";
+		std::cout << "Runtime error on line " << line << ": " << message << "\n";
+	}
+	if (end_script) end_script();
 	exit(0);
 }
 
-using Object = std::variant<bool, float, std::string>;
+// Object itself is in heap.h, next to the types it holds
 enum {
 	TYPE_BOOLEAN = 0,
 	TYPE_NUMBER,
-	TYPE_STRING
+	TYPE_STRING,
+	TYPE_FUNCTION,
+	TYPE_TASK,
+	TYPE_CHANNEL,
+	TYPE_MAP,
+	TYPE_FILE,
+	TYPE_UNKNOWN = -1 // Static types only, no Object holds it
 };
+Object MakeString(std::string value) {
+	return Object(Ref<StringObj>(heap.New<StringObj>(std::move(value))));
+}
+const std::string& ObjStr(const Object& obj) {
+	return std::get<TYPE_STRING>(obj)->value;
+}
+// For values already known to be numbers; skips the index check std::get does
+float ObjNum(const Object& obj) {
+	return *std::get_if<TYPE_NUMBER>(&obj);
+}
+
+std::string NumberToStr(float number) {
+	char buffer[OutputBuffer::MAX_NUMBER_CHARS];
+	return std::string(buffer, OutputBuffer::FormatNumber(buffer, buffer + sizeof(buffer), number));
+}
+std::string MapToStr(MapObj* map); // In map.h
 std::string ObjToStr(const Object& obj) {
 	switch (obj.index()) {
 	case TYPE_BOOLEAN:
 		return (std::get<bool>(obj) ? "true" : "false");
 	case TYPE_NUMBER:
-		return std::to_string(std::get<float>(obj));
+		return NumberToStr(std::get<float>(obj));
 	case TYPE_STRING:
-		return std::get<std::string>(obj);
+		return ObjStr(obj);
+	case TYPE_FUNCTION:
+		return "<fn " + std::get<TYPE_FUNCTION>(obj)->name + ">";
+	case TYPE_TASK:
+		return "<task>";
+	case TYPE_CHANNEL:
+		return "<channel>";
+	case TYPE_MAP:
+		return MapToStr(std::get<TYPE_MAP>(obj).Get());
+	case TYPE_FILE:
+		return "<file>";
 	default:
 		return "Internal error in ObjToStr.\n";
 	}
 }
-
-class BreakException : public std::exception {};
-class ContinueException : public std::exception {};
+// Same text as ObjToStr, written straight into the output buffer
+void PrintObj(const Object& obj) {
+	switch (obj.index()) {
+	case TYPE_BOOLEAN:
+		if (std::get<bool>(obj)) output.Write("true", 4);
+		else output.Write("false", 5);
+		break;
+	case TYPE_NUMBER:
+		output.WriteNumber(std::get<float>(obj));
+		break;
+	case TYPE_STRING:
+		output.Write(ObjStr(obj));
+		break;
+	default:
+		output.Write(ObjToStr(obj));
+		break;
+	}
+	output.Put('\n');
+}
 
 #endif
\ No newline at end of file
@@ -0,0 +1,465 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "util.h"
+#include "lexer.h"
+#include "parser.h"
+#include "types.h"
+#include "simplify.h"
+#include "closure.h"
+#include "pool.h"
+#include "server.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <unordered_set>
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+/*
+--watch <script> runs the script, then runs it again every time the file
+changes. Between runs only the edited part of the file is lexed and parsed
+again: top-level statements that lie entirely before or after the edit are
+kept, with the line numbers of the ones after it moved by however many
+lines the edit added or removed. An edit that adds or removes a function,
+an import or a variable a 'memo' function relies on, or assigns to one,
+parses the whole file again, since the checks on those look at all of it.
+
+The kept statements are never type checked, simplified or run in this
+process, since all of those change them. Each run happens in a forked child
+that does that work on its own copy.
+*/
+
+void ShiftLines(Expr* expr, i32 delta);
+void ShiftLines(Stmt* stmt, i32 delta);
+
+void ShiftLines(Expr* expr, i32 delta) {
+	if (!expr) return;
+	switch (expr->Type()) {
+	case NodeType::ASSIGN_EXPR:
+		((AssignExpr*)expr)->identifier.line += delta;
+		ShiftLines(((AssignExpr*)expr)->expr, delta);
+		break;
+	case NodeType::IF_EXPR: {
+		IfExpr* e = (IfExpr*)expr;
+		ShiftLines(e->condition, delta);
+		ShiftLines(e->then_branch, delta);
+		ShiftLines(e->else_branch, delta);
+		break;
+	}
+	case NodeType::LOGIC_EXPR: {
+		LogicExpr* e = (LogicExpr*)expr;
+		e->op.line += delta;
+		ShiftLines(e->left, delta);
+		ShiftLines(e->right, delta);
+		break;
+	}
+	case NodeType::BINARY_EXPR: {
+		BinaryExpr* e = (BinaryExpr*)expr;
+		e->op.line += delta;
+		ShiftLines(e->left, delta);
+		ShiftLines(e->right, delta);
+		break;
+	}
+	case NodeType::GROUP_EXPR:
+		ShiftLines(((GroupExpr*)expr)->expr, delta);
+		break;
+	case NodeType::UNARY_EXPR:
+		((UnaryExpr*)expr)->op.line += delta;
+		ShiftLines(((UnaryExpr*)expr)->expr, delta);
+		break;
+	case NodeType::VAR_EXPR:
+		((VarExpr*)expr)->identifier.line += delta;
+		break;
+	case NodeType::CALL_EXPR: {
+		CallExpr* e = (CallExpr*)expr;
+		e->paren.line += delta;
+		ShiftLines(e->callee, delta);
+		for (Expr* arg : e->arguments)
+			ShiftLines(arg, delta);
+		break;
+	}
+	case NodeType::SPAWN_EXPR: {
+		SpawnExpr* e = (SpawnExpr*)expr;
+		e->keyword.line += delta;
+		ShiftLines(e->call, delta);
+		ShiftLines(e->block, delta);
+		break;
+	}
+	case NodeType::MAP_EXPR: {
+		MapExpr* e = (MapExpr*)expr;
+		e->brace.line += delta;
+		for (u32 i = 0; i < e->keys.size(); i++) {
+			ShiftLines(e->keys[i], delta);
+			ShiftLines(e->values[i], delta);
+		}
+		break;
+	}
+	case NodeType::REDUCED_EXPR:
+		ShiftLines(((ReducedExpr*)expr)->expr, delta);
+		break;
+	case NodeType::CSE_DEF_EXPR:
+		ShiftLines(((CseDefExpr*)expr)->expr, delta);
+		break;
+	default:
+		break;
+	}
+}
+
+void ShiftLines(Stmt* stmt, i32 delta) {
+	if (!stmt) return;
+	switch (stmt->Type()) {
+	case NodeType::PRINT_STMT:
+		ShiftLines(((PrintStmt*)stmt)->expr, delta);
+		break;
+	case NodeType::EXPR_STMT:
+		ShiftLines(((ExprStmt*)stmt)->expr, delta);
+		break;
+	case NodeType::BLOCK_STMT:
+		for (Stmt* s : ((BlockStmt*)stmt)->statements)
+			ShiftLines(s, delta);
+		break;
+	case NodeType::VAR_DECL_STMT:
+		((VarDeclStmt*)stmt)->identifier.line += delta;
+		ShiftLines(((VarDeclStmt*)stmt)->expr, delta);
+		break;
+	case NodeType::IF_STMT: {
+		IfStmt* s = (IfStmt*)stmt;
+		ShiftLines(s->condition, delta);
+		ShiftLines(s->then_branch, delta);
+		ShiftLines(s->else_branch, delta);
+		break;
+	}
+	case NodeType::WHILE_STMT:
+		ShiftLines(((WhileStmt*)stmt)->condition, delta);
+		ShiftLines(((WhileStmt*)stmt)->statement, delta);
+		break;
+	case NodeType::FOR_STMT: {
+		ForStmt* s = (ForStmt*)stmt;
+		if (s->counted)
+			s->counter.line += delta; // 'limit' is part of the condition
+		ShiftLines(s->initializer, delta);
+		ShiftLines(s->condition, delta);
+		ShiftLines(s->increment, delta);
+		ShiftLines(s->body, delta);
+		break;
+	}
+	case NodeType::RANGE_FOR_STMT: {
+		RangeForStmt* s = (RangeForStmt*)stmt;
+		s->identifier.line += delta;
+		for (Reduction& r : s->reductions)
+			r.name.line += delta;
+		ShiftLines(s->start, delta);
+		ShiftLines(s->end, delta);
+		ShiftLines(s->step, delta);
+		ShiftLines(s->body, delta);
+		break;
+	}
+	case NodeType::FOR_IN_STMT: {
+		ForInStmt* s = (ForInStmt*)stmt;
+		s->identifier.line += delta;
+		ShiftLines(s->collection, delta);
+		ShiftLines(s->body, delta);
+		break;
+	}
+	case NodeType::FN_DECL_STMT: {
+		FnDeclStmt* s = (FnDeclStmt*)stmt;
+		s->name.line += delta;
+		for (Stmt* body : s->function->body)
+			ShiftLines(body, delta);
+		break;
+	}
+	case NodeType::RETURN_STMT:
+		((ReturnStmt*)stmt)->keyword.line += delta;
+		ShiftLines(((ReturnStmt*)stmt)->value, delta);
+		break;
+	case NodeType::IMPORT_STMT:
+		((ImportStmt*)stmt)->keyword.line += delta;
+		break;
+	case NodeType::SNAPSHOT_STMT:
+		((SnapshotStmt*)stmt)->keyword.line += delta;
+		break;
+	default:
+		break;
+	}
+}
+
+// The last program that lexed and parsed cleanly, and where each of its
+// top-level statements came from in the source
+class IncrementalParser {
+public:
+	std::vector<Stmt*> statements;
+	u32 reused = 0; // Statements kept by the last Update()
+	u64 tokens = 0; // Tokens lexed by the last Update()
+	std::string directory; // For the parser
+
+	~IncrementalParser() {
+		Destroy(0, statements.size());
+	}
+	// Returns false, after printing the errors, if 'source' doesn't parse;
+	// the previous program is kept
+	bool Update(const std::string& source) {
+		if (statements.empty())
+			return Full(source);
+
+		// The edit is whatever lies between the common prefix and suffix
+		u32 old_size = mSource.size(), new_size = source.size();
+		u32 prefix = 0, suffix = 0;
+		u32 limit = std::min(old_size, new_size);
+		while (prefix < limit && mSource[prefix] == source[prefix]) prefix++;
+		while (suffix < limit - prefix && mSource[old_size - 1 - suffix] == source[new_size - 1 - suffix]) suffix++;
+		i32 delta = (i32)new_size - (i32)old_size;
+		i32 line_delta = (i32)std::count(source.begin() + prefix, source.end() - suffix, '\n') -
+			(i32)std::count(mSource.begin() + prefix, mSource.end() - suffix, '\n');
+
+		u32 count = statements.size();
+		u32 kept = 0; // Statements before the edit
+		while (kept < count && mSpans[kept].end <= prefix) kept++;
+		u32 next = kept; // First statement after it
+		while (next < count && mSpans[next].begin < old_size - suffix) next++;
+
+		// Lex from the end of the last kept statement until a token boundary
+		// lines up with the start of a statement after the edit. A token that
+		// runs past one, like a newly unterminated string, moves on to the next.
+		u32 begin = kept ? mSpans[kept - 1].end : 0;
+		u32 line = kept ? mSpans[kept - 1].end_line : 1;
+		std::ostringstream errors;
+		Lexer lexer;
+		lexer.errors = &errors;
+		lexer.Begin(source, begin, line);
+		while (true) {
+			u32 stop = next < count ? mSpans[next].begin + delta : new_size;
+			u32 reached = lexer.ScanUntil(stop);
+			if (reached == stop) break;
+			while (next < count && mSpans[next].begin + delta < reached) next++;
+			if (reached >= new_size) break;
+		}
+		lexer.End();
+		tokens = lexer.tokens.size();
+
+		// Errors in the middle may only be errors without the code around it,
+		// so they are checked again against the whole file
+		if (lexer.HadError())
+			return Full(source);
+		std::streambuf* prev = std::cout.rdbuf(errors.rdbuf());
+		Parser parser;
+		parser.directory = directory;
+		parser.Parse(lexer.tokens);
+		std::cout.rdbuf(prev);
+		if (parser.HadError() || Declares(statements.begin() + kept, statements.begin() + next) ||
+				Declares(parser.statements.begin(), parser.statements.end()) || Assigns(lexer.tokens)) {
+			Destroy(parser.statements);
+			return Full(source);
+		}
+
+		std::vector<Span> spans = Spans(parser, lexer.tokens);
+		Destroy(kept, next);
+		for (u32 i = next; i < count; i++) {
+			mSpans[i].begin += delta;
+			mSpans[i].end += delta;
+			mSpans[i].end_line += line_delta;
+			if (line_delta)
+				ShiftLines(statements[i], line_delta);
+		}
+		statements.erase(statements.begin() + kept, statements.begin() + next);
+		statements.insert(statements.begin() + kept, parser.statements.begin(), parser.statements.end());
+		mSpans.erase(mSpans.begin() + kept, mSpans.begin() + next);
+		mSpans.insert(mSpans.begin() + kept, spans.begin(), spans.end());
+		mSource = source;
+		reused = count - (next - kept);
+		return true;
+	}
+private:
+	struct Span {
+		u32 begin = 0, end = 0; // Offsets of the first and one past the last character
+		u32 end_line = 0;
+	};
+	std::string mSource;
+	std::vector<Span> mSpans;
+	std::unordered_set<std::string> mReliedOn; // By 'memo' functions
+
+	// Whether any of these statements is checked against the whole program:
+	// functions and imports, which decide what 'memo' functions may rely on,
+	// and variables one already relies on
+	bool Declares(std::vector<Stmt*>::iterator first, std::vector<Stmt*>::iterator last) {
+		for (; first != last; ++first) {
+			NodeType type = (*first)->Type();
+			if (type == NodeType::FN_DECL_STMT || type == NodeType::IMPORT_STMT)
+				return true;
+			if (type == NodeType::VAR_DECL_STMT && mReliedOn.count(((VarDeclStmt*)*first)->identifier.lexeme))
+				return true;
+		}
+		return false;
+	}
+	// Whether the edited part assigns to a name a 'memo' function relies
+	// on, anywhere, even inside functions. A local of that name is let
+	// through by the parser, so that only costs a full parse.
+	bool Assigns(const std::vector<Token>& tokens) {
+		for (u32 i = 0; i < tokens.size(); i++) {
+			if (tokens[i].type != TokenType::IDENTIFIER || !mReliedOn.count(tokens[i].lexeme)) continue;
+			TokenType prev = i > 0 ? tokens[i - 1].type : TokenType::EOF;
+			TokenType next = i + 1 < tokens.size() ? tokens[i + 1].type : TokenType::EOF;
+			if (next == TokenType::EQUAL || next == TokenType::PLUS_PLUS || next == TokenType::MINUS_MINUS ||
+					prev == TokenType::PLUS_PLUS || prev == TokenType::MINUS_MINUS)
+				return true;
+		}
+		return false;
+	}
+
+	bool Full(const std::string& source) {
+		Lexer lexer;
+		Parser parser;
+		parser.directory = directory;
+		lexer.Lex(source);
+		tokens = lexer.tokens.size();
+		if (lexer.HadError())
+			return false;
+		parser.Parse(lexer.tokens);
+		if (parser.HadError()) {
+			Destroy(parser.statements);
+			return false;
+		}
+		Destroy(0, statements.size());
+		statements = parser.statements;
+		mSpans = Spans(parser, lexer.tokens);
+		mReliedOn.clear();
+		for (auto& relied : parser.MemoReliedOn())
+			mReliedOn.insert(relied.first);
+		mSource = source;
+		reused = 0;
+		return true;
+	}
+	static std::vector<Span> Spans(Parser& parser, const std::vector<Token>& tokens) {
+		std::vector<Span> spans;
+		for (auto& range : parser.ranges) {
+			const Token& last = tokens[range.second - 1];
+			Span span;
+			span.begin = tokens[range.first].offset;
+			span.end = last.offset + last.lexeme.size();
+			span.end_line = last.line;
+			spans.push_back(span);
+		}
+		return spans;
+	}
+	void Destroy(u32 first, u32 last) {
+		for (u32 i = first; i < last; i++) {
+			statements[i]->Destroy();
+			delete statements[i];
+		}
+	}
+	static void Destroy(std::vector<Stmt*>& list) {
+		for (Stmt* stmt : list) {
+			stmt->Destroy();
+			delete stmt;
+		}
+	}
+};
+
+#ifndef _WIN32
+
+class Watcher {
+public:
+	Watcher(const char* path, RunOptions options) : mPath(path), mOptions(options) {
+		mProgram.directory = DirectoryOf(path);
+	}
+	i32 Run() {
+		value_stack.resize(STACK_SIZE); // Shared with every child, as in Server
+		while (true) {
+			struct stat info;
+			if (stat(mPath, &info) == 0 && (info.st_mtime != mMtime || info.st_size != mSize || Recent(info))) {
+				mMtime = info.st_mtime;
+				mSize = info.st_size;
+				std::string source;
+				if (Read(source) && source != mLast) {
+					mLast = source;
+					Rerun(source);
+				}
+			}
+			usleep(POLL_US);
+		}
+	}
+private:
+	const char* mPath;
+	RunOptions mOptions;
+	IncrementalParser mProgram;
+	std::string mLast;
+	time_t mMtime = 0;
+	off_t mSize = -1;
+	static const u32 POLL_US = 50000;
+
+	// mtime only has whole seconds, so a file saved twice within one second
+	// at the same size is read again until that second is over
+	static bool Recent(const struct stat& info) {
+		return time(0) - info.st_mtime <= 1;
+	}
+	bool Read(std::string& source) {
+		std::ifstream file(mPath);
+		if (!file.is_open()) return false;
+		std::string line;
+		while (std::getline(file, line))
+			source += line + "\n";
+		return true;
+	}
+	void Rerun(const std::string& source) {
+		auto start = std::chrono::steady_clock::now();
+		bool parsed = mProgram.Update(source);
+		double parse_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		if (!parsed) {
+			fprintf(stderr, "[watch] %s: errors, %.3f ms; waiting for changes\n", mPath, parse_ms);
+			return;
+		}
+		fprintf(stderr, "[watch] %s: reused %u of %zu statements, %llu tokens lexed, %.3f ms\n",
+			mPath, mProgram.reused, mProgram.statements.size(), (unsigned long long)mProgram.tokens, parse_ms);
+		modules.Preload(mProgram.statements); // Kept for the next run, unless they change
+		std::cout.flush();
+		pid_t pid = fork();
+		if (pid == 0) {
+			std::vector<Stmt*>& statements = mProgram.statements;
+			TypeInference().Run(statements);
+			if (mOptions.simplify)
+				Simplifier(mOptions.cse).Run(statements);
+			ClosureCompiler compiler;
+			if (mOptions.use_closures && compiler.Compile(statements))
+				compiler.Run();
+			else
+				for (Stmt* stmt : statements)
+					stmt->Evaluate();
+			ThreadPool::Drain();
+			output.Flush();
+			std::cout.flush();
+			_exit(0);
+		}
+		if (pid < 0) {
+			GenericError("Could not start the script.");
+			return;
+		}
+		int status = 0;
+		waitpid(pid, &status, 0);
+		double total_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		fprintf(stderr, "[watch] %s: finished in %.3f ms", mPath, total_ms);
+		if (WIFSIGNALED(status))
+			fprintf(stderr, ", killed by signal %d", WTERMSIG(status));
+		fprintf(stderr, "\n");
+	}
+};
+
+i32 Watch(const char* path, RunOptions options) {
+	Watcher watcher(path, options);
+	return watcher.Run();
+}
+
+#else
+
+i32 Watch(const char* path, RunOptions options) {
+	GenericError("--watch needs fork(), which this platform doesn't have.");
+	return 1;
+}
+
+#endif
+
+#endif